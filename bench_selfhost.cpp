@@ -0,0 +1,667 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <chrono>
+#include <algorithm>
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <csetjmp>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <jpeglib.h>
+#include <png.h>
+#include <tiffio.h>
+
+#include "config.hpp"
+#include "simpic_client.hpp"
+#include "simpic_plugins.hpp"
+
+/* End to end over the self-hosted server: writes a deterministic corpus of images in groups of near-duplicates of one */
+/* another (rescaled, recompressed, cropped, and in other formats), along with unrelated singletons, then scans it once */
+/* per maximum hamming distance and reports how long the scan and the transfer of the sets took, the peak memory of the */
+/* client and of the server, and the precision and recall of the sets against the groups the corpus was made in. */
+
+/* Written into the corpus directory; if it matches, the corpus is reused. */
+#define BENCH_MANIFEST ".bench_corpus"
+
+/* How long the server gets to start listening. */
+#define BENCH_SERVER_WAIT 30
+
+using namespace SimpicClientLib;
+
+enum class Variants
+{
+    Original, // JPEG, quality 92.
+    Rescaled, // to 60%, JPEG quality 85.
+    Recompressed, // JPEG quality 35.
+    Cropped, // 6% off every side, JPEG quality 85.
+    Png,
+    Tiff,
+    Count
+};
+
+static const char *variant_names[] = { "original", "rescaled", "recompressed", "cropped", "png", "tiff" };
+
+struct RgbImage
+{
+    int width;
+    int height;
+    std::vector<uint8_t> pixels; // RGB, row after row.
+};
+
+static uint64_t splitmix64(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t &state)
+{
+    return (splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* A picture with some structure to it, so that its perceptual hash means something: a gradient, soft-edged ellipses */
+/* and a faint ripple, all from the seed. */
+static RgbImage generate(uint64_t seed, int width, int height)
+{
+    RgbImage img;
+    img.width = width;
+    img.height = height;
+    img.pixels.resize((size_t) width * height * 3);
+
+    uint64_t state = seed;
+    double from[3], to[3];
+
+    for (int c = 0; c < 3; c++)
+    {
+        from[c] = uniform(state) * 255;
+        to[c] = uniform(state) * 255;
+    }
+
+    struct Ellipse { double x, y, rx, ry, color[3]; };
+    std::vector<Ellipse> ellipses(12);
+
+    for (Ellipse &e : ellipses)
+    {
+        e.x = uniform(state) * width;
+        e.y = uniform(state) * height;
+        e.rx = (0.05 + uniform(state) * 0.25) * width;
+        e.ry = (0.05 + uniform(state) * 0.25) * height;
+
+        for (int c = 0; c < 3; c++)
+            e.color[c] = uniform(state) * 255;
+    }
+
+    double fx = 2 + uniform(state) * 6;
+    double fy = 2 + uniform(state) * 6;
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            double t = (double) (x + y) / (width + height);
+            double px[3];
+
+            for (int c = 0; c < 3; c++)
+                px[c] = from[c] + (to[c] - from[c]) * t;
+
+            for (Ellipse &e : ellipses)
+            {
+                double dx = (x - e.x) / e.rx;
+                double dy = (y - e.y) / e.ry;
+                double d = dx * dx + dy * dy;
+
+                if (d >= 1.2)
+                    continue;
+
+                double alpha = d < 0.8 ? 0.85 : 0.85 * (1.2 - d) / 0.4;
+
+                for (int c = 0; c < 3; c++)
+                    px[c] = px[c] * (1 - alpha) + e.color[c] * alpha;
+            }
+
+            double ripple = 12 * std::sin(fx * M_PI * x / width) * std::sin(fy * M_PI * y / height);
+            uint8_t *out = &img.pixels[((size_t) y * width + x) * 3];
+
+            for (int c = 0; c < 3; c++)
+                out[c] = (uint8_t) std::clamp(px[c] + ripple, 0.0, 255.0);
+        }
+    }
+
+    return img;
+}
+
+static RgbImage rescale(const RgbImage &in, double factor)
+{
+    RgbImage out;
+    out.width = std::max(1, (int) (in.width * factor));
+    out.height = std::max(1, (int) (in.height * factor));
+    out.pixels.resize((size_t) out.width * out.height * 3);
+
+    /* Bilinear. */
+    for (int y = 0; y < out.height; y++)
+    {
+        double sy = std::min((y + 0.5) / factor - 0.5, in.height - 1.0);
+        int y0 = std::max(0, (int) sy);
+        int y1 = std::min(in.height - 1, y0 + 1);
+        double wy = std::max(0.0, sy - y0);
+
+        for (int x = 0; x < out.width; x++)
+        {
+            double sx = std::min((x + 0.5) / factor - 0.5, in.width - 1.0);
+            int x0 = std::max(0, (int) sx);
+            int x1 = std::min(in.width - 1, x0 + 1);
+            double wx = std::max(0.0, sx - x0);
+
+            for (int c = 0; c < 3; c++)
+            {
+                double a = in.pixels[((size_t) y0 * in.width + x0) * 3 + c] * (1 - wx) + in.pixels[((size_t) y0 * in.width + x1) * 3 + c] * wx;
+                double b = in.pixels[((size_t) y1 * in.width + x0) * 3 + c] * (1 - wx) + in.pixels[((size_t) y1 * in.width + x1) * 3 + c] * wx;
+                out.pixels[((size_t) y * out.width + x) * 3 + c] = (uint8_t) (a * (1 - wy) + b * wy + 0.5);
+            }
+        }
+    }
+
+    return out;
+}
+
+static RgbImage crop(const RgbImage &in, double margin)
+{
+    int left = in.width * margin;
+    int top = in.height * margin;
+
+    RgbImage out;
+    out.width = in.width - 2 * left;
+    out.height = in.height - 2 * top;
+    out.pixels.resize((size_t) out.width * out.height * 3);
+
+    for (int y = 0; y < out.height; y++)
+        std::memcpy(&out.pixels[(size_t) y * out.width * 3], &in.pixels[((size_t) (y + top) * in.width + left) * 3], (size_t) out.width * 3);
+
+    return out;
+}
+
+/* libjpeg's default error handler calls exit(); jump back out instead, as the decoder does. */
+struct jpeg_error_jump
+{
+    struct jpeg_error_mgr mgr;
+    std::jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_error_jump *err = (struct jpeg_error_jump*) cinfo->err;
+    std::longjmp(err->jump, 1);
+}
+
+static bool write_jpeg(const std::string &path, const RgbImage &img, int quality)
+{
+    FILE *out = std::fopen(path.c_str(), "wb");
+
+    if (out == nullptr)
+        return false;
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_jump err;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        std::fclose(out);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, out);
+
+    cinfo.image_width = img.width;
+    cinfo.image_height = img.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = (JSAMPROW) &img.pixels[(size_t) cinfo.next_scanline * img.width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return !std::fclose(out);
+}
+
+static bool write_png(const std::string &path, const RgbImage &img)
+{
+    png_image image;
+    std::memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    image.width = img.width;
+    image.height = img.height;
+    image.format = PNG_FORMAT_RGB;
+
+    return png_image_write_to_file(&image, path.c_str(), 0, img.pixels.data(), 0, nullptr);
+}
+
+static bool write_tiff(const std::string &path, const RgbImage &img)
+{
+    TIFF *tif = TIFFOpen(path.c_str(), "w");
+
+    if (tif == nullptr)
+        return false;
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, img.width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, img.height);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+
+    bool ok = true;
+
+    for (int y = 0; y < img.height && ok; y++)
+        ok = TIFFWriteScanline(tif, (void*) &img.pixels[(size_t) y * img.width * 3], y, 0) >= 0;
+
+    TIFFClose(tif);
+    return ok;
+}
+
+struct CorpusFile
+{
+    std::string name;
+    uint32_t group;
+};
+
+/* Every third group is a singleton, with nothing like it; the rest have one file of every variant. */
+static std::vector<CorpusFile> plan(uint32_t images)
+{
+    std::vector<CorpusFile> files;
+    const char *extensions[] = { "jpg", "jpg", "jpg", "jpg", "png", "tif" };
+
+    for (uint32_t group = 0; files.size() < images; group++)
+    {
+        int variants = group % 3 == 2 ? 1 : (int) Variants::Count;
+
+        for (int v = 0; v < variants && files.size() < images; v++)
+        {
+            char name[64];
+            std::snprintf(name, sizeof(name), "g%06u_%s.%s", group, variant_names[v], extensions[v]);
+            files.push_back(CorpusFile{name, group});
+        }
+    }
+
+    return files;
+}
+
+static bool write_variant(const std::string &path, const RgbImage &original, Variants variant)
+{
+    switch (variant)
+    {
+        case Variants::Original:
+            return write_jpeg(path, original, 92);
+
+        case Variants::Rescaled:
+            return write_jpeg(path, rescale(original, 0.6), 85);
+
+        case Variants::Recompressed:
+            return write_jpeg(path, original, 35);
+
+        case Variants::Cropped:
+            return write_jpeg(path, crop(original, 0.06), 85);
+
+        case Variants::Png:
+            return write_png(path, original);
+
+        case Variants::Tiff:
+            return write_tiff(path, original);
+
+        default:
+            return false;
+    }
+}
+
+static bool make_corpus(const std::string &directory, std::vector<CorpusFile> &files, std::vector<std::pair<int, int>> &sizes)
+{
+    std::string description = std::to_string(files.size());
+
+    for (auto &size : sizes)
+        description += " " + std::to_string(size.first) + "x" + std::to_string(size.second);
+
+    std::string manifest = directory + "/" + BENCH_MANIFEST;
+    std::ifstream in(manifest);
+    std::string line;
+
+    if (in && std::getline(in, line) && line == description)
+    {
+        std::cout << "Reusing the corpus in " << directory << "\n";
+        return true;
+    }
+
+    /* A corpus of other parameters: clear out what it wrote, and nothing else. */
+    while (in && std::getline(in, line))
+        unlink((directory + "/" + line).c_str());
+
+    in.close();
+    mkdir(directory.c_str(), 0755);
+
+    std::cout << "Writing " << files.size() << " images to " << directory << "...\n";
+
+    uint32_t group = (uint32_t) -1;
+    RgbImage original;
+    size_t variant = 0;
+
+    for (CorpusFile &file : files)
+    {
+        if (file.group != group)
+        {
+            group = file.group;
+            auto &size = sizes[group % sizes.size()];
+            original = generate(0x5eed0000ULL + group, size.first, size.second);
+            variant = 0;
+        }
+
+        if (!write_variant(directory + "/" + file.name, original, (Variants) variant++))
+        {
+            std::cerr << "Could not write " << directory << "/" << file.name << "\n";
+            return false;
+        }
+    }
+
+    std::ofstream out(manifest, std::ios::trunc);
+    out << description << "\n";
+
+    for (CorpusFile &file : files)
+        out << file.name << "\n";
+
+    return (bool) out;
+}
+
+static bool wait_for_server()
+{
+    for (int i = 0; i < BENCH_SERVER_WAIT * 10; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(MOCK_PORT);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        bool up = connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+        close(fd);
+
+        if (up)
+            return true;
+
+        usleep(100000);
+    }
+
+    return false;
+}
+
+/* Start the server's high-water mark over from what it uses now, so that each run reports a peak of its own. */
+static void reset_peak(pid_t pid)
+{
+    std::ofstream clear("/proc/" + std::to_string(pid) + "/clear_refs");
+    clear << "5";
+}
+
+/* The server's high-water mark, in kB. */
+static long server_peak(pid_t pid)
+{
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+
+    while (std::getline(status, line))
+        if (!line.compare(0, 6, "VmHWM:"))
+            return std::atol(line.c_str() + 6);
+
+    return 0;
+}
+
+static void run(const std::string &directory, std::map<std::string, uint32_t> &groups, uint64_t truth_pairs, uint8_t max_ham, pid_t server)
+{
+    std::string address = "127.0.0.1";
+    std::string path = directory;
+    SimpicClient client(address, MOCK_PORT);
+
+    std::map<std::string, uint32_t> ids;
+    std::set<std::pair<uint32_t, uint32_t>> pairs;
+    std::vector<uint32_t> set;
+    uint64_t bytes = 0;
+    bool in_set = false;
+
+    reset_peak(server);
+
+    auto start = std::chrono::steady_clock::now();
+    auto scanned = start;
+    bool results = false;
+
+    try
+    {
+        client.make_connection();
+        client.set_no_data(false);
+
+        client.request(path, false, max_ham, (uint8_t) DataTypes::Image, [&](void *data, DataTypes type) -> void {
+            if (type == DataTypes::Update)
+                return;
+
+            /* The server is done scanning once it starts sending sets. */
+            if (!results)
+            {
+                scanned = std::chrono::steady_clock::now();
+                results = true;
+            }
+
+            if (data == nullptr)
+            {
+                if (in_set)
+                {
+                    for (size_t i = 0; i < set.size(); i++)
+                        for (size_t j = i + 1; j < set.size(); j++)
+                            pairs.insert(std::minmax(set[i], set[j]));
+
+                    set.clear();
+                    client.keep(false);
+                }
+
+                in_set = !in_set;
+                return;
+            }
+
+            Media *media = (Media*) data;
+            bytes += media->length;
+            set.push_back(ids.emplace(media->filename, ids.size()).first->second);
+        });
+
+        client.close();
+    }
+    catch (NoResultsException &ex)
+    {
+        client.close();
+    }
+    catch (simpic_networking_exception &ex)
+    {
+        std::cerr << "max_ham " << (int) max_ham << ": " << ex.what() << "\n";
+        return;
+    }
+    catch (ErrnoException &ex)
+    {
+        std::cerr << "max_ham " << (int) max_ham << ": " << ex.what() << "\n";
+        return;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    if (!results)
+        scanned = end;
+
+    /* Pairs of files put in a set together, against pairs of files made from the same picture. */
+    std::vector<std::string> names(ids.size());
+
+    for (auto &id : ids)
+        names[id.second] = id.first;
+
+    uint64_t true_pairs = 0;
+
+    for (auto &pair : pairs)
+    {
+        auto a = groups.find(names[pair.first]);
+        auto b = groups.find(names[pair.second]);
+
+        if (a != groups.end() && b != groups.end() && a->second == b->second)
+            true_pairs++;
+    }
+
+    double precision = pairs.empty() ? 1.0 : (double) true_pairs / pairs.size();
+    double recall = truth_pairs ? (double) true_pairs / truth_pairs : 1.0;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::printf("%7d  %8.3fs  %8.3fs  %8.1f MB  %9ld kB  %9ld kB  %9.3f  %6.3f\n", max_ham,
+                    std::chrono::duration<double>(scanned - start).count(), std::chrono::duration<double>(end - scanned).count(),
+                    bytes / (double) (1 << 20), usage.ru_maxrss, server_peak(server), precision, recall);
+}
+
+static std::vector<std::string> split(const std::string &str, char by)
+{
+    std::vector<std::string> parts;
+    std::stringstream ss(str);
+    std::string part;
+
+    while (std::getline(ss, part, by))
+        if (!part.empty())
+            parts.push_back(part);
+
+    return parts;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t images = argc > 1 ? std::atoi(argv[1]) : 240;
+    std::string size_list = argc > 2 ? argv[2] : "640x480,1600x1200";
+    std::string ham_list = argc > 3 ? argv[3] : "0,2,4,8,12";
+    std::string directory = argc > 4 ? argv[4] : "/tmp/simpic_bench_corpus";
+
+    std::vector<std::pair<int, int>> sizes;
+
+    for (std::string &size : split(size_list, ','))
+    {
+        int w = 0, h = 0;
+
+        if (std::sscanf(size.c_str(), "%dx%d", &w, &h) != 2 || w < 16 || h < 16)
+        {
+            std::cerr << "Sizes are WIDTHxHEIGHT, comma delimited, at least 16x16: " << size << "\n";
+            return -1;
+        }
+
+        sizes.push_back({w, h});
+    }
+
+    std::vector<CorpusFile> files = plan(images);
+
+    if (sizes.empty() || files.empty() || !make_corpus(directory, files, sizes))
+        return -1;
+
+    std::map<std::string, uint32_t> groups;
+    std::map<uint32_t, uint64_t> group_sizes;
+
+    for (CorpusFile &file : files)
+    {
+        groups[file.name] = file.group;
+        group_sizes[file.group]++;
+    }
+
+    uint64_t truth_pairs = 0;
+
+    for (auto &group : group_sizes)
+        truth_pairs += group.second * (group.second - 1) / 2;
+
+    /* The server gets a process (and a state folder) of its own, so its memory is counted apart from the client's. */
+    std::string folder = directory + ".server/";
+    std::string recycling_bin = folder + "recycling_bin/";
+    mkdir(folder.c_str(), 0755);
+    mkdir(recycling_bin.c_str(), 0755);
+
+    typedef int (*selfhost_function)(uint16_t port, const char *folder, const char *recycling_bin);
+    selfhost_function selfhost_start;
+
+    try
+    {
+        selfhost_start = (selfhost_function) plugin_symbol(SELFHOST_PLUGIN, "simpic_selfhost_start");
+    }
+    catch (PluginException &ex)
+    {
+        std::cerr << "The benchmark needs " << SELFHOST_PLUGIN << ": " << ex.what() << "\n";
+        return -1;
+    }
+
+    pid_t child = fork();
+
+    if (child == 0)
+    {
+        if (selfhost_start((uint16_t) MOCK_PORT, folder.c_str(), recycling_bin.c_str()) == -1)
+            std::cerr << "A Simpic server is already running on this machine; stop it first.\n";
+
+        _exit(-1);
+    }
+
+    if (!wait_for_server())
+    {
+        std::cerr << "The server did not start listening on port " << MOCK_PORT << ".\n";
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+        return -1;
+    }
+
+    std::printf("%zu images in %zu groups, %lu pairs of near-duplicates\n\n", files.size(), group_sizes.size(), (unsigned long) truth_pairs);
+    std::printf("max_ham      scan  transfer      data  client peak  server peak  precision  recall\n");
+
+    for (std::string &ham : split(ham_list, ','))
+    {
+        /* Each run is a process of its own, since ru_maxrss is the peak of the whole process. */
+        std::fflush(stdout);
+        pid_t runner = fork();
+
+        if (runner == 0)
+        {
+            run(directory, groups, truth_pairs, std::atoi(ham.c_str()), child);
+            std::fflush(stdout);
+            _exit(0);
+        }
+
+        waitpid(runner, nullptr, 0);
+    }
+
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+    return 0;
+}
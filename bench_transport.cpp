@@ -0,0 +1,256 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <memory>
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "simpic_transport.hpp"
+#include "simpic_protocol.hpp"
+
+/* Compares the transports over loopback against a stand-in server in a child process (so only the client's CPU time is counted): */
+/* many concurrent scans (a header, a plea, a small body, over and over) and heavy downloads (one long body into a file). */
+
+#define BENCH_BODY_SIZE 16384
+#define BENCH_SEND_SIZE (1 << 20)
+
+using namespace SimpicClientLib;
+
+enum class Scenarios
+{
+    Scan,
+    Download
+};
+
+struct __attribute__((__packed__)) BenchCommand
+{
+    uint8_t scenario;
+    uint32_t items;
+    uint64_t bytes;
+};
+
+static void serve(int fd)
+{
+    struct BenchCommand cmd;
+
+    if (recv(fd, &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
+        return;
+
+    std::vector<char> body(cmd.scenario == (uint8_t) Scenarios::Scan ? BENCH_BODY_SIZE : BENCH_SEND_SIZE, 'x');
+
+    if (cmd.scenario == (uint8_t) Scenarios::Scan)
+    {
+        for (uint32_t i = 0; i < cmd.items; i++)
+        {
+            struct ImageHeader ihdr;
+            std::memset(&ihdr, 0, sizeof(ihdr));
+            ihdr.size = BENCH_BODY_SIZE;
+            ihdr.filename_length = 16;
+            ihdr.path_length = -1;
+
+            char filename[16] = "bench_image.jpg";
+            send(fd, &ihdr, sizeof(ihdr), MSG_MORE);
+            send(fd, filename, sizeof(filename), 0);
+
+            struct ClientPlea plea;
+
+            if (recv(fd, &plea, sizeof(plea), MSG_WAITALL) != sizeof(plea))
+                return;
+
+            send(fd, body.data(), body.size(), 0);
+        }
+
+        return;
+    }
+
+    uint64_t remaining = cmd.bytes;
+
+    while (remaining)
+    {
+        ssize_t n = send(fd, body.data(), std::min(remaining, (uint64_t) body.size()), 0);
+
+        if (n <= 0)
+            return;
+
+        remaining -= n;
+    }
+}
+
+static void server(int listener)
+{
+    while (true)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+
+        if (fd < 0)
+            continue;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::thread([fd]() -> void {
+            serve(fd);
+            close(fd);
+        }).detach();
+    }
+}
+
+static int dial(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        std::perror("connect");
+        std::exit(-1);
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void scan(Transport *transport, uint32_t items)
+{
+    for (uint32_t i = 0; i < items; i++)
+    {
+        struct ImageHeader ihdr;
+        transport->recvall(&ihdr, sizeof(ihdr));
+
+        char filename[16];
+        transport->recvall(filename, ihdr.filename_length);
+
+        struct ClientPlea plea;
+        plea.no_data = false;
+        plea.skip_file = false;
+        transport->sendall(&plea, sizeof(plea));
+
+        transport->discard(ihdr.size, [](const char *, size_t) -> void {});
+    }
+}
+
+static void download(Transport *transport, uint64_t bytes)
+{
+    FILE *out = std::tmpfile();
+
+    transport->receive_to(fileno(out), 0, bytes, [](const char *, size_t) -> void {});
+    std::fclose(out);
+}
+
+static void run(const char *name, TransportKinds kind, Scenarios scenario, uint16_t port, int connections, uint32_t items, uint64_t bytes)
+{
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    TransportKinds got = kind;
+
+    for (int i = 0; i < connections; i++)
+    {
+        int fd = dial(port);
+        std::unique_ptr<Transport> transport(open_transport(kind, fd));
+        got = transport->kind;
+
+        threads.emplace_back([fd, scenario, items, bytes](std::unique_ptr<Transport> transport) -> void {
+            struct BenchCommand cmd;
+            cmd.scenario = (uint8_t) scenario;
+            cmd.items = items;
+            cmd.bytes = bytes;
+            transport->sendall(&cmd, sizeof(cmd));
+
+            if (scenario == Scenarios::Scan)
+                scan(transport.get(), items);
+            else
+                download(transport.get(), bytes);
+
+            transport.reset();
+            close(fd);
+        }, std::move(transport));
+    }
+
+    for (std::thread &t : threads)
+        t.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    getrusage(RUSAGE_SELF, &after);
+
+    double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+    cpu += (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+
+    std::printf("%-8s %-9s %3d conn  %8.3fs  ", name, scenario == Scenarios::Scan ? "scan" : "download", connections, seconds);
+
+    if (scenario == Scenarios::Scan)
+        std::printf("%10.0f items/s", connections * (double) items / seconds);
+    else
+        std::printf("%10.1f MB/s   ", connections * (double) bytes / seconds / (1 << 20));
+
+    std::printf("  cpu %.3fs%s\n", cpu, got != kind ? "  (io_uring unavailable: fell back to sockets)" : "");
+}
+
+int main(int argc, char **argv)
+{
+    int connections = argc > 1 ? std::atoi(argv[1]) : 32;
+    uint32_t items = argc > 2 ? std::atoi(argv[2]) : 2000;
+    uint64_t megabytes = argc > 3 ? std::atoi(argv[3]) : 256;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t len = sizeof(addr);
+
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(listener, 1024) < 0)
+    {
+        std::perror("listen");
+        return -1;
+    }
+
+    getsockname(listener, (struct sockaddr*) &addr, &len);
+    uint16_t port = ntohs(addr.sin_port);
+
+    pid_t child = fork();
+
+    if (child == 0)
+    {
+        server(listener);
+        return 0;
+    }
+
+    close(listener);
+
+    /* Split the download volume between the connections. */
+    uint64_t per_connection = (megabytes << 20) / connections;
+
+    std::printf("%d connections, %u items each, %lu MB of downloads in all\n\n", connections, items, (unsigned long) megabytes);
+
+    run("socket", TransportKinds::Socket, Scenarios::Scan, port, connections, items, 0);
+    run("io_uring", TransportKinds::Uring, Scenarios::Scan, port, connections, items, 0);
+    run("socket", TransportKinds::Socket, Scenarios::Download, port, connections, 0, per_connection);
+    run("io_uring", TransportKinds::Uring, Scenarios::Download, port, connections, 0, per_connection);
+
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+    return 0;
+}
@@ -1,3 +1,20 @@
 #define MOCK_PORT 27278
 #define CHEAP_THREAD_SLEEP_TIME 2
-#define SELF_HOST true
\ No newline at end of file
+#define SELF_HOST true
+
+/* Most striped downloads (-st) in flight at once before the scan waits on the oldest. */
+#define MAX_DOWNLOADS 4
+
+/* Default memory budget of -pl/--pipelined, in megabytes. */
+#define PIPELINE_BUDGET_MB 256
+/* Default of -jc/--job-concurrency: scans at once on the server with -j/--jobs. */
+#define JOB_CONCURRENCY 2
+
+/* Default of -fo/--fan-out: how many levels below -d the tree is split into subscans. */
+#define FANOUT_LEVELS 1
+
+/* simpic_clientd: the most memory each feed's ring of sets takes, in megabytes... */
+#define CLIENTD_FEED_MB 64
+
+/* ...and how many feeds it keeps before the oldest finished one goes. */
+#define CLIENTD_MAX_FEEDS 16
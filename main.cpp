@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <thread>
 #include <chrono>
+#include <deque>
 
 #include <cstring>
 #include <cstdlib>
@@ -13,9 +14,19 @@
 #include "config.hpp"
 #include "utils.hpp"
 #include "simpic_client.hpp"
+#include "simpic_download.hpp"
+#include "simpic_watch.hpp"
+#include "simpic_scheduler.hpp"
+#include "simpic_cluster.hpp"
+#include "simpic_fanout.hpp"
+#include "simpic_feed.hpp"
+#include "simpic_reclaim.hpp"
+#include "simpic_link.hpp"
+
+#include <mutex>
 
 #ifdef SELF_HOST
-    #include <simpic_server/simpic_server.hpp>
+    #include "simpic_plugins.hpp"
 #endif
 
 using namespace SimpicClientLib;
@@ -50,13 +61,535 @@ void help()
     "-r, --recursive                    If on, recursively scan starting from the directory.\n"
     "-sd, --send-data [PATH]            If on, download media and save the file as their hash.\n"
     "               ~~~^ this is the path where they'll be downloaded to.\n"
+    "-st, --stripes [N]                 With -sd, download over N extra connections each, while the scan goes on.\n"
     "-n, --no-action                    Don't ask what to keep, just print out similar files.\n"
     "-mx, --max-hamming [HAM]           Specify a maximum hamming distance (Default: 3).\n"
+    "-pl, --pipelined [MB]              Read the server at wire speed, holding up to MB of data in memory (implies -n).\n"
+    "-inc, --incremental                Only show the sets that changed since the last scan of this directory.\n"
+    "-incs, --incremental-at-server     Like -inc, but have the server send only those sets (if it supports it).\n"
+    "-ig, --ignore-reviewed             Don't show the sets kept whole in earlier scans again, until they change.\n"
+    "-igs, --ignore-at-server           Like -ig, but have the server leave them out (if it supports it).\n"
+    "-io, --io-uring                    Talk to the server over io_uring (falls back to plain sockets without it).\n"
+    "-pv, --protocol [VERSION]          Speak at most this protocol version (Default: 2); 1 skips the v2 hello.\n"
+    "-j, --jobs [FILE]                  Scan every directory listed in FILE (\"[priority] path\" per line) instead of -d.\n"
+    "-jc, --job-concurrency [N]         With -j or -fo, scan up to N directories at once (Default: 2).\n"
+    "-m, --merge                        With -j, merge sets that share a file into one cluster, printed once at the end.\n"
+    "-rec, --record [FILE]              Record everything the server sends during the scan into a capture FILE.\n"
+    "-rp, --replay [FILE]               Play a capture back instead of asking a server, at its original pace.\n"
+    "-rpf, --replay-fast [FILE]         Like -rp, but as fast as the output goes (for timing what handles the sets).\n"
+    "-rf, --reclaim-first [N]           Scan first, then review the N sets (Default: all) that free the most space first.\n"
+    "-fo, --fan-out [LEVELS]            With -r, scan each directory LEVELS below -d on its own, side by side, and merge\n"
+    "                                   what they find into clusters, printed once at the end (Default: 1).\n"
+    "-cd, --clientd                     Have simpic_clientd run the scan (or share the one it has), and print its sets.\n"
+    "-w, --watch                        After the scan, keep watching the directory and check new files as they land.\n"
+    "-wo, --watch-only                  Like -w, but start watching right away, without the scan.\n"
+    "-ix, --index                       Remember every image the scan looks at in ~/.simpic/index, for -sim.\n"
+    "-sim, --similar [FILE]             Say what looks like FILE, from the index if it knows (see -ix), or by a check\n"
+    "                                   against -d if it doesn't.\n"
+    "-q, --quality                      Rank the images of each set by quality (requires -sd).\n"
     "-?, --help                         Shows this menu.\n\n";
 
     std::cout << help_text << std::endl;
 }
 
+/* Scan every directory in the jobs file on one server, several at a time over kept-open connections, and print what was found. */
+/* Nothing is deleted: with scans running side by side, there is no one to ask. */
+/* With merge, sets that share a file (across every directory) are printed once, as one cluster, at the end. */
+int run_jobs(const char *jobs, std::string &address, uint16_t port, uint8_t mode, int max_ham, int concurrency, bool uring, bool merge,
+                uint8_t protocol)
+{
+    std::ifstream list(jobs);
+
+    if (!list)
+    {
+        std::cerr << "Could not open the jobs file '" << jobs << "': " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    ScanScheduler scheduler(concurrency, [uring, protocol](SimpicClient &client) -> void {
+        client.set_no_data(true);
+        client.set_transport(uring ? TransportKinds::Uring : TransportKinds::Socket);
+        client.set_protocol(protocol);
+    });
+
+    std::string line;
+    int count = 0;
+
+    while (std::getline(list, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        /* An optional priority, then the path (which may have spaces in it). */
+        int priority = 0;
+        size_t space = line.find(' ');
+
+        if (space != std::string::npos && line.find_first_not_of("-0123456789") == space)
+        {
+            priority = std::stoi(line.substr(0, space));
+            line = line.substr(space + 1);
+        }
+
+        scheduler.add(address, port, line, mode & (uint8_t)Modes::Recursive, max_ham, mode, priority);
+        count++;
+    }
+
+    std::cout << count << " directories queued." << std::endl;
+
+    std::mutex output;
+    std::map<ScanJob*, bool> in_set;
+    std::map<ScanJob*, std::vector<Media*>> current;
+    ClusterMerger merger;
+    int failures = 0;
+
+    scheduler.run([&output, &in_set, &current, &merger, merge](ScanJob &job, SimpicClient &client, void *data, DataTypes type) -> void {
+        if (type == DataTypes::Update)
+            return;
+
+        std::lock_guard<std::mutex> guard(output);
+
+        if (data == nullptr)
+        {
+            in_set[&job] = !in_set[&job];
+
+            if (in_set[&job])
+            {
+                if (!merge)
+                    std::cout << std::endl << job.path << ":\n";
+
+                return;
+            }
+
+            if (merge)
+            {
+                merger.add(current[&job]);
+                current[&job].clear();
+            }
+
+            client.keep();
+            return;
+        }
+
+        Media *media = (Media*) data;
+
+        if (merge)
+            current[&job].push_back(media);
+        else
+            std::cout << "[" << media->index << "]: " << media->path << "/" << media->filename << std::endl;
+    },
+    [&output, &failures](ScanJob &job, JobOutcomes outcome) -> void {
+        std::lock_guard<std::mutex> guard(output);
+
+        switch (outcome)
+        {
+            case JobOutcomes::Done:
+                break;
+
+            case JobOutcomes::NoResults:
+                std::cout << job.path << ": nothing similar.\n";
+                break;
+
+            case JobOutcomes::Failed:
+                std::cerr << job.path << ": the server failed the scan: " << job.error << std::endl;
+                failures++;
+                break;
+
+            case JobOutcomes::GaveUp:
+                std::cerr << job.path << ": gave up after " << job.attempts << " tries: " << job.error << std::endl;
+                failures++;
+                break;
+        }
+    },
+    [&output, &in_set, &current](ScanJob &job) -> void {
+        /* A try that dropped part of the way through a set left it open; the next starts from the first set. */
+        std::lock_guard<std::mutex> guard(output);
+        in_set[&job] = false;
+        current[&job].clear();
+    });
+
+    if (merge)
+    {
+        Clusters clusters = merger.clusters();
+
+        for (size_t c = 0; c < clusters.count(); c++)
+        {
+            std::cout << std::endl;
+
+            for (uint32_t i = clusters.offsets[c]; i < clusters.offsets[c + 1]; i++)
+                std::cout << merger.files.path(clusters.members[i]) << std::endl;
+        }
+
+        std::cout << std::endl << clusters.count() << " clusters of " << merger.files.size() << " files." << std::endl;
+    }
+
+    return failures ? -1 : 0;
+}
+
+/* Scan the directory as subscans of its subtrees, several at a time, and print the merged clusters at the end. */
+/* Nothing is deleted, as with -j/--jobs: a cluster can span subscans that no longer have anyone to ask. */
+int run_fanout(std::string &directory, std::string &address, uint16_t port, uint8_t mode, int max_ham, int levels, int concurrency, bool uring,
+                uint8_t protocol)
+{
+    SubtreeFanout fanout(address, port, concurrency, [uring, protocol](SimpicClient &client) -> void {
+        client.set_transport(uring ? TransportKinds::Uring : TransportKinds::Socket);
+        client.set_protocol(protocol);
+    });
+
+    std::mutex output;
+    int failures = 0;
+    int scans = 0;
+    Clusters clusters;
+
+    try
+    {
+        clusters = fanout.run(directory, levels, max_ham, mode, [&output, &failures, &scans](ScanJob &job, JobOutcomes outcome) -> void {
+            std::lock_guard<std::mutex> guard(output);
+            scans++;
+
+            switch (outcome)
+            {
+                case JobOutcomes::Done:
+                case JobOutcomes::NoResults:
+                    std::cerr << job.path << (job.recursive ? " (and below)" : "") << ": " << job.hashes.size() << " images.\n";
+                    break;
+
+                case JobOutcomes::Failed:
+                    std::cerr << job.path << ": the server failed the scan: " << job.error << std::endl;
+                    failures++;
+                    break;
+
+                case JobOutcomes::GaveUp:
+                    std::cerr << job.path << ": gave up after " << job.attempts << " tries: " << job.error << std::endl;
+                    failures++;
+                    break;
+            }
+        });
+    }
+    catch (ErrnoException &ex)
+    {
+        std::cerr << "Could not list " << directory << ": " << ex.what() << std::endl;
+        return -1;
+    }
+    catch (simpic_networking_exception &ex)
+    {
+        std::cerr << "Networking error: " << ex.what() << std::endl;
+        return -1;
+    }
+
+    for (size_t c = 0; c < clusters.count(); c++)
+    {
+        std::cout << std::endl;
+
+        for (uint32_t i = clusters.offsets[c]; i < clusters.offsets[c + 1]; i++)
+            std::cout << fanout.merger.files.path(clusters.members[i]) << std::endl;
+    }
+
+    std::cout << std::endl << clusters.count() << " clusters of " << fanout.merger.files.size() << " files, from ";
+    std::cout << scans << " scans." << std::endl;
+
+    return failures ? -1 : 0;
+}
+
+/* Have simpic_clientd run the scan (or share one it already has), and print the sets straight out of its feed. */
+int run_clientd(std::string &directory, std::string &address, uint16_t port, uint8_t mode, int max_ham)
+{
+    try
+    {
+        std::string name = clientd_scan(clientd_socket_path(), address, port, directory, mode & (uint8_t)Modes::Recursive,
+                        max_ham, mode, false);
+
+        FeedReader feed(name);
+        FeedSetView view;
+        uint64_t s = 0;
+
+        while (feed.wait(s, -1))
+        {
+            /* Fell a whole ring behind: skip to what is still there. */
+            if (s < feed.oldest())
+            {
+                std::cerr << feed.oldest() - s << " set(s) were overwritten before they could be read.\n";
+                s = feed.oldest();
+                continue;
+            }
+
+            if (!feed.set(s, view))
+                continue;
+
+            std::cout << std::endl;
+
+            for (const FeedItem *item : view.items)
+                std::cout << "[" << item->index << "]: " << FeedSetView::path(item) << "/" << FeedSetView::filename(item) << std::endl;
+
+            s++;
+        }
+
+        if (feed.state() == FeedStates::Failed)
+        {
+            std::cerr << "simpic_clientd could not finish the scan.\n";
+            return -1;
+        }
+
+        std::cout << std::endl << s << " sets." << std::endl;
+    }
+    catch (simpic_networking_exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return -1;
+    }
+    catch (ErrnoException &ex)
+    {
+        std::cerr << "simpic_clientd refused the scan: " << ex.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+std::string human_bytes(uint64_t bytes)
+{
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = bytes;
+    int unit = 0;
+
+    while (value >= 1024 && unit < 4)
+    {
+        value /= 1024;
+        unit++;
+    }
+
+    char out[32];
+    std::snprintf(out, sizeof(out), unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+    return out;
+}
+
+/* Answer what looks like file from the local index, connecting to the server only if it doesn't know. */
+int run_similar(const char *file, std::string &directory, std::string &address, uint16_t port, uint8_t mode, int max_ham,
+                uint8_t protocol)
+{
+    SimpicClient client(address, port);
+    client.set_protocol(protocol);
+    client.set_indexing(true);
+    client.set_no_data(true);
+
+    std::string cpp_file(file);
+    SimilarityIndex *index = client.similarity_index();
+
+    try
+    {
+        auto started = std::chrono::steady_clock::now();
+        std::vector<IndexMatch> matches = client.similar(cpp_file, directory, mode & (uint8_t)Modes::Recursive, max_ham);
+        auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+
+        for (IndexMatch &match : matches)
+        {
+            std::cout << match.path;
+
+            if (match.distance != UINT8_MAX)
+                std::cout << " (distance " << (int) match.distance << ")";
+
+            std::cout << std::endl;
+        }
+
+        std::cout << matches.size() << " similar file(s), " << (index->hits ? "from the local index" : "from the server");
+        std::cout << " (" << index->size() << " images indexed), in " << took << " us." << std::endl;
+
+        if (index->misses)
+            client.close();
+    }
+    catch (ErrnoException &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        std::cerr << "Errno: " << ex._errno << std::endl;
+        return -1;
+    }
+    catch (simpic_networking_exception &ex)
+    {
+        std::cerr << "Networking error: " << ex.what() << std::endl;
+        std::cerr << "Errno Text: " << std::strerror(ex.errnum) << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Scan with headers only, keeping every set, then present the sets that free the most first and remove what is picked. */
+/* top == 0 reviews every set. */
+int run_reclaim(SimpicClient &client, std::string &directory, uint8_t mode, int max_ham, size_t top, bool no_action)
+{
+    ReclaimRanking ranking(top, directory);
+    std::vector<Media*> set;
+
+    /* Before the scan, rather than after it, at the first set chosen. */
+    if (!no_action && !client.has(ProtocolCapabilities::Remove))
+    {
+        std::cerr << "The server can't remove files by path; use -n to only see what could be reclaimed.\n";
+        return -1;
+    }
+
+    try
+    {
+        client.set_no_data(true);
+        client.request(directory, mode & (uint8_t)Modes::Recursive, max_ham, mode, [&ranking, &set, &client](void *data, DataTypes type) -> void {
+            if (type == DataTypes::Update)
+                return;
+
+            if (data != nullptr)
+            {
+                set.push_back((Media*) data);
+                return;
+            }
+
+            /* The end of a set (its beginning leaves it empty). */
+            if (set.empty())
+                return;
+
+            ranking.add(type, set);
+            set.clear();
+            client.keep();
+        });
+    }
+    catch (NoResultsException &ex)
+    {
+        std::cout << "Nothing similar was found." << std::endl;
+        return 0;
+    }
+
+    std::vector<RankedSet> ranked = ranking.ranked();
+    uint64_t reclaimed = 0;
+
+    std::cout << ranking.sets << " sets, " << human_bytes(ranking.reclaimable) << " reclaimable";
+    std::cout << " (keeping the largest file of each); largest savings first." << std::endl;
+
+    for (size_t r = 0; r < ranked.size(); r++)
+    {
+        RankedSet &rs = ranked[r];
+
+        std::cout << std::endl << "#" << r + 1 << ": " << human_bytes(rs.reclaimable) << " reclaimable of ";
+        std::cout << human_bytes(rs.total) << " (set " << rs.order << ")\n";
+
+        for (size_t i = 0; i < rs.files.size(); i++)
+            std::cout << "[" << i << "]: " << rs.files[i].target.path << " (" << human_bytes(rs.files[i].size) << ")\n";
+
+        if (no_action)
+            continue;
+
+        std::vector<RemoveTarget> targets;
+        std::vector<uint64_t> sizes;
+
+        while (true)
+        {
+            std::cout << "Comma delimited indices to delete (nothing keeps them all): ";
+
+            std::string input;
+            std::getline(std::cin, input);
+
+            targets.clear();
+            sizes.clear();
+
+            size_t at = 0;
+            bool good = true;
+
+            while (good && at < input.size())
+            {
+                size_t comma = input.find(',', at);
+                std::string token = input.substr(at, comma == std::string::npos ? std::string::npos : comma - at);
+                at = comma == std::string::npos ? input.size() : comma + 1;
+
+                try
+                {
+                    size_t i = std::stoul(token);
+                    good = i < rs.files.size();
+
+                    if (good)
+                    {
+                        targets.push_back(rs.files[i].target);
+                        sizes.push_back(rs.files[i].size);
+                    }
+                }
+                catch (std::exception &ex)
+                {
+                    good = false;
+                }
+            }
+
+            if (good)
+                break;
+
+            std::cerr << "Those aren't indices of this set; try again.\n";
+        }
+
+        if (targets.empty())
+            continue;
+
+        std::vector<MainHeaderCodes> results = client.remove_files(targets);
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            if (results[i] == MainHeaderCodes::Success)
+                reclaimed += sizes[i];
+            else
+                std::cerr << targets[i].path << " was not removed: it is gone, has changed, or couldn't be moved.\n";
+        }
+
+        std::cout << "Reclaimed " << human_bytes(reclaimed) << " of " << human_bytes(ranking.reclaimable) << " so far.\n";
+    }
+
+    return 0;
+}
+
+/* Check every file of the kinds asked for that lands in directory from now on, until something fails. */
+int run_watch(SimpicClient &client, std::string &directory, uint8_t mode, int max_ham)
+{
+    try
+    {
+        DirectoryWatcher watcher(directory, mode & (uint8_t)Modes::Recursive);
+        std::cout << "Watching " << directory << " for new files..." << std::endl;
+
+        while (true)
+        {
+            std::vector<std::string> files;
+
+            /* Only check the kinds of files that were asked for. */
+            for (std::string &file : watcher.next_batch(WATCH_DEBOUNCE_MS, WATCH_MAX_BATCH_MS))
+            {
+                if ((uint8_t) guess_type(file) & mode & ~(uint8_t)Modes::Recursive & ~(uint8_t)Modes::NoData)
+                    files.push_back(file);
+            }
+
+            if (files.empty())
+                continue;
+
+            int conflicts = client.check(directory, mode & (uint8_t)Modes::Recursive, max_ham, mode, files,
+                [&files](void *data, DataTypes) -> void {
+
+                /* Beginning and end of a set of conflicts. */
+                if (data == nullptr)
+                    return;
+
+                Media *media = (Media*) data;
+                std::cout << files[media->set_no] << " looks like [" << media->index << "]: ";
+                std::cout << media->path << "/" << media->filename << std::endl;
+            });
+
+            std::cout << files.size() << " new file(s), " << conflicts << " with near-duplicates." << std::endl;
+        }
+    }
+    catch (ErrnoException &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        std::cerr << "Errno: " << ex._errno << std::endl;
+        return -1;
+    }
+    catch (simpic_networking_exception &ex)
+    {
+        std::cerr << "Networking error: " << ex.what() << std::endl;
+        std::cerr << "Errno Text: " << std::strerror(ex.errnum) << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv, char **envp)
 {
     int max_ham = 3;
@@ -64,6 +597,18 @@ int main(int argc, char **argv, char **envp)
     bool local = false;
     bool no_action = false;
     bool no_progress = false;
+    bool quality = false;
+    bool incremental = false;
+    bool incremental_at_server = false;
+    bool ignore_reviewed = false;
+    bool ignore_at_server = false;
+    bool watch = false;
+    bool watch_only = false;
+    bool uring = false;
+    bool merge = false;
+    bool clientd = false;
+    bool indexing = false;
+    const char *similar = nullptr;
 
     std::string homedir = home_folder();
     std::string ourfolder = simpic_folder(homedir);
@@ -72,9 +617,19 @@ int main(int argc, char **argv, char **envp)
     std::thread *localserver = nullptr;
 
     uint16_t port = 0;
+    int stripes = 0;
+    int pipelined = 0;
+    int protocol = PROTOCOL_VERSION;
+    int job_concurrency = JOB_CONCURRENCY;
+    int fanout = 0;
+    int reclaim = -1;
+    const char *jobs = nullptr;
     const char *directory = nullptr;
     const char *address = nullptr;
     const char *send_data = nullptr;
+    const char *record = nullptr;
+    const char *replay = nullptr;
+    bool replay_fast = false;
 
     uint8_t mode = 0;
 
@@ -99,75 +654,274 @@ int main(int argc, char **argv, char **envp)
         else if (!std::strcmp(argv[i], "-r") || !std::strcmp(argv[i], "--recursive"))
             mode |= (uint8_t) Modes::Recursive;
 
-        else if (!std::strcmp(argv[i], "-n") || !std::strcmp(argv[i], "--no-action"))
-            no_action = true;
+        else if (!std::strcmp(argv[i], "-n") || !std::strcmp(argv[i], "--no-action"))
+            no_action = true;
+
+        else if (!std::strcmp(argv[i], "-np") || !std::strcmp(argv[i], "--no-progress"))
+            no_progress = true;
+
+        else if (!std::strcmp(argv[i], "-q") || !std::strcmp(argv[i], "--quality"))
+            quality = true;
+
+        else if (!std::strcmp(argv[i], "-inc") || !std::strcmp(argv[i], "--incremental"))
+            incremental = true;
+
+        else if (!std::strcmp(argv[i], "-incs") || !std::strcmp(argv[i], "--incremental-at-server"))
+        {
+            incremental = true;
+            incremental_at_server = true;
+        }
+
+        else if (!std::strcmp(argv[i], "-ig") || !std::strcmp(argv[i], "--ignore-reviewed"))
+            ignore_reviewed = true;
+
+        else if (!std::strcmp(argv[i], "-igs") || !std::strcmp(argv[i], "--ignore-at-server"))
+        {
+            ignore_reviewed = true;
+            ignore_at_server = true;
+        }
+
+        else if (!std::strcmp(argv[i], "-w") || !std::strcmp(argv[i], "--watch"))
+            watch = true;
+
+        else if (!std::strcmp(argv[i], "-wo") || !std::strcmp(argv[i], "--watch-only"))
+        {
+            watch = true;
+            watch_only = true;
+        }
+
+        else if (!std::strcmp(argv[i], "-io") || !std::strcmp(argv[i], "--io-uring"))
+            uring = true;
+
+        else if (!std::strcmp(argv[i], "-m") || !std::strcmp(argv[i], "--merge"))
+            merge = true;
+
+        else if (!std::strcmp(argv[i], "-cd") || !std::strcmp(argv[i], "--clientd"))
+            clientd = true;
+
+        else if (!std::strcmp(argv[i], "-?") || !std::strcmp(argv[i], "--help"))
+        {
+            help();
+            return 0;
+        }
+
+        else if (!std::strcmp(argv[i], "-d") || !std::strcmp(argv[i], "--directory"))
+        {
+            /* If the argument is the end of the nullptr-terminated string array. */
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-d/--directory requires an argument (the directory to scan). \n";
+                return -1;
+            }
+
+            directory = argv[i + 1];
+        }
+
+        else if (!std::strcmp(argv[i], "-h") || !std::strcmp(argv[i], "--host"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-h/--host requires a host (the server's IP).\n";
+                return -1;
+            }
+
+            address = argv[i + 1];
+        }
+
+        else if (!std::strcmp(argv[i], "-p") || !std::strcmp(argv[i], "--port"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-p/--port requires a port (the server's port).\n";
+                return -1;
+            }
+
+            /* Attempt to convert the port from a string back into an integer value.*/
+            try
+            {
+                port = std::stoi(std::string(argv[i + 1]));
+            }
+            catch (std::out_of_range &ex)
+            {
+                std::cerr << "Error parsing port: " << ex.what() << std::endl;
+                return -1;
+            }
+        }
+        else if (!std::strcmp(argv[i], "-mx") || !std::strcmp(argv[i], "--max-ham"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-mx/--max-ham requires a maximum hamming distance (int)\n";
+                return -1;
+            }
+
+            try
+            {
+                max_ham = std::stoi(std::string(argv[i + 1]));
+            }
+            catch (std::out_of_range &ex)
+            {
+                std::cerr << "Error parsing maximum hamming distance: " << ex.what() << std::endl;
+                return -1;
+            }
+        }
+        else if (!std::strcmp(argv[i], "-pl") || !std::strcmp(argv[i], "--pipelined"))
+        {
+            pipelined = PIPELINE_BUDGET_MB;
+            no_action = true;
+
+            /* The budget is optional. */
+            if (argv[i + 1] != nullptr && argv[i + 1][0] != '-')
+            {
+                try
+                {
+                    pipelined = std::stoi(std::string(argv[i + 1]));
+                }
+                catch (std::exception &ex)
+                {
+                    std::cerr << "Error parsing the pipeline memory budget: " << ex.what() << std::endl;
+                    return -1;
+                }
+            }
+        }
+        else if (!std::strcmp(argv[i], "-rf") || !std::strcmp(argv[i], "--reclaim-first"))
+        {
+            reclaim = 0;
+
+            /* How many of the sets to review is optional. */
+            if (argv[i + 1] != nullptr && argv[i + 1][0] != '-')
+            {
+                try
+                {
+                    reclaim = std::stoi(std::string(argv[i + 1]));
+                }
+                catch (std::exception &ex)
+                {
+                    std::cerr << "Error parsing the number of sets to review: " << ex.what() << std::endl;
+                    return -1;
+                }
+            }
+        }
+        else if (!std::strcmp(argv[i], "-fo") || !std::strcmp(argv[i], "--fan-out"))
+        {
+            fanout = FANOUT_LEVELS;
 
-        else if (!std::strcmp(argv[i], "-np") || !std::strcmp(argv[i], "--no-progress"))
-            no_progress = true;
+            /* The depth is optional. */
+            if (argv[i + 1] != nullptr && argv[i + 1][0] != '-')
+            {
+                try
+                {
+                    fanout = std::stoi(std::string(argv[i + 1]));
+                }
+                catch (std::exception &ex)
+                {
+                    std::cerr << "Error parsing the fan-out depth: " << ex.what() << std::endl;
+                    return -1;
+                }
+            }
+        }
+        else if (!std::strcmp(argv[i], "-j") || !std::strcmp(argv[i], "--jobs"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-j/--jobs requires a file listing the directories to scan.\n";
+                return -1;
+            }
 
-        else if (!std::strcmp(argv[i], "-?") || !std::strcmp(argv[i], "--help"))
+            jobs = argv[i + 1];
+        }
+        else if (!std::strcmp(argv[i], "-jc") || !std::strcmp(argv[i], "--job-concurrency"))
         {
-            help();
-            return 0;
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-jc/--job-concurrency requires a number of scans (int)\n";
+                return -1;
+            }
+
+            try
+            {
+                job_concurrency = std::stoi(std::string(argv[i + 1]));
+            }
+            catch (std::exception &ex)
+            {
+                std::cerr << "Error parsing the job concurrency: " << ex.what() << std::endl;
+                return -1;
+            }
         }
+        else if (!std::strcmp(argv[i], "-ix") || !std::strcmp(argv[i], "--index"))
+            indexing = true;
 
-        else if (!std::strcmp(argv[i], "-d") || !std::strcmp(argv[i], "--directory"))
+        else if (!std::strcmp(argv[i], "-sim") || !std::strcmp(argv[i], "--similar"))
         {
-            /* If the argument is the end of the nullptr-terminated string array. */
             if (argv[i + 1] == nullptr)
             {
-                std::cerr << "-d/--directory requires an argument (the directory to scan). \n";
+                std::cerr << "-sim/--similar requires the file to look for.\n";
                 return -1;
             }
 
-            directory = argv[i + 1];
+            similar = argv[i + 1];
         }
-
-        else if (!std::strcmp(argv[i], "-h") || !std::strcmp(argv[i], "--host"))
+        else if (!std::strcmp(argv[i], "-rec") || !std::strcmp(argv[i], "--record"))
         {
             if (argv[i + 1] == nullptr)
             {
-                std::cerr << "-h/--host requires a host (the server's IP).\n";
+                std::cerr << "-rec/--record requires a file to write the capture to.\n";
                 return -1;
             }
 
-            address = argv[i + 1];
+            record = argv[i + 1];
         }
+        else if (!std::strcmp(argv[i], "-rp") || !std::strcmp(argv[i], "--replay")
+                        || !std::strcmp(argv[i], "-rpf") || !std::strcmp(argv[i], "--replay-fast"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << argv[i] << " requires a capture made with -rec/--record.\n";
+                return -1;
+            }
 
-        else if (!std::strcmp(argv[i], "-p") || !std::strcmp(argv[i], "--port"))
+            replay = argv[i + 1];
+            replay_fast = !std::strcmp(argv[i], "-rpf") || !std::strcmp(argv[i], "--replay-fast");
+        }
+        else if (!std::strcmp(argv[i], "-pv") || !std::strcmp(argv[i], "--protocol"))
         {
             if (argv[i + 1] == nullptr)
             {
-                std::cerr << "-p/--port requires a port (the server's port).\n";
+                std::cerr << "-pv/--protocol requires a protocol version (int)\n";
                 return -1;
             }
 
-            /* Attempt to convert the port from a string back into an integer value.*/
             try
             {
-                port = std::stoi(std::string(argv[i + 1]));
+                protocol = std::stoi(std::string(argv[i + 1]));
             }
-            catch (std::out_of_range &ex)
+            catch (std::exception &ex)
             {
-                std::cerr << "Error parsing port: " << ex.what() << std::endl;
+                std::cerr << "Error parsing the protocol version: " << ex.what() << std::endl;
+                return -1;
+            }
+
+            if (protocol < 1 || protocol > PROTOCOL_VERSION)
+            {
+                std::cerr << "-pv/--protocol must be between 1 and " << PROTOCOL_VERSION << ".\n";
                 return -1;
             }
         }
-        else if (!std::strcmp(argv[i], "-mx") || !std::strcmp(argv[i], "--max-ham"))
+        else if (!std::strcmp(argv[i], "-st") || !std::strcmp(argv[i], "--stripes"))
         {
             if (argv[i + 1] == nullptr)
             {
-                std::cerr << "-mx/--max-ham requires a maximum hamming distance (int)\n";
+                std::cerr << "-st/--stripes requires a number of connections (int)\n";
                 return -1;
             }
 
             try
             {
-                max_ham = std::stoi(std::string(argv[i + 1]));
+                stripes = std::stoi(std::string(argv[i + 1]));
             }
-            catch (std::out_of_range &ex)
+            catch (std::exception &ex)
             {
-                std::cerr << "Error parsing maximum hamming distance: " << ex.what() << std::endl;
+                std::cerr << "Error parsing the number of stripes: " << ex.what() << std::endl;
                 return -1;
             }
         }
@@ -213,28 +967,58 @@ int main(int argc, char **argv, char **envp)
         mode = (uint8_t)Modes::Images;
     }
 
-    /* This program requires a directory. */
-    if (directory == nullptr)
+    /* This program requires a directory (a replay already has its scan). */
+    if (directory == nullptr && jobs == nullptr && replay == nullptr)
     {
         std::cerr << "The simpic_client requires a directory to scan... and it was not provided.\n";
         std::cerr << "Exiting... you can supply one with -d/--directory [DIRNAME] on the remote end.\n";
         return -1;
     }
 
-    std::string cpp_directory(directory);
+    std::string cpp_directory(directory != nullptr ? directory : "");
+
+    /* The daemon connects to the server itself, and can't host one. */
+    if (clientd && (address == nullptr || jobs != nullptr || replay != nullptr || fanout > 0))
+    {
+        std::cerr << "-cd/--clientd needs -h/--host and -p/--port, and cannot be used with -j, -rp or -fo.\n";
+        return -1;
+    }
+
+    /* A replay needs no server, so none is looked for or started. */
+    if (replay != nullptr)
+    {
+        if (jobs != nullptr || record != nullptr || stripes > 0 || watch)
+        {
+            std::cerr << "-rp/--replay cannot be used with -j/--jobs, -rec/--record, -st/--stripes or -w/--watch.\n";
+            return -1;
+        }
+
+        if (address == nullptr)
+            address = "localhost";
+    }
 
     /* If no address was specified, start our own local server. */
     if (address == nullptr)
     {
         #ifdef SELF_HOST
             std::cerr << "Address not specified--searching locally.\n";
-            std::thread hosting_server([&ourfolder, &recycling_bin]() -> void {
-                try
-                {
-                    SimpicServerLib::SimpicServer srv((uint16_t)MOCK_PORT, ourfolder, recycling_bin);
-                    srv.start();
-                }
-                catch (SimpicServerLib::SimpicMultipleInstanceException &ex)
+            /* The server and everything it needs is only loaded now, so that remote scans never touch it. */
+            typedef int (*selfhost_function)(uint16_t port, const char *folder, const char *recycling_bin);
+            selfhost_function selfhost_start;
+
+            try
+            {
+                selfhost_start = (selfhost_function) plugin_symbol(SELFHOST_PLUGIN, "simpic_selfhost_start");
+            }
+            catch (PluginException &ex)
+            {
+                std::cerr << "Self-hosting needs " << SELFHOST_PLUGIN << ", which could not be loaded: " << ex.what() << "\n";
+                std::cerr << "Install it, or provide the address and port of a running server with -h and -p.\n";
+                return -1;
+            }
+
+            std::thread hosting_server([&ourfolder, &recycling_bin, selfhost_start]() -> void {
+                if (selfhost_start((uint16_t)MOCK_PORT, ourfolder.c_str(), recycling_bin.c_str()) == -1)
                 {
                     std::cerr << "An instance of simpic_server is already running, cannot make another one\n";
                     std::cerr << "Please run this program again, providing the address and port of it.\n";
@@ -260,34 +1044,135 @@ int main(int argc, char **argv, char **envp)
     std::string cpp_address(address);
 
     /* If no port was specified. */
-    if (!port && address != nullptr && !local)
+    if (!port && address != nullptr && !local && replay == nullptr)
     {
         std::cerr << "Either the port was set to 0 (invalid) or a port wasn't given... \n";
         std::cerr << "This is a critical error and thus we must shut down.\n";
         return -1;
     }
 
+    /* Quality ranking needs the image data. */
+    if (quality && send_data == nullptr)
+    {
+        std::cerr << "-q/--quality requires the image data, so -sd/--send-data must be given too.\n";
+        return -1;
+    }
+
+    if (stripes > 0 && (send_data == nullptr || quality))
+    {
+        std::cerr << "-st/--stripes requires -sd/--send-data, and cannot be used with -q/--quality.\n";
+        return -1;
+    }
+
+    if (jobs != nullptr && record != nullptr)
+    {
+        std::cerr << "-rec/--record records a single scan, and cannot be used with -j/--jobs.\n";
+        return -1;
+    }
+
+    if (clientd)
+        return run_clientd(cpp_directory, cpp_address, port, mode, max_ham);
+
+    if (similar != nullptr)
+        return run_similar(similar, cpp_directory, cpp_address, local ? MOCK_PORT : port, mode, max_ham, protocol);
+
+    if (fanout > 0)
+    {
+        if (jobs != nullptr || replay != nullptr || record != nullptr || !(mode & (uint8_t)Modes::Recursive))
+        {
+            std::cerr << "-fo/--fan-out needs -r/--recursive, and cannot be used with -j/--jobs, -rec/--record or -rp/--replay.\n";
+            return -1;
+        }
+
+        return run_fanout(cpp_directory, cpp_address, local ? MOCK_PORT : port, mode, max_ham, fanout, job_concurrency, uring, protocol);
+    }
+
+    if (jobs != nullptr)
+        return run_jobs(jobs, cpp_address, local ? MOCK_PORT : port, mode, max_ham, job_concurrency, uring, merge, protocol);
+
+    if (reclaim >= 0 && (send_data != nullptr || pipelined || incremental || watch || replay != nullptr))
+    {
+        std::cerr << "-rf/--reclaim-first cannot be used with -sd, -pl, -inc, -w or -rp.\n";
+        return -1;
+    }
+
     bool in_set = false;
 	uint32_t highest_index = 0;
 
+    std::deque<StripedDownload*> downloads;
+
+    std::vector<Image*> current_set;
+
+    /* Every file of the set at hand, for linking its exact duplicates. */
+    std::vector<Media*> set_media;
+
+    QualityScorer *scorer = quality ? new QualityScorer(0) : nullptr;
+
     /* MOCK_PORT if hosting locally. */
     SimpicClient client(cpp_address, local ? MOCK_PORT : port);
 
+    /* For timing a replay. */
+    auto started = std::chrono::steady_clock::now();
+
     try 
     {
+        client.set_transport(uring ? TransportKinds::Uring : TransportKinds::Socket);
+        client.set_protocol(protocol);
+
+        if (record != nullptr)
+            client.set_recording(record);
+
+        if (replay != nullptr)
+            client.set_replay(replay, !replay_fast);
+
         client.make_connection();
-        client.set_no_data(send_data == nullptr);
+
+        if (uring && replay == nullptr && client.transport_kind != TransportKinds::Uring)
+            std::cerr << "io_uring is not available here; using plain sockets instead.\n";
+
+        if (reclaim >= 0)
+        {
+            int ret = run_reclaim(client, cpp_directory, mode, max_ham, reclaim, no_action);
+            client.close();
+            return ret;
+        }
+
+        if (stripes > 0 && !client.has(ProtocolCapabilities::Previews))
+        {
+            std::cerr << "The server can't send files by their hash; -st is ignored.\n";
+            stripes = 0;
+        }
+
+        /* Only the files that land from now on are checked. */
+        if (watch_only)
+        {
+            int ret = run_watch(client, cpp_directory, mode, max_ham);
+            client.close();
+            delete scorer;
+            return ret;
+        }
+
+        /* Striped downloads fetch the data on their own connections; the scan itself needs none. */
+        client.set_no_data(send_data == nullptr || stripes > 0);
+        client.set_scorer(scorer);
+        client.set_incremental(incremental, incremental_at_server);
+        client.set_ignore_reviewed(ignore_reviewed, ignore_at_server);
+        client.set_indexing(indexing);
+
+        /* One consumer, since the callback below keeps its own state about the set it is in. */
+        if (pipelined)
+            client.set_pipelined(1, (size_t) pipelined << 20);
 
         client.request(
             cpp_directory, mode & (uint8_t)Modes::Recursive, max_ham, mode, 
-            [&in_set, &highest_index, &client, &no_action, &no_progress](void *data, DataTypes type) mutable -> void {
+            [&in_set, &highest_index, &client, &no_action, &no_progress, &quality, &current_set, &set_media, &local, &cpp_directory, &downloads, &stripes, &send_data](void *data, DataTypes type) mutable -> void {
             
             if (type == DataTypes::Update)
             {
                 if (!no_progress)
                 {
                     std::system("clear");
-                    std::cout << "Images found: " << ((struct UpdateHeader*)data)->images << std::endl;
+                    std::cout << "Images found: " << ((struct UpdateHeader2*)data)->images << std::endl;
                     std::this_thread::sleep_for(std::chrono::milliseconds(700));
                 }
 
@@ -298,6 +1183,7 @@ int main(int argc, char **argv, char **envp)
             if (data == nullptr && !in_set)
             {
                 std::cout << std::endl;
+                set_media.clear();
                 in_set = true;
                 return;
             }
@@ -305,11 +1191,44 @@ int main(int argc, char **argv, char **envp)
             /* End of a set. */
             if (data == nullptr && in_set)
             {
+                /* By now, every image of the set has been scored. */
+                if (quality && !current_set.empty())
+                {
+                    std::vector<Image*> ranked = current_set;
+                    std::sort(ranked.begin(), ranked.end(), [](Image *a, Image *b) -> bool {
+                        return a->quality.score > b->quality.score;
+                    });
+
+                    std::cout << "Ranked by quality (best first):\n";
+
+                    for (Image *img : ranked)
+                    {
+                        std::cout << "  [" << img->index << "] score " << img->quality.score;
+                        std::cout << " (sharpness " << img->quality.sharpness << ", blockiness " << img->quality.blockiness;
+                        std::cout << ", noise " << img->quality.noise << ")";
+
+                        if (img->verification == Verification::Mismatch)
+                            std::cout << " CORRUPTED: does not match its SHA256 hash";
+
+                        std::cout << "\n";
+                    }
+                }
+
+                current_set.clear();
+
+                /* Every body that came with the set has been read (and hashed) by now. */
+                for (Media *media : set_media)
+                {
+                    if (media->verification == Verification::Mismatch)
+                        std::cerr << "[" << media->index << "] " << media->filename << " is CORRUPTED: it does not match its SHA256 hash.\n";
+                }
+
                 if (!no_action)
                 {
 index_parsing:
                     std::cout << "Please enter the comma delimited indices of the files to delete. \n";
                     std::cout << "Example: 0,2,4,5\n";
+                    std::cout << "Or l and an index to replace the exact copies of that file with links to it (example: l0).\n";
                     std::cout << "Write nothing to keep all files.\n";
 
                     std::vector<int> indices;
@@ -317,6 +1236,103 @@ index_parsing:
                     std::string input;
                     std::getline(std::cin, input);
 
+                    if (!input.empty() && input[0] == 'l')
+                    {
+                        Media *source = nullptr;
+
+                        try
+                        {
+                            int our_index = std::stoi(input.substr(1));
+
+                            for (Media *media : set_media)
+                                if (media->index == our_index)
+                                    source = media;
+                        }
+                        catch (std::exception &ex)
+                        {
+                        }
+
+                        if (source == nullptr)
+                        {
+                            std::cerr << "That is not the index of a file in this set." << std::endl;
+                            goto index_parsing;
+                        }
+
+                        /* Only exact copies can become links; the rest of the set is kept as it is. */
+                        std::vector<Media*> copies;
+
+                        for (Media *media : set_media)
+                            if (media != source && !std::memcmp(media->sha256, source->sha256, SHA256_DIGEST_LENGTH))
+                                copies.push_back(media);
+
+                        if (copies.empty())
+                        {
+                            std::cout << "No other file in this set is an exact copy of it; files kept." << std::endl;
+                            client.keep();
+                        }
+                        else if (local)
+                        {
+                            /* Self-hosted: the files are right here, so the links are made here and the server keeps the set. */
+                            RemoveTarget target;
+                            std::memcpy(target.sha256, source->sha256, SHA256_DIGEST_LENGTH);
+                            target.path = (source->path.empty() ? cpp_directory : source->path) + "/" + source->filename;
+
+                            std::vector<RemoveTarget> targets;
+
+                            for (Media *media : copies)
+                            {
+                                RemoveTarget copy;
+                                std::memcpy(copy.sha256, media->sha256, SHA256_DIGEST_LENGTH);
+                                copy.path = (media->path.empty() ? cpp_directory : media->path) + "/" + media->filename;
+                                targets.push_back(copy);
+                            }
+
+                            try
+                            {
+                                std::vector<LinkResult> results = link_duplicates(target, targets);
+                                const char *outcomes[] = { "reflinked", "hard linked", "already linked", "changed since the scan; left alone", "failed" };
+
+                                for (size_t i = 0; i < results.size(); i++)
+                                {
+                                    std::cout << "[" << copies[i]->index << "] " << outcomes[(int) results[i].outcome];
+
+                                    if (results[i].outcome == LinkOutcomes::Failed)
+                                        std::cout << ": " << std::strerror(results[i]._errno);
+
+                                    std::cout << "\n";
+                                }
+                            }
+                            catch (ErrnoException &ex)
+                            {
+                                std::cerr << "Could not read " << target.path << ": " << ex.what() << "; files kept." << std::endl;
+                            }
+
+                            client.keep();
+                        }
+                        else if (!client.has(ProtocolCapabilities::Link))
+                        {
+                            std::cout << "The server can't link files; files kept." << std::endl;
+                            client.keep();
+                        }
+                        else
+                        {
+                            std::cout << "Linking these to [" << source->index << "]: ";
+
+                            for (Media *media : copies)
+                            {
+                                std::cout << media->index << " ";
+                                indices.push_back(media->index);
+                            }
+
+                            std::cout << std::endl;
+                            client.link(source->index, indices);
+                        }
+
+                        set_media.clear();
+                        in_set = false;
+                        return;
+                    }
+
                     /* It must be allocated on the heap. */
                     char *c_input = new char[input.size() + 1];
                     std::strcpy(c_input, input.c_str());
@@ -379,7 +1395,8 @@ index_parsing:
                 }
                 else
                 {
-                    client.keep();
+                    /* Nobody looked at it. */
+                    client.keep(false);
                 }
 
                 in_set = false;
@@ -387,23 +1404,79 @@ index_parsing:
             }
 
             /* Data about a file was sent through. */
+            Media *media = (Media*) data;
+
+            /* Update the store of the highest index. */
+            if ((uint32_t) media->index > highest_index)
+                highest_index = media->index;
+
+            set_media.push_back(media);
+
+            std::cout << "[" << media->index << "]: " << media->path << "/" << media->filename << " ";
+
             switch (type)
             {
                 case DataTypes::Image:
                 {
                     Image *img = (Image*) data;
+                    current_set.push_back(img);
+
+                    std::cout << img->width << "x" << img->height;
+                    break;
+                }
+
+                case DataTypes::Video:
+                {
+                    Video *vid = (Video*) data;
+                    std::cout << vid->width << "x" << vid->height << ", " << vid->duration / 1000.0 << "s";
+                    break;
+                }
 
-                    /* Update the store of the highest index. */
-                    if (img->index > highest_index)
-                        highest_index = img->index;
+                case DataTypes::Audio:
+                {
+                    Audio *aud = (Audio*) data;
+                    std::cout << aud->duration / 1000.0 << "s, " << aud->sample_rate << "Hz, " << (int) aud->channels << "ch";
+                    break;
+                }
 
-                    std::cout << "[" << img->index << "]: " << img->path << "/" << img->filename << " " << img->width << "x" << img->height << std::endl;
+                case DataTypes::Text:
+                {
+                    Text *txt = (Text*) data;
+                    std::cout << txt->lines << " lines";
+                    break;
+                }
 
+                default:
+                {
                     break;
                 }
             }
+
+            std::cout << std::endl;
+
+            if (stripes > 0)
+            {
+                /* Don't let too many downloads pile up behind the scan. */
+                if (downloads.size() >= MAX_DOWNLOADS)
+                {
+                    downloads.front()->wait();
+                    delete downloads.front();
+                    downloads.pop_front();
+                }
+
+                std::string destination = std::string(send_data) + "/" + sha256digest2string(media->sha256);
+
+                StripedDownload *download = new StripedDownload(client, *media, destination, stripes);
+                download->start();
+                downloads.push_back(download);
+            }
         });
     }
+    catch (NoResultsException &ex)
+    {
+        /* Nothing to review, which -w can still go on from. */
+        std::cout << ex.what() << std::endl;
+    }
     catch (InUseException &ex)
     {
         std::cerr << ex.what() << std::endl;
@@ -422,12 +1495,63 @@ index_parsing:
         std::cerr << "Errno Text: " << std::strerror(ex.errnum) << std::endl;
         return -1;
     }
+    catch (HashMismatchException &ex)
+    {
+        /* A download that had to finish before the next could start. */
+        std::cerr << "Download failed: " << ex.filename << ": " << ex.what() << std::endl;
+        return -1;
+    }
     catch (std::exception &ex)
     {
         std::cerr << "General unknown exception: "  << ex.what() << std::endl;
         return -1;
     }
 
+    if (replay != nullptr)
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        std::cerr << "Replayed " << replay << " in " << elapsed.count() << " ms.\n";
+    }
+
+    if (client.scan_state() != nullptr && client.scan_state()->unchanged)
+        std::cout << client.scan_state()->unchanged << " set(s) unchanged since the last scan were kept without asking.\n";
+
+    if (client.reviewed_sets() != nullptr && client.reviewed_sets()->ignored)
+        std::cout << client.reviewed_sets()->ignored << " set(s) already reviewed were kept without asking.\n";
+
+    try
+    {
+        for (StripedDownload *download : downloads)
+        {
+            download->wait();
+            delete download;
+        }
+    }
+    catch (simpic_networking_exception &ex)
+    {
+        std::cerr << "Download failed: " << ex.what() << std::endl;
+        client.close();
+        delete scorer;
+        return -1;
+    }
+    catch (ErrnoException &ex)
+    {
+        std::cerr << "Download failed: " << ex.what() << std::endl;
+        client.close();
+        delete scorer;
+        return -1;
+    }
+    catch (HashMismatchException &ex)
+    {
+        std::cerr << "Download failed: " << ex.filename << ": " << ex.what() << std::endl;
+        client.close();
+        delete scorer;
+        return -1;
+    }
+
+    int ret = watch ? run_watch(client, cpp_directory, mode, max_ham) : 0;
+
     client.close();
-    return 0;
+    delete scorer;
+    return ret;
 }
@@ -1,5 +1,12 @@
 #include "networking.hpp"
 
+#include <chrono>
+#include <stdexcept>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace SimpicClientLib
 {
     simpic_networking_exception::simpic_networking_exception(std::string msg, uint8_t err)
@@ -30,4 +37,177 @@ namespace SimpicClientLib
             throw simpic_networking_exception("Error sendall(): " + std::string(std::strerror(err)), err);
         }
     }
-}
\ No newline at end of file
+
+    socklen_t sockaddr_length(const struct sockaddr_storage &addr)
+    {
+        if (addr.ss_family == AF_INET6)
+            return sizeof(struct sockaddr_in6);
+
+        return sizeof(struct sockaddr_in);
+    }
+
+    std::vector<struct sockaddr_storage> resolve(const std::string &host, uint16_t port)
+    {
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        struct addrinfo *results = nullptr;
+        std::string service = std::to_string(port);
+
+        int status = getaddrinfo(host.c_str(), service.c_str(), &hints, &results);
+
+        /* If the address/domain resolution failed, complain heavily about it. */
+        if (status != 0)
+            throw std::runtime_error("Could not resolve address: " + std::string(gai_strerror(status)));
+
+        /* getaddrinfo() already sorts by RFC 6724 preference; keep that order within each family. */
+        std::vector<struct sockaddr_storage> primary;
+        std::vector<struct sockaddr_storage> secondary;
+
+        for (struct addrinfo *ai = results; ai != nullptr; ai = ai->ai_next)
+        {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+                continue;
+
+            struct sockaddr_storage addr;
+            std::memset(&addr, 0, sizeof(addr));
+            std::memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+
+            if (primary.empty() || primary[0].ss_family == addr.ss_family)
+                primary.push_back(addr);
+            else
+                secondary.push_back(addr);
+        }
+
+        freeaddrinfo(results);
+
+        /* Interleave the families, so one dead family never holds the other back. */
+        std::vector<struct sockaddr_storage> result;
+
+        for (size_t i = 0; i < primary.size() || i < secondary.size(); i++)
+        {
+            if (i < primary.size())
+                result.push_back(primary[i]);
+
+            if (i < secondary.size())
+                result.push_back(secondary[i]);
+        }
+
+        if (result.empty())
+            throw std::runtime_error("Could not resolve address: no IPv4 or IPv6 addresses for " + host);
+
+        return result;
+    }
+
+    int happy_eyeballs(std::vector<struct sockaddr_storage> &addresses, int attempt_delay, int timeout)
+    {
+        typedef std::chrono::steady_clock clock;
+
+        std::vector<struct pollfd> attempts;
+        size_t next = 0;
+        int last_error = ECONNREFUSED;
+
+        clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeout);
+        clock::time_point next_attempt = clock::now();
+
+        /* Close every attempt except the winner (or all of them, if winner is -1). */
+        auto abandon = [&attempts](int winner) -> void {
+            for (struct pollfd &attempt : attempts)
+            {
+                if (attempt.fd != winner)
+                    ::close(attempt.fd);
+            }
+        };
+
+        while (true)
+        {
+            clock::time_point now = clock::now();
+
+            /* Start the next attempt if its turn has come, or if nothing else is in flight. */
+            if (next < addresses.size() && (now >= next_attempt || attempts.empty()))
+            {
+                struct sockaddr_storage &addr = addresses[next++];
+
+                int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+
+                if (fd < 0)
+                {
+                    last_error = errno;
+                    continue;
+                }
+
+                if (connect(fd, (struct sockaddr*) &addr, sockaddr_length(addr)) == 0)
+                {
+                    abandon(-1);
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                    return fd;
+                }
+
+                if (errno != EINPROGRESS)
+                {
+                    last_error = errno;
+                    ::close(fd);
+                    continue;
+                }
+
+                attempts.push_back({fd, POLLOUT, 0});
+                next_attempt = now + std::chrono::milliseconds(attempt_delay);
+                continue;
+            }
+
+            if (attempts.empty())
+                throw simpic_networking_exception("connect() failed in SimpicClient: " + std::string(std::strerror(last_error)), last_error);
+
+            if (now >= deadline)
+            {
+                abandon(-1);
+                throw simpic_networking_exception("connect() timed out in SimpicClient", ETIMEDOUT);
+            }
+
+            clock::time_point wake = deadline;
+
+            if (next < addresses.size() && next_attempt < wake)
+                wake = next_attempt;
+
+            int wait = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+
+            if (poll(attempts.data(), attempts.size(), wait) < 0 && errno != EINTR)
+            {
+                last_error = errno;
+                abandon(-1);
+                throw simpic_networking_exception("poll() failed in SimpicClient", last_error);
+            }
+
+            for (size_t i = 0; i < attempts.size();)
+            {
+                if (!attempts[i].revents)
+                {
+                    i++;
+                    continue;
+                }
+
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+                /* First one through wins the race. */
+                if (err == 0)
+                {
+                    int fd = attempts[i].fd;
+                    abandon(fd);
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                    return fd;
+                }
+
+                /* A failed attempt hands its turn straight to the next address. */
+                last_error = err;
+                ::close(attempts[i].fd);
+                attempts.erase(attempts.begin() + i);
+                next_attempt = clock::now();
+            }
+        }
+    }
+}
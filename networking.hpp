@@ -2,6 +2,7 @@
 
 #include <exception>
 #include <string>
+#include <vector>
 
 #include <cstring>
 #include <cerrno>
@@ -13,6 +14,18 @@
 #include <netinet/in.h>
 #include <netdb.h>
 
+/* RFC 8305 "Connection Attempt Delay": how long to wait on one address before racing the next. */
+#define CONNECTION_ATTEMPT_DELAY_MS 250
+
+/* Give up on every address after this long. */
+#define CONNECTION_TIMEOUT_MS 10000
+
+/* How long a server gets to answer the protocol hello before it is taken to speak v1. */
+#define HELLO_TIMEOUT_MS 2000
+
+/* A server found to speak v1 is offered the hello again after this long, in case it was upgraded meanwhile. */
+#define PROTOCOL_VERDICT_SECONDS (7 * 24 * 60 * 60)
+
 namespace SimpicClientLib
 {
     class simpic_networking_exception : std::exception
@@ -29,4 +42,14 @@ namespace SimpicClientLib
 
     void recvall(int fd, void *buffer, int length);
     void sendall(int fd, void *buffer, int length);
-}
\ No newline at end of file
+
+    /* Resolve a host into all of its IPv6 and IPv4 addresses with getaddrinfo(), which (unlike gethostbyname()) is safe to call from many threads. */
+    /* The result is interleaved by address family, as RFC 8305 asks for. */
+    std::vector<struct sockaddr_storage> resolve(const std::string &host, uint16_t port);
+
+    /* Race connections to the addresses, starting a new attempt every attempt_delay milliseconds (or as soon as one fails). */
+    /* Returns the blocking socket of whichever address answered first; the others are closed. */
+    int happy_eyeballs(std::vector<struct sockaddr_storage> &addresses, int attempt_delay, int timeout);
+
+    socklen_t sockaddr_length(const struct sockaddr_storage &addr);
+}
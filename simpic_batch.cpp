@@ -0,0 +1,81 @@
+#include "simpic_batch.hpp"
+#include "simpic_image.hpp"
+
+namespace SimpicClientLib
+{
+    SetBatch::SetBatch()
+    {
+        set_offsets.push_back(0);
+    }
+
+    size_t SetBatch::sets() const
+    {
+        return set_types.size();
+    }
+
+    size_t SetBatch::items() const
+    {
+        return size.size();
+    }
+
+    const char *SetBatch::filename(size_t item) const
+    {
+        return strings.data() + filename_offsets[item];
+    }
+
+    const char *SetBatch::path(size_t item) const
+    {
+        return strings.data() + path_offsets[item];
+    }
+
+    void SetBatch::append(DataTypes type, std::vector<Media*> &set)
+    {
+        set_types.push_back((uint8_t) type);
+
+        for (Media *media : set)
+        {
+            uint32_t w = 0, h = 0;
+
+            if (type == DataTypes::Image)
+            {
+                w = ((Image*) media)->width;
+                h = ((Image*) media)->height;
+            }
+            else if (type == DataTypes::Video)
+            {
+                w = ((Video*) media)->width;
+                h = ((Video*) media)->height;
+            }
+
+            set_index.push_back(media->set_no);
+            item_index.push_back(media->index);
+            width.push_back(w);
+            height.push_back(h);
+            size.push_back(media->length);
+            sha256.insert(sha256.end(), media->sha256, media->sha256 + SHA256_DIGEST_LENGTH);
+
+            filename_offsets.push_back(strings.size());
+            strings.insert(strings.end(), media->filename.c_str(), media->filename.c_str() + media->filename.size() + 1);
+
+            path_offsets.push_back(strings.size());
+            strings.insert(strings.end(), media->path.c_str(), media->path.c_str() + media->path.size() + 1);
+        }
+
+        set_offsets.push_back(size.size());
+    }
+
+    void SetBatch::clear()
+    {
+        set_offsets.resize(1);
+        set_types.clear();
+        set_index.clear();
+        item_index.clear();
+        width.clear();
+        height.clear();
+        size.clear();
+        sha256.clear();
+        filename_offsets.clear();
+        path_offsets.clear();
+        strings.clear();
+    }
+}
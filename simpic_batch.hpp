@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include <cstdint>
+
+#include <openssl/sha.h>
+
+#include "simpic_protocol.hpp"
+#include "simpic_media.hpp"
+
+namespace SimpicClientLib
+{
+    /* A window of completed sets as a struct of arrays, for consumers (GUI models, NumPy) that would rather copy */
+    /* whole columns than walk Media objects one by one. Item i of the batch is entry i of every per-item array. */
+    class SetBatch
+    {
+    public:
+        /* Per set: the items of set s are [set_offsets[s], set_offsets[s + 1]); set_offsets has one more entry than there are sets. */
+        std::vector<uint32_t> set_offsets;
+        std::vector<uint8_t> set_types; // a DataTypes.
+
+        /* Per item. */
+        std::vector<uint32_t> set_index; // the set's number in the whole scan (Media::set_no).
+        std::vector<uint32_t> item_index; // the index to hand to SimpicClient::remove() (Media::index).
+        std::vector<uint32_t> width; // 0 for media without one (audio, text).
+        std::vector<uint32_t> height;
+        std::vector<uint64_t> size;
+        std::vector<uint8_t> sha256; // SHA256_DIGEST_LENGTH bytes per item.
+
+        /* Offsets of NUL-terminated strings in strings. */
+        std::vector<uint32_t> filename_offsets;
+        std::vector<uint32_t> path_offsets;
+        std::vector<char> strings;
+
+        SetBatch();
+
+        size_t sets() const;
+        size_t items() const;
+
+        const char *filename(size_t item) const;
+        const char *path(size_t item) const;
+
+        /* Add a completed set, which is copied out of the media. */
+        void append(DataTypes type, std::vector<Media*> &set);
+
+        /* Empty it for the next window, keeping the memory. */
+        void clear();
+    };
+}
@@ -0,0 +1,221 @@
+#include "simpic_capture.hpp"
+
+#include <thread>
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace SimpicClientLib
+{
+    RecordingTransport::RecordingTransport(Transport *_inner, const std::string &path) : Transport(_inner->fd, _inner->kind)
+    {
+        inner.reset(_inner);
+        capture = std::fopen(path.c_str(), "wb");
+
+        if (capture == nullptr)
+        {
+            uint8_t err = errno;
+            throw simpic_networking_exception("Error creating capture " + path + ": " + std::string(std::strerror(err)), err);
+        }
+
+        setvbuf(capture, nullptr, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+        struct CaptureHeader header;
+        std::memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.started = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+
+        std::fwrite(&header, sizeof(header), 1, capture);
+        last = std::chrono::steady_clock::now();
+    }
+
+    RecordingTransport::~RecordingTransport()
+    {
+        std::fclose(capture);
+    }
+
+    void RecordingTransport::record(CaptureDirections direction, const void *data, size_t length)
+    {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t delay = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+        last = now;
+
+        struct CaptureRecord rec;
+        rec.direction = (uint8_t) direction;
+        rec.delay = (uint32_t) std::min(delay, (uint64_t) UINT32_MAX);
+        rec.length = length;
+
+        if (std::fwrite(&rec, sizeof(rec), 1, capture) != 1 || std::fwrite(data, 1, length, capture) != length)
+        {
+            uint8_t err = errno;
+            throw simpic_networking_exception("Error writing capture: " + std::string(std::strerror(err)), err);
+        }
+    }
+
+    void RecordingTransport::note(CaptureDirections direction, const void *data, size_t length)
+    {
+        record(direction, data, length);
+    }
+
+    ssize_t RecordingTransport::receive(void *buffer, size_t length)
+    {
+        ssize_t n = inner->receive(buffer, length);
+
+        if (n > 0)
+            record(CaptureDirections::Inbound, buffer, n);
+
+        return n;
+    }
+
+    void RecordingTransport::sendall(void *buffer, size_t length)
+    {
+        record(CaptureDirections::Outbound, buffer, length);
+        inner->sendall(buffer, length);
+    }
+
+    void RecordingTransport::flush()
+    {
+        inner->flush();
+        std::fflush(capture);
+    }
+
+    void RecordingTransport::cork(bool on)
+    {
+        inner->cork(on);
+    }
+
+    /* Bodies keep whatever path the transport underneath has for them; the capture sees them as they pass. */
+    void RecordingTransport::receive_to(int out, off_t offset, uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        inner->receive_to(out, offset, length, [this, &observe](const char *chunk, size_t amnt) -> void {
+            record(CaptureDirections::Inbound, chunk, amnt);
+            observe(chunk, amnt);
+        });
+    }
+
+    void RecordingTransport::discard(uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        inner->discard(length, [this, &observe](const char *chunk, size_t amnt) -> void {
+            record(CaptureDirections::Inbound, chunk, amnt);
+            observe(chunk, amnt);
+        });
+    }
+
+    ReplayTransport::ReplayTransport(const std::string &path, bool _realtime) : Transport(-1, TransportKinds::Replay)
+    {
+        realtime = _realtime;
+        at = sizeof(struct CaptureHeader);
+        data = nullptr;
+        left = 0;
+
+        int cfd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (cfd < 0 || fstat(cfd, &st) < 0)
+        {
+            uint8_t err = errno;
+
+            if (cfd >= 0)
+                ::close(cfd);
+
+            throw simpic_networking_exception("Error opening capture " + path + ": " + std::string(std::strerror(err)), err);
+        }
+
+        map_size = st.st_size;
+        map = (char*) MAP_FAILED;
+
+        if (map_size >= sizeof(struct CaptureHeader))
+            map = (char*) mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+
+        ::close(cfd);
+
+        if (map == MAP_FAILED || std::memcmp(map, CAPTURE_MAGIC, sizeof(((struct CaptureHeader*) 0)->magic)))
+        {
+            if (map != MAP_FAILED)
+                munmap(map, map_size);
+
+            throw simpic_networking_exception(path + " is not a capture", EINVAL);
+        }
+
+        madvise(map, map_size, MADV_SEQUENTIAL);
+        due = std::chrono::steady_clock::now();
+    }
+
+    ReplayTransport::~ReplayTransport()
+    {
+        munmap(map, map_size);
+    }
+
+    bool ReplayTransport::next()
+    {
+        while (at + sizeof(struct CaptureRecord) <= map_size)
+        {
+            struct CaptureRecord rec;
+            std::memcpy(&rec, map + at, sizeof(rec));
+
+            /* A capture cut short (the recorder was killed) ends where its last whole record does. */
+            if (at + sizeof(rec) + rec.length > map_size)
+                break;
+
+            data = map + at + sizeof(rec);
+            left = rec.length;
+            at += sizeof(rec) + rec.length;
+
+            /* The delays count from the record before, sends included. */
+            due += std::chrono::microseconds(rec.delay);
+
+            if (rec.direction != (uint8_t) CaptureDirections::Inbound)
+                continue;
+
+            if (realtime)
+                std::this_thread::sleep_until(due);
+
+            return true;
+        }
+
+        at = map_size;
+        return false;
+    }
+
+    ssize_t ReplayTransport::receive(void *buffer, size_t length)
+    {
+        if (!left && !next())
+            return 0;
+
+        size_t amnt = std::min(length, left);
+        std::memcpy(buffer, data, amnt);
+
+        data += amnt;
+        left -= amnt;
+        return amnt;
+    }
+
+    /* What the client sends has no bearing on a replay: the server's side of it was recorded already. */
+    void ReplayTransport::sendall(void *, size_t)
+    {
+
+    }
+
+    /* Skipped bodies are observed straight out of the capture, without a copy. */
+    void ReplayTransport::discard(uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        while (length)
+        {
+            if (!left && !next())
+                throw simpic_networking_exception("Error discard(): the capture ended", ECONNRESET);
+
+            size_t amnt = std::min(length, (uint64_t) left);
+            observe(data, amnt);
+
+            data += amnt;
+            left -= amnt;
+            length -= amnt;
+        }
+    }
+}
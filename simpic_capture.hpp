@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <chrono>
+
+#include <cstdio>
+#include <cstdint>
+
+#include "simpic_transport.hpp"
+
+/* The first bytes of every capture file. */
+#define CAPTURE_MAGIC "SIMPCAP1"
+
+/* A recording transport writes the capture through a buffer this big. */
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+namespace SimpicClientLib
+{
+    /* A capture is a CaptureHeader, then one CaptureRecord per receive (or send) followed by the bytes of it. */
+    struct __attribute__((__packed__)) CaptureHeader
+    {
+        char magic[8];
+        uint64_t started; // microseconds since the epoch, for the record.
+    };
+
+    enum class CaptureDirections
+    {
+        Inbound = 0,
+        Outbound = 1 // kept so that a capture shows what was asked; replay skips them.
+    };
+
+    struct __attribute__((__packed__)) CaptureRecord
+    {
+        uint8_t direction; // a CaptureDirections.
+        uint32_t delay; // microseconds since the record before it (saturating).
+        uint32_t length;
+    };
+
+    /* Passes everything through to another transport, and tees whatever comes in (frames and bodies alike, through */
+    /* whichever path they take) and whatever goes out into a capture file, timestamped. */
+    /* Throws simpic_networking_exception if the capture can't be created or written. */
+    class RecordingTransport : public Transport
+    {
+    private:
+        std::unique_ptr<Transport> inner;
+        FILE *capture;
+        std::chrono::steady_clock::time_point last;
+
+        void record(CaptureDirections direction, const void *data, size_t length);
+
+    public:
+        /* Takes ownership of the transport. */
+        RecordingTransport(Transport *_inner, const std::string &path);
+        ~RecordingTransport();
+
+        ssize_t receive(void *buffer, size_t length);
+        void sendall(void *buffer, size_t length);
+        void flush();
+        void cork(bool on);
+        void receive_to(int out, off_t offset, uint64_t length, std::function<void(const char*, size_t)> observe);
+        void discard(uint64_t length, std::function<void(const char*, size_t)> observe);
+
+        /* Record bytes that went by before the transport was wrapped (the protocol hello). */
+        void note(CaptureDirections direction, const void *data, size_t length);
+    };
+
+    /* Plays a capture back as though it were the server: receives come out of the capture, in order, either when they */
+    /* came originally (realtime) or as fast as they are asked for; sends go nowhere. There is no socket (fd is -1). */
+    /* The end of the capture is the end of the connection. */
+    class ReplayTransport : public Transport
+    {
+    private:
+        char *map;
+        size_t map_size;
+
+        size_t at; // the next record.
+        const char *data; // what is left of the record at hand.
+        size_t left;
+
+        bool realtime;
+        std::chrono::steady_clock::time_point due;
+
+        /* Move on to the next inbound record, waiting for it if realtime; false at the end. */
+        bool next();
+
+    public:
+        ReplayTransport(const std::string &path, bool _realtime);
+        ~ReplayTransport();
+
+        ssize_t receive(void *buffer, size_t length);
+        void sendall(void *buffer, size_t length);
+        void discard(uint64_t length, std::function<void(const char*, size_t)> observe);
+    };
+}
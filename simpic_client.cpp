@@ -1,7 +1,59 @@
 #include "simpic_client.hpp"
 
+#include <ctime>
+#include <mutex>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <openssl/evp.h>
+
 namespace SimpicClientLib
 {
+    /* Servers (host:port) that didn't answer the hello, and when, so that they aren't made to time out on every */
+    /* connection. Shared by every client of the process, and by every process through ~/.simpic/protocol, a line of */
+    /* "host:port time" for each; the last line about a server is the one that counts. */
+    static std::mutex v1_servers_lock;
+    static std::map<std::string, time_t> v1_servers;
+    static bool v1_servers_loaded = false;
+
+    static std::string v1_servers_location()
+    {
+        std::string folder = simpic_folder(home_folder());
+        mkdir_dir(folder);
+
+        return folder + "protocol";
+    }
+
+    /* With v1_servers_lock held. */
+    static bool known_v1(const std::string &server)
+    {
+        if (!v1_servers_loaded)
+        {
+            std::ifstream in(v1_servers_location());
+            std::string name;
+            time_t when;
+
+            while (in >> name >> when)
+                v1_servers[name] = when;
+
+            v1_servers_loaded = true;
+        }
+
+        auto found = v1_servers.find(server);
+        return found != v1_servers.end() && time(nullptr) - found->second < PROTOCOL_VERDICT_SECONDS;
+    }
+
+    /* With v1_servers_lock held. A lost line only costs another hello. */
+    static void remember_v1(const std::string &server)
+    {
+        time_t now = time(nullptr);
+        v1_servers[server] = now;
+
+        std::ofstream out(v1_servers_location(), std::ios::app);
+        out << server << " " << now << "\n";
+    }
+
     NoResultsException::NoResultsException(std::string msg)
     {
         message = msg;
@@ -48,187 +100,1888 @@ namespace SimpicClientLib
     SimpicClient::SimpicClient(std::string &addr, uint16_t port)
     {
         no_data = false;
+        answered = false;
+        preview = PreviewTypes::None;
+        preview_length = 0;
+        scorer = nullptr;
+        pipeline_consumers = 0;
+        pipeline_budget = 0;
+        pipelining = false;
+        incremental = false;
+        server_deltas = false;
+        ignoring = false;
+        server_ignore = false;
+        host = addr;
+        this->port = port;
 
-        struct hostent *entry = gethostbyname(addr.c_str());
+        std::memset(&peer, 0, sizeof(peer));
+        std::memset(&server_addr, 0, sizeof(server_addr));
+        std::memset(&saddr, 0, sizeof(saddr));
+        resolution = std::async(std::launch::async, resolve, addr, port);
 
-        /* If the address/domain resolution failed, complain heavily about it. */
-        if (entry == nullptr)
-            throw std::runtime_error("Could not resolve address: " + std::string(hstrerror(h_errno)));
+        transport_kind = TransportKinds::Socket;
+        replay_realtime = false;
+        want_hashes = false;
+        fd = -1;
+        connected = false;
+        max_protocol = PROTOCOL_VERSION;
+        protocol_version = 1;
+        capabilities = 0;
+        multiplexed = false;
+        sharing = false;
+        indexing = false;
+        owner = nullptr;
+    }
 
-        server_addr = *((struct in_addr*) entry->h_addr_list[0]);
-        saddr.sin_addr = server_addr;
-        saddr.sin_port = htons(port);
-        saddr.sin_family = AF_INET;
+    SimpicClient::SimpicClient(SimpicClient &parent)
+    {
+        no_data = parent.no_data;
+        answered = false;
+        preview = parent.preview;
+        preview_length = parent.preview_length;
+        scorer = parent.scorer;
+        pipeline_consumers = parent.pipeline_consumers;
+        pipeline_budget = parent.pipeline_budget;
+        pipelining = false;
+        incremental = parent.incremental;
+        server_deltas = parent.server_deltas;
+        ignoring = parent.ignoring;
+        server_ignore = parent.server_ignore;
+        dfolder = parent.dfolder;
+        host = parent.host;
+        port = parent.port;
+        addresses = parent.addresses;
+        peer = parent.peer;
+        server_addr = parent.server_addr;
+        saddr = parent.saddr;
+        cache_location = parent.cache_location;
 
-        fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        transport_kind = parent.transport_kind;
+        replay_realtime = false;
+        want_hashes = parent.want_hashes;
+        fd = -1;
         connected = false;
+        max_protocol = parent.max_protocol;
+        protocol_version = parent.protocol_version;
+        capabilities = parent.capabilities;
+        multiplexed = false;
+        sharing = false;
+        indexing = parent.indexing;
+        owner = &parent;
+
+        if (parent.mux != nullptr)
+        {
+            transport.reset(parent.mux->open());
+            connected = true;
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(parent.sessions_lock);
+
+            if (!parent.idle.empty())
+            {
+                transport = std::move(parent.idle.back());
+                parent.idle.pop_back();
+
+                fd = transport->fd;
+                connected = true;
+                return;
+            }
+        }
+
+        /* Every connection is busy: one more, which the hello cache keeps from waiting on a v1 server again. */
+        make_connection();
     }
 
-    int SimpicClient::make_connection()
+    SimpicClient *SimpicClient::session()
     {
-        /* Try to connect--if it failed, returned the errno value for the error. */
-        if (connect(fd, (struct sockaddr*) &saddr, sizeof(saddr)) < 0)
-            throw simpic_networking_exception("connect() failed in SimpicClient", errno);
+        if (!sharing)
+            return nullptr;
 
-        connected = true;
-        return 0; 
+        std::lock_guard<std::mutex> guard(sessions_lock);
+        auto found = sessions.find(std::this_thread::get_id());
+
+        return found == sessions.end() ? nullptr : found->second;
     }
 
-    void SimpicClient::remove(std::vector<int> &selected)
+    int SimpicClient::concurrently(std::function<int(SimpicClient&)> call)
     {
-        struct ClientAction act;
-        act.action = (uint8_t) ClientActions::Delete;
-        act.deletions = selected.size();
-        sendall(fd, &act, sizeof(act));
+        SimpicClient own(*this);
+        std::thread::id self = std::this_thread::get_id();
+        SimpicClient *outer = nullptr;
+
+        /* A request made from another's callback (a fetch, say) has the thread until it returns. */
+        {
+            std::lock_guard<std::mutex> guard(sessions_lock);
+            auto found = sessions.find(self);
+
+            if (found != sessions.end())
+                outer = found->second;
+
+            sessions[self] = &own;
+        }
+
+        int ret = 0;
+        bool reusable = true;
+        std::exception_ptr failure;
+
+        /* These leave the connection in step with the server; anything else may have left it anywhere. */
+        try
+        {
+            ret = call(own);
+        }
+        catch (NoResultsException &ex)
+        {
+            failure = std::current_exception();
+        }
+        catch (InUseException &ex)
+        {
+            failure = std::current_exception();
+        }
+        catch (...)
+        {
+            failure = std::current_exception();
+            reusable = false;
+        }
 
-        /* Send the indices which are to be deleted. */
-        for (int index : selected)
         {
-            sendall(fd, (uint8_t*) &index, sizeof(uint8_t));
+            std::lock_guard<std::mutex> guard(sessions_lock);
+
+            if (outer != nullptr)
+                sessions[self] = outer;
+            else
+                sessions.erase(self);
+
+            hashes = std::move(own.hashes);
+
+            /* What each session found is saved already: the state to a file of its own path, and the reviewed list */
+            /* merged with what the others saved (see ReviewedSets::save()). The client only shows the last of each. */
+            if (own.state != nullptr)
+                state = std::move(own.state);
+
+            if (own.reviewed != nullptr)
+                reviewed = std::move(own.reviewed);
+
+            if (reusable && mux == nullptr)
+            {
+                idle.push_back(std::move(own.transport));
+                own.fd = -1;
+            }
         }
+
+        /* Ends the stream, if it was one. */
+        own.transport.reset();
+
+        if (own.fd >= 0)
+            ::close(own.fd);
+
+        if (failure)
+            std::rethrow_exception(failure);
+
+        return ret;
     }
 
-    void SimpicClient::keep()
+    int SimpicClient::dial()
     {
-        struct ClientAction act;
-        act.deletions = -1;
-        act.action = (uint8_t) ClientActions::Keep;
+        int sock = happy_eyeballs(addresses, CONNECTION_ATTEMPT_DELAY_MS, CONNECTION_TIMEOUT_MS);
+
+        socklen_t len = sizeof(peer);
+        getpeername(sock, (struct sockaddr*) &peer, &len);
+
+        if (peer.ss_family == AF_INET)
+        {
+            std::memcpy(&saddr, &peer, sizeof(saddr));
+            server_addr = saddr.sin_addr;
+        }
+        else
+        {
+            std::memset(&server_addr, 0, sizeof(server_addr));
+            std::memset(&saddr, 0, sizeof(saddr));
+        }
 
-        sendall(fd, &act, sizeof(act));
+        /* Every message is whole when it is sent (see OutboundMessage), so Nagle can only delay it. */
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        return sock;
     }
 
-    int SimpicClient::request(std::string &path, bool recursive, uint8_t max_ham, uint8_t types,
-                        std::function<void(void*, DataTypes)> callback)
+    bool SimpicClient::hello(int sock, struct ClientHello &offer, struct ServerHello &reply)
     {
-        /* Send a structure that tells the server what we want. */
         struct ClientRequest req;
-        req.max_ham = max_ham;
-        req.path_length = path.size() + 1;
-        req.types = types;
-        req.request = (uint8_t)(recursive ? ClientRequests::ScanRecursive : ClientRequests::Scan);
+        req.request = (uint8_t) ClientRequests::Hello;
+        req.types = 0;
+        req.max_ham = 0;
+        req.path_length = htole16(1);
 
+        OutboundMessage msg;
+        msg.add(req).add(std::string("")).add(offer);
 
-        sendall(fd, &req, sizeof(req));
-        sendall(fd, (char*)path.c_str(), req.path_length);
+        try
+        {
+            sendall(sock, msg.buffer.data(), msg.buffer.size());
+        }
+        catch (simpic_networking_exception &ex)
+        {
+            return false;
+        }
 
-        struct UpdateHeader uh;
-        recvall(fd, &uh, sizeof(uh));
+        /* Done on the bare socket, before any transport has it, so that the wait can time out. */
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HELLO_TIMEOUT_MS);
+        size_t got = 0;
 
-        /* While there are progress updates, send them to the callback. */
-        while (!uh.done)
+        while (got < sizeof(reply))
         {
-            callback(&uh, DataTypes::Update);
-            recvall(fd, &uh, sizeof(uh));
+            int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            struct pollfd pfd = { sock, POLLIN, 0 };
+
+            if (left <= 0 || poll(&pfd, 1, left) <= 0)
+                return false;
+
+            ssize_t n = recv(sock, (char*) &reply + got, sizeof(reply) - got, 0);
+
+            if (n <= 0)
+                return false;
+
+            got += n;
+
+            /* A v1 server's answer is told apart as soon as it could be a MainHeader. */
+            if (got >= sizeof(struct MainHeader) && (reply.code != (uint8_t) MainHeaderCodes::Success || reply._errno
+                            || le16toh(reply.mark) != PROTOCOL_HELLO_MARK))
+                return false;
         }
 
-        /* The server is now going to tell us how many results it found. */
-        struct MainHeader mhdr;
-        recvall(fd, &mhdr, sizeof(mhdr));
+        return reply.version >= 2;
+    }
 
-        if (mhdr.code == (uint8_t)MainHeaderCodes::NoResults)
+    int SimpicClient::make_connection()
+    {
+        protocol_version = 1;
+        capabilities = 0;
+
+        /* A capture has room for one conversation at a time. */
+        sharing = multiplexed && record_path.empty() && replay_path.empty();
+
+        /* No server at all: the capture is the connection. */
+        if (!replay_path.empty())
         {
-            throw NoResultsException("Simpic server found no similar images.");
-            return -1;
+            transport.reset(new ReplayTransport(replay_path, replay_realtime));
+            transport_kind = transport->kind;
+            connected = true;
+
+            /* A capture of a v2 connection starts with the ServerHello; one of a v1 connection is started over. */
+            struct ServerHello reply;
+            bool v2 = false;
+
+            try
+            {
+                transport->recvall(&reply, sizeof(struct MainHeader));
+                v2 = reply.code == (uint8_t) MainHeaderCodes::Success && !reply._errno && le16toh(reply.mark) == PROTOCOL_HELLO_MARK;
+
+                if (v2)
+                    transport->recvall(&reply.version, sizeof(reply) - sizeof(struct MainHeader));
+            }
+            catch (simpic_networking_exception &ex)
+            {
+            }
+
+            if (v2 && reply.version >= 2)
+            {
+                protocol_version = reply.version;
+                capabilities = le32toh(reply.capabilities);
+            }
+            else
+            {
+                transport.reset(new ReplayTransport(replay_path, replay_realtime));
+            }
+
+            return 0;
         }
 
-        /* If the server complains of the directory already being scanned. */
-        if (mhdr.code == (uint8_t)MainHeaderCodes::DirectoryAlreadyActive)
+        /* Wait for the background resolver, if it hasn't finished already. Its answer is only good once: after it */
+        /* failed, a retry resolves again, so it gets the resolver's error (or, by now, the addresses) itself. */
+        if (resolution.valid())
+            addresses = resolution.get();
+        else if (addresses.empty())
+            addresses = resolve(host, port);
+
+        std::string server = host + ":" + std::to_string(port);
+        bool offer = max_protocol >= 2;
+
+        if (offer)
         {
-            throw InUseException(
-                "A scan cannot be preformed--the directory is already being scanned.",
-                path
-            );
+            std::lock_guard<std::mutex> guard(v1_servers_lock);
+            offer = !known_v1(server);
+        }
 
-            return -1;
+        fd = dial();
+
+        struct ClientHello ours;
+        struct ServerHello reply;
+
+        if (offer)
+        {
+            std::memcpy(ours.magic, PROTOCOL_MAGIC, sizeof(ours.magic));
+            ours.version = max_protocol;
+            ours.capabilities = htole32((uint32_t) ProtocolCapabilities::WideHeaders | (uint32_t) ProtocolCapabilities::Previews
+                            | (uint32_t) ProtocolCapabilities::Delta | (uint32_t) ProtocolCapabilities::PerceptualHashes
+                            | (uint32_t) ProtocolCapabilities::Ignore | (uint32_t) ProtocolCapabilities::List
+                            | (uint32_t) ProtocolCapabilities::Remove | (uint32_t) ProtocolCapabilities::Link
+                            | (sharing ? (uint32_t) ProtocolCapabilities::Streams : 0));
+
+            if (hello(fd, ours, reply))
+            {
+                protocol_version = std::min(reply.version, max_protocol);
+                capabilities = le32toh(reply.capabilities);
+            }
+            else
+            {
+                /* Whatever the server made of the hello, the connection can't be trusted to be in step with it. */
+                ::close(fd);
+
+                {
+                    std::lock_guard<std::mutex> guard(v1_servers_lock);
+                    remember_v1(server);
+                }
+
+                fd = dial();
+            }
         }
 
-        /* A generic--we don't know exactly--error occured, let's see its errno. */
-        if (mhdr.code == (uint8_t)MainHeaderCodes::Failure)
+        if (sharing && (capabilities & (uint32_t) ProtocolCapabilities::Streams))
         {
-            throw ErrnoException(mhdr._errno);
-            return mhdr._errno;
+            mux.reset(new Multiplexer(fd));
+            transport_kind = TransportKinds::Stream;
+            connected = true;
+            return 0;
         }
 
-        /* Memory garbage can. */
-        std::vector<void*> garbage;
+        /* Falls back to plain sockets if io_uring can't be had. */
+        transport.reset(open_transport(transport_kind, fd));
+        transport_kind = transport->kind;
 
-        /* Loop the amount of times we expect a set.*/
-        for (int i = 0; i < mhdr.set_no; i++)
+        if (!record_path.empty())
         {
-            /* Empty and free the garbage can. */
-            for (void *ptr : garbage)
-                delete ptr; 
+            RecordingTransport *recording = new RecordingTransport(transport.release(), record_path);
+            transport.reset(recording);
 
-            garbage.clear();
+            /* The hello went by before there was a transport to tee it; a replay has to see it all the same. */
+            if (protocol_version >= 2)
+                recording->note(CaptureDirections::Inbound, &reply, sizeof(reply));
+        }
 
-            struct SetHeader shdr;
-            recvall(fd, &shdr, sizeof(shdr));
+        /* Without streams, this connection becomes the first of those that the sessions take turns with. */
+        if (sharing)
+        {
+            idle.push_back(std::move(transport));
+            fd = -1;
+        }
 
-            switch ((DataTypes)shdr.type)
-            {
-                /* If the set is a set of images. */
-                case DataTypes::Image:
-                {
-                    /* This signifies the start of a collection of images. */
-                    callback(nullptr, DataTypes::Image);
+        connected = true;
+        return 0; 
+    }
 
-                    /* Let the client handle every image that comes through. */
-                    for (int j = 0; j < shdr.count; j++)
-                    {
-                        struct ImageHeader ihdr;
-                        recvall(fd, &ihdr, sizeof(ihdr));
-
-                        Image *img = new Image(&ihdr, j, fd);
-                        img->no_sets = mhdr.set_no;
-                        img->set_no = i;
-                        
-                        garbage.push_back(img);
-
-                        /* The server needs to know whether to send the file data. */
-                        struct ClientPlea plea;
-                        plea.no_data = no_data;
-                        plea.skip_file = false;
-                        sendall(fd, &plea, sizeof(plea));
-
-                        /* void* > std::any */
-                        /* BLOCKS this thread. */
-                        callback((void*) img, DataTypes::Image);
-                    }
+    void SimpicClient::set_protocol(uint8_t version)
+    {
+        max_protocol = std::clamp<uint8_t>(version, 1, PROTOCOL_VERSION);
+    }
 
-                    /* This signals that the end of the set has been reached. */
-                    callback(nullptr, DataTypes::Image);
-                    break;
-                }
+    void SimpicClient::set_multiplexed(bool enabled)
+    {
+        multiplexed = enabled;
+    }
 
-                default:
-                {
-                    break;
-                }
-            }
+    bool SimpicClient::has(ProtocolCapabilities capability)
+    {
+        return protocol_version >= 2 && (capabilities & (uint32_t) capability);
+    }
+
+    void SimpicClient::require(ProtocolCapabilities capability, const std::string &what)
+    {
+        if (!has(capability))
+            throw simpic_networking_exception("Error " + what + "(): the server doesn't support it", EOPNOTSUPP);
+    }
+
+    bool SimpicClient::wide()
+    {
+        return has(ProtocolCapabilities::WideHeaders);
+    }
+
+    uint16_t SimpicClient::wire16(uint16_t value)
+    {
+        return protocol_version >= 2 ? htole16(value) : value;
+    }
+
+    uint32_t SimpicClient::wire32(uint32_t value)
+    {
+        return protocol_version >= 2 ? htole32(value) : value;
+    }
+
+    uint64_t SimpicClient::wire64(uint64_t value)
+    {
+        return protocol_version >= 2 ? htole64(value) : value;
+    }
+
+    void SimpicClient::receive_update(struct UpdateHeader2 &uh)
+    {
+        if (wide())
+        {
+            transport->recvall(&uh, sizeof(uh));
+            uh.images = le32toh(uh.images);
+            uh.audios = le32toh(uh.audios);
+            uh.videos = le32toh(uh.videos);
+            uh.texts = le32toh(uh.texts);
+            return;
         }
 
-        return 0;    
+        struct UpdateHeader v1;
+        transport->recvall(&v1, sizeof(v1));
+
+        uh.done = v1.done;
+        uh.images = v1.images;
+        uh.audios = v1.audios;
+        uh.videos = v1.videos;
+        uh.texts = v1.texts;
     }
 
-    void SimpicClient::handler()
+    void SimpicClient::receive_main(struct MainHeader2 &mhdr)
     {
-        while (true)
+        if (wide())
+        {
+            transport->recvall(&mhdr, sizeof(mhdr));
+            mhdr.set_no = le32toh(mhdr.set_no);
+            return;
+        }
+
+        struct MainHeader v1;
+        transport->recvall(&v1, sizeof(v1));
+
+        mhdr.code = v1.code;
+        mhdr._errno = v1._errno;
+        mhdr.set_no = v1.set_no;
+    }
+
+    void SimpicClient::receive_set(struct SetHeader2 &shdr)
+    {
+        if (wide())
         {
+            transport->recvall(&shdr, sizeof(shdr));
+            shdr.count = le32toh(shdr.count);
+            return;
+        }
+
+        struct SetHeader v1;
+        transport->recvall(&v1, sizeof(v1));
+
+        shdr.type = v1.type;
+        shdr.count = v1.count;
+    }
+
+    void SimpicClient::add_action(OutboundMessage &msg, ClientActions action, int source, std::vector<int> &indices)
+    {
+        if (wide())
+        {
+            struct ClientAction2 act;
+            act.action = (uint8_t) action;
+            act.deletions = htole32(action == ClientActions::Keep ? UINT32_MAX : (uint32_t) indices.size());
+            msg.add(act);
+
+            if (action == ClientActions::Link)
+                msg.add((uint32_t) htole32(source));
 
+            for (int index : indices)
+                msg.add((uint32_t) htole32(index));
+
+            return;
         }
+
+        /* Better to refuse than to have the count or an index wrap around and name the wrong files. */
+        if (indices.size() > UINT8_MAX - 1 || source > UINT8_MAX)
+            throw LimitsException("A v1 server can only be given 254 files of a set at once.", "deletions");
+
+        for (int index : indices)
+            if (index > UINT8_MAX)
+                throw LimitsException("A v1 server can't be given an index past 255.", "deletions");
+
+        struct ClientAction act;
+        act.action = (uint8_t) action;
+        act.deletions = action == ClientActions::Keep ? -1 : indices.size();
+        msg.add(act);
+
+        if (action == ClientActions::Link)
+            msg.add((uint8_t) source);
+
+        for (int index : indices)
+            msg.add((uint8_t) index);
     }
 
-    void SimpicClient::set_no_data(bool data)
+    void SimpicClient::send_keep()
     {
-        no_data = data;
+        std::vector<int> none;
+
+        OutboundMessage msg;
+        add_action(msg, ClientActions::Keep, 0, none);
+        transport->send(msg);
     }
 
-    void SimpicClient::close()
+    void SimpicClient::remove(std::vector<int> &selected)
     {
-        struct ClientRequest req;
-        req.request = (uint8_t) ClientRequests::Exit;
-        req.path_length = 0;
+        /* A multiplexed client answers for the set of the calling thread's request. */
+        if (sharing)
+        {
+            if (SimpicClient *own = session())
+                own->remove(selected);
+
+            return;
+        }
+
+        /* The network thread has already answered for this set. */
+        if (pipelining)
+            return;
+
+        /* The indices which are to be deleted follow the action. */
+        OutboundMessage msg;
+        add_action(msg, ClientActions::Delete, 0, selected);
+        transport->send(msg);
+        answered = true;
+    }
+
+    void SimpicClient::link(int source, std::vector<int> &duplicates)
+    {
+        require(ProtocolCapabilities::Link, "link");
+
+        if (sharing)
+        {
+            if (SimpicClient *own = session())
+                own->link(source, duplicates);
+
+            return;
+        }
+
+        if (pipelining)
+            return;
+
+        OutboundMessage msg;
+        add_action(msg, ClientActions::Link, source, duplicates);
+        transport->send(msg);
+        answered = true;
+
+        if (reviewed != nullptr && !reviewing.empty())
+            reviewed->add(reviewing);
+    }
+
+    void SimpicClient::keep(bool reviewed)
+    {
+        if (sharing)
+        {
+            if (SimpicClient *own = session())
+                own->keep(reviewed);
+
+            return;
+        }
+
+        if (pipelining)
+            return;
+
+        if (reviewed && this->reviewed != nullptr && !reviewing.empty())
+            this->reviewed->add(reviewing);
+
+        send_keep();
+        answered = true;
+    }
+
+    int SimpicClient::request(std::string &path, bool recursive, uint8_t max_ham, uint8_t types,
+                        std::function<void(void*, DataTypes)> callback)
+    {
+        if (sharing)
+            return concurrently([&](SimpicClient &own) -> int {
+                return own.request(path, recursive, max_ham, types, callback);
+            });
+
+        /* An extension the server doesn't have is left out; the client does without, or does it itself. */
+        bool previews = preview != PreviewTypes::None && has(ProtocolCapabilities::Previews);
+        bool deltas = incremental && server_deltas && has(ProtocolCapabilities::Delta);
+
+        /* The index is fed the perceptual hashes of everything the scan looked at. */
+        bool hashing = (want_hashes || indexing) && has(ProtocolCapabilities::PerceptualHashes);
+
+        /* Find out what the last scan of this path looked like. */
+        state.reset();
+
+        if (incremental)
+        {
+            std::string folder = simpic_folder(home_folder());
+            mkdir_dir(folder);
+            folder += "scans/";
+            mkdir_dir(folder);
+
+            state.reset(new ScanState(folder, host, port, path, recursive, max_ham, types));
+            state->load();
+        }
+
+        reviewed.reset();
+
+        if (ignoring)
+        {
+            std::string folder = simpic_folder(home_folder());
+            mkdir_dir(folder);
+
+            reviewed.reset(new ReviewedSets(folder + "reviewed"));
+            reviewed->load();
+        }
 
-        sendall(fd, &req, sizeof(req));
+        /* An empty filter would suppress nothing. */
+        bool filtering = reviewed != nullptr && server_ignore && reviewed->size() && has(ProtocolCapabilities::Ignore);
+
+        /* Sets may have to be seen whole before deciding whether to present them. */
+        bool staging = state != nullptr || reviewed != nullptr;
+
+        uint32_t extensions = 0;
+
+        if (previews)
+            extensions |= (uint32_t) RequestExtensions::Previews;
+
+        if (deltas)
+            extensions |= (uint32_t) RequestExtensions::Delta;
+
+        if (hashing)
+            extensions |= (uint32_t) RequestExtensions::PerceptualHashes;
+
+        if (filtering)
+            extensions |= (uint32_t) RequestExtensions::Ignore;
+
+        hashes.clear();
+
+        /* Send a structure that tells the server what we want. */
+        struct ClientRequest req;
+        req.max_ham = max_ham;
+        req.path_length = wire16(path.size() + 1);
+        req.types = types | (extensions ? (uint8_t) ClientRequestFlags::Extended : 0);
+        req.request = (uint8_t)(recursive ? ClientRequests::ScanRecursive : ClientRequests::Scan);
+
+
+        /* The request, its path and its extensions leave together. */
+        OutboundMessage msg;
+        msg.add(req).add(path);
+
+        if (extensions)
+        {
+            struct ClientRequestExtensions ext;
+            ext.flags = wire32(extensions);
+            msg.add(ext);
+        }
+
+        if (previews)
+        {
+            struct ClientPreviewRequest preq;
+            preq.type = (uint8_t) preview;
+            preq.length = wire32(preview_length);
+            msg.add(preq);
+        }
+
+        if (deltas)
+        {
+            struct ClientDeltaRequest dreq;
+            dreq.generation = wire64(state->generation);
+            msg.add(dreq);
+        }
+
+        if (hashing)
+        {
+            struct ClientHashesRequest hreq;
+            hreq.singletons = 1;
+            msg.add(hreq);
+        }
+
+        if (filtering)
+        {
+            /* The filter goes in the same message as the request, so the two leave in one write. */
+            struct ClientIgnoreRequest ireq;
+            std::vector<uint8_t> filter;
+            reviewed->filter(ireq, filter);
+            ireq.bits = wire32(ireq.bits);
+            msg.add(ireq).add(filter.data(), filter.size());
+        }
+
+        transport->send(msg);
+
+        /* Where the data of a set being held back goes past STAGING_MEMORY_BUDGET; it outlives the pipeline below. */
+        /* Its room is used again once the set is left out, or (unless the consumers have it) once the next one starts. */
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> spill_file(nullptr, std::fclose);
+        off_t spill_end = 0;
+
+        /* In pipelined mode, this thread only reads the socket; the callback runs on the consumers. */
+        std::unique_ptr<Pipeline> pipeline;
+
+        /* However the request ends, keep() and the rest answer for themselves again after it, and if it failed */
+        /* part of the way, the consumers drop what they were still to see. */
+        struct PipelineStop
+        {
+            std::atomic<bool> &pipelining;
+            std::unique_ptr<Pipeline> &pipeline;
+
+            ~PipelineStop()
+            {
+                pipelining = false;
+
+                if (pipeline != nullptr)
+                    pipeline->abort();
+            }
+        } stop{pipelining, pipeline};
+
+        if (pipeline_consumers)
+        {
+            pipeline.reset(new Pipeline(pipeline_consumers, pipeline_budget, callback, scorer));
+            pipelining = true;
+        }
+
+        struct UpdateHeader2 uh;
+        receive_update(uh);
+
+        /* While there are progress updates, send them to the callback. */
+        while (!uh.done)
+        {
+            if (pipelining)
+                pipeline->update(&uh);
+            else
+                callback(&uh, DataTypes::Update);
+
+            receive_update(uh);
+        }
+
+        /* The server is now going to tell us how many results it found. */
+        struct MainHeader2 mhdr;
+        receive_main(mhdr);
+
+        /* Whatever the outcome, the consumers have seen everything they will see. */
+        if (mhdr.code != (uint8_t)MainHeaderCodes::Success && pipelining)
+        {
+            pipeline->finish();
+            pipelining = false;
+        }
+
+        if (mhdr.code == (uint8_t)MainHeaderCodes::NoResults)
+        {
+            if (hashing)
+            {
+                receive_hashes();
+                learn(path);
+            }
+
+            /* Nothing is similar anymore, which is a result worth remembering too. */
+            if (state != nullptr)
+            {
+                state->sets.clear();
+                state->generation++;
+                state->save();
+            }
+
+            throw NoResultsException("Simpic server found no similar images.");
+            return -1;
+        }
+
+        /* If the server complains of the directory already being scanned. */
+        if (mhdr.code == (uint8_t)MainHeaderCodes::DirectoryAlreadyActive)
+        {
+            throw InUseException(
+                "A scan cannot be preformed--the directory is already being scanned.",
+                path
+            );
+
+            return -1;
+        }
+
+        /* A generic--we don't know exactly--error occured, let's see its errno. */
+        if (mhdr.code == (uint8_t)MainHeaderCodes::Failure)
+        {
+            throw ErrnoException(mhdr._errno);
+            return mhdr._errno;
+        }
+
+        /* With a server delta, only the sets that changed follow, after the files that left every set. */
+        std::vector<std::string> removed;
+        std::vector<ScanSet> received;
+        bool delta = false;
+        uint64_t generation = 0;
+
+        if (deltas)
+        {
+            struct ServerDeltaHeader dhdr;
+            transport->recvall(&dhdr, sizeof(dhdr));
+            dhdr.generation = wire64(dhdr.generation);
+            dhdr.removed = wire32(dhdr.removed);
+
+            delta = dhdr.delta;
+            generation = dhdr.generation;
+
+            for (uint32_t k = 0; k < dhdr.removed; k++)
+            {
+                std::string hash(SHA256_DIGEST_LENGTH, '\0');
+                transport->recvall(hash.data(), SHA256_DIGEST_LENGTH);
+                removed.push_back(hash);
+            }
+        }
+
+        /* Memory garbage can. */
+        std::vector<Media*> garbage;
+
+        /* Loop the amount of times we expect a set.*/
+        for (uint32_t i = 0; i < mhdr.set_no; i++)
+        {
+            /* Empty and free the garbage can. */
+            for (Media *ptr : garbage)
+                delete ptr; 
+
+            garbage.clear();
+
+            /* Nothing reads what an earlier set spilled anymore, and this one may as well use its room; the consumers */
+            /* may still be on theirs, though. */
+            if (!pipelining)
+                spill_end = 0;
+
+            off_t set_spilled = spill_end;
+
+            struct SetHeader2 shdr;
+            receive_set(shdr);
+
+            /* The server thinks this set was reviewed; the filter can be wrong, but the list can't. */
+            if (shdr.type & (uint8_t) SetHeaderFlags::Suppressed)
+            {
+                std::string key(SHA256_DIGEST_LENGTH, '\0');
+                transport->recvall(key.data(), SHA256_DIGEST_LENGTH);
+                shdr.type &= ~(uint8_t) SetHeaderFlags::Suppressed;
+
+                struct ClientSuppressionReply reply;
+                reply.send = reviewed == nullptr || !reviewed->contains(key);
+                transport->sendall(&reply, sizeof(reply));
+
+                if (!reply.send)
+                {
+                    reviewed->ignored++;
+                    continue;
+                }
+
+                if (reviewed != nullptr)
+                    reviewed->false_positives++;
+            }
+
+            DataTypes type = (DataTypes) shdr.type;
+
+            /* Without knowing its header, there's no telling where the set ends: the stream can't be followed past it. */
+            if (type != DataTypes::Image && type != DataTypes::Video && type != DataTypes::Audio && type != DataTypes::Text)
+                throw simpic_networking_exception("Unknown set type from the Simpic server: " + std::to_string(shdr.type), EPROTO);
+
+            std::vector<Media*> staged;
+            size_t held = 0; // bytes of staged in memory.
+
+            ScanSet described;
+            described.type = type;
+
+            /* Whether the set could still turn out to be one not to present, and so is held back until it's whole. */
+            /* Everything a server delta sends has changed, so only the reviewed sets can be left out then. */
+            bool holding = staging && (reviewed != nullptr || !delta);
+
+            /* This signifies the start of a collection of media (unless it's being held back). */
+            if (!holding)
+            {
+                if (pipelining)
+                    pipeline->begin_set(type);
+                else
+                    callback(nullptr, type);
+            }
+
+            /* Let the client handle every file that comes through. */
+            for (uint32_t j = 0; j < shdr.count; j++)
+            {
+                Media *media = receive_media(type, j);
+                media->no_sets = mhdr.set_no;
+                media->set_no = i;
+
+                /* The server needs to know whether to send the file data. */
+                struct ClientPlea plea;
+                plea.no_data = no_data;
+                plea.skip_file = false;
+                transport->sendall(&plea, sizeof(plea));
+
+                if (previews)
+                    receive_preview(media);
+
+                if (state != nullptr)
+                {
+                    described.members.push_back(ScanState::describe(type, media));
+
+                    /* A file the last scan didn't have where it is now: the set has changed, whatever else is in it. */
+                    /* Unless it could have been reviewed, what was held goes on now, and the rest streams as usual. */
+                    if (holding && reviewed == nullptr && !state->seen(described.members.back()))
+                    {
+                        holding = false;
+                        release(type, staged, garbage, pipeline.get(), callback);
+                        staged.clear();
+                    }
+                }
+
+                /* Hold on to it (and its data) until the whole set is in: in memory up to the budget, spilled past it. */
+                if (holding)
+                {
+                    if (!no_data && held + media->length <= STAGING_MEMORY_BUDGET)
+                    {
+                        held += media->length;
+                        media->buffer();
+                    }
+                    else if (!no_data)
+                    {
+                        if (spill_file == nullptr)
+                            spill_file.reset(std::tmpfile());
+
+                        if (spill_file == nullptr)
+                            throw simpic_networking_exception("Could not make a spill file: " + std::string(std::strerror(errno)), errno);
+
+                        media->spill(fileno(spill_file.get()), spill_end);
+                        spill_end += media->length;
+                    }
+
+                    if (scorer != nullptr && media->buffered && type == DataTypes::Image)
+                        scorer->submit((Image*) media);
+
+                    staged.push_back(media);
+                    continue;
+                }
+
+                /* Queue it up for a consumer, with its data already off the socket. */
+                if (pipelining)
+                {
+                    pipeline->media(media, !no_data);
+                    continue;
+                }
+
+                garbage.push_back(media);
+
+                /* Score it in the background while the rest of the set comes in. */
+                if (scorer != nullptr && !no_data && type == DataTypes::Image)
+                {
+                    media->buffer();
+                    scorer->submit((Image*) media);
+                }
+
+                /* void* > std::any */
+                /* BLOCKS this thread. */
+                callback((void*) media, type);
+
+                /* Whatever of the body the callback didn't read has to come off the socket before the next header. */
+                if (!no_data)
+                    media->skip();
+            }
+
+            if (state != nullptr)
+                received.push_back(described);
+
+            if (holding)
+            {
+                std::string key = reviewed != nullptr ? ReviewedSets::key(staged) : "";
+
+                /* Everything a server delta sends has changed; otherwise, compare with the last scan. */
+                bool known = state != nullptr && !delta && state->known(described);
+
+                if (reviewed != nullptr && reviewed->contains(key))
+                {
+                    reviewed->ignored++;
+                }
+                else if (!known)
+                {
+                    reviewing = key;
+                    deliver(type, staged, garbage, pipeline.get(), callback);
+                    reviewing.clear();
+                    continue;
+                }
+                else
+                {
+                    /* Seen, and dealt with, last time. */
+                    state->unchanged++;
+                }
+
+                if (scorer != nullptr)
+                    scorer->wait();
+
+                for (Media *ptr : staged)
+                    delete ptr;
+
+                /* What this set spilled is the end of the file, and no one will read it. */
+                spill_end = set_spilled;
+
+                send_keep();
+                continue;
+            }
+
+            /* The consumers can't answer in time for the server, so every set is kept. */
+            if (pipelining)
+            {
+                pipeline->end_set(type);
+
+                send_keep();
+                continue;
+            }
+
+            /* Every image must carry its score by the end of the set. */
+            if (scorer != nullptr && !no_data && type == DataTypes::Image)
+                scorer->wait();
+
+            /* This signals that the end of the set has been reached. */
+            callback(nullptr, type);
+        }
+
+        for (Media *ptr : garbage)
+            delete ptr;
+
+        if (hashing)
+        {
+            receive_hashes();
+            learn(path);
+        }
+
+        if (pipelining)
+        {
+            pipeline->finish();
+            pipelining = false;
+        }
+
+        if (state != nullptr)
+        {
+            if (delta)
+                state->merge(removed, received);
+            else
+                state->sets = received;
+
+            state->generation = deltas ? generation : state->generation + 1;
+            state->save();
+        }
+
+        if (reviewed != nullptr)
+            reviewed->save();
+
+        return 0;    
+    }
+
+    int SimpicClient::request_batched(std::string &path, bool recursive, uint8_t max_ham, uint8_t types, unsigned int window,
+                        std::function<void(SetBatch&)> callback)
+    {
+        if (sharing)
+            return concurrently([&](SimpicClient &own) -> int {
+                return own.request_batched(path, recursive, max_ham, types, window, callback);
+            });
+
+        SetBatch batch;
+        std::vector<Media*> current;
+        bool in_set = false;
+
+        window = std::max(window, 1u);
+
+        /* The media of a set are only good until the next one starts, so each set is copied out as it ends. */
+        int ret = request(path, recursive, max_ham, types, [&](void *data, DataTypes type) -> void {
+            if (type == DataTypes::Update)
+                return;
+
+            if (data != nullptr)
+            {
+                current.push_back((Media*) data);
+                return;
+            }
+
+            /* Beginning of a set. */
+            if (!in_set)
+            {
+                in_set = true;
+                answered = false;
+                return;
+            }
+
+            in_set = false;
+            batch.append(type, current);
+            current.clear();
+
+            if (batch.sets() >= window)
+            {
+                callback(batch);
+                batch.clear();
+            }
+
+            if (!answered)
+                keep(false);
+        });
+
+        if (batch.sets())
+            callback(batch);
+
+        return ret;
+    }
+
+    int SimpicClient::check(std::string &path, bool recursive, uint8_t max_ham, uint8_t types, std::vector<std::string> &files,
+                        std::function<void(void*, DataTypes)> callback)
+    {
+        if (sharing)
+            return concurrently([&](SimpicClient &own) -> int {
+                return own.check(path, recursive, max_ham, types, files, callback);
+            });
+
+        struct ClientRequest req;
+        req.max_ham = max_ham;
+        req.path_length = wire16(path.size() + 1);
+        req.types = types;
+        req.request = (uint8_t)(recursive ? ClientRequests::CheckRecursive : ClientRequests::Check);
+
+        OutboundMessage msg;
+        msg.add(req).add(path);
+
+        if (wide())
+            msg.add((uint32_t) htole32(files.size()));
+        else
+            msg.add((uint16_t) files.size());
+
+        transport->cork(true);
+        transport->send(msg);
+
+        /* Every file is named by its path; the server already has it. The lot is packed into full segments. */
+        for (std::string &file : files)
+        {
+            struct ClientCheckRequest creq;
+            creq.length = wire32(file.size() + 1);
+            creq.type = (uint8_t) guess_type(file);
+            creq.method = (uint8_t) ClientCheckRequestTypes::ByPath;
+
+            OutboundMessage check;
+            check.add(creq).add(file);
+            transport->send(check);
+        }
+
+        transport->cork(false);
+
+        uint32_t results;
+
+        if (wide())
+        {
+            struct ServerCheckResponse2 resp;
+            transport->recvall(&resp, sizeof(resp));
+            results = le32toh(resp.results);
+        }
+        else
+        {
+            struct ServerCheckResponse resp;
+            transport->recvall(&resp, sizeof(resp));
+            results = resp.results == (uint16_t) -1 ? UINT32_MAX : resp.results;
+        }
+
+        /* Nothing conflicted. */
+        if (results == UINT32_MAX)
+            return 0;
+
+        for (uint32_t i = 0; i < results; i++)
+        {
+            struct ServerCheckIndividualGenericResponse2 ind;
+
+            if (wide())
+            {
+                transport->recvall(&ind, sizeof(ind));
+                ind.index = le32toh(ind.index);
+                ind.info.count = le32toh(ind.info.count);
+            }
+            else
+            {
+                struct ServerCheckIndividualGenericResponse v1;
+                transport->recvall(&v1, sizeof(v1));
+                ind.index = v1.index;
+                ind.info.type = v1.info.type;
+                ind.info.count = v1.info.count;
+            }
+
+            DataTypes type = (DataTypes) ind.info.type;
+
+            if (type != DataTypes::Image && type != DataTypes::Video && type != DataTypes::Audio && type != DataTypes::Text)
+                throw simpic_networking_exception("Unknown set type from the Simpic server: " + std::to_string(ind.info.type), EPROTO);
+
+            std::vector<Media*> conflicts;
+            callback(nullptr, type);
+
+            /* From here on, it is just like a set of a scan. */
+            for (uint32_t j = 0; j < ind.info.count; j++)
+            {
+                Media *media = receive_media(type, j);
+                media->set_no = ind.index;
+                conflicts.push_back(media);
+
+                struct ClientPlea plea;
+                plea.no_data = no_data;
+                plea.skip_file = false;
+                transport->sendall(&plea, sizeof(plea));
+
+                callback((void*) media, type);
+
+                if (!no_data)
+                    media->skip();
+            }
+
+            callback(nullptr, type);
+
+            for (Media *ptr : conflicts)
+                delete ptr;
+        }
+
+        return results;
+    }
+
+    void SimpicClient::release(DataTypes type, std::vector<Media*> &set, std::vector<Media*> &garbage, Pipeline *pipeline,
+                        std::function<void(void*, DataTypes)> &callback)
+    {
+        if (pipelining)
+        {
+            pipeline->begin_set(type);
+
+            for (Media *media : set)
+                pipeline->media(media, false);
+
+            return;
+        }
+
+        callback(nullptr, type);
+
+        for (Media *media : set)
+        {
+            garbage.push_back(media);
+            callback((void*) media, type);
+        }
+    }
+
+    void SimpicClient::deliver(DataTypes type, std::vector<Media*> &set, std::vector<Media*> &garbage, Pipeline *pipeline,
+                        std::function<void(void*, DataTypes)> &callback)
+    {
+        release(type, set, garbage, pipeline, callback);
+
+        if (pipelining)
+        {
+            pipeline->end_set(type);
+
+            send_keep();
+            return;
+        }
+
+        if (scorer != nullptr && type == DataTypes::Image)
+            scorer->wait();
+
+        callback(nullptr, type);
+    }
+
+    Media *SimpicClient::receive_media(DataTypes type, int index)
+    {
+        switch (type)
+        {
+            case DataTypes::Video:
+            {
+                struct VideoHeader2 vhdr;
+
+                if (wide())
+                {
+                    transport->recvall(&vhdr, sizeof(vhdr));
+                    vhdr.width = le32toh(vhdr.width);
+                    vhdr.height = le32toh(vhdr.height);
+                    vhdr.duration = le32toh(vhdr.duration);
+                    vhdr.size = le64toh(vhdr.size);
+                    vhdr.filename_length = le16toh(vhdr.filename_length);
+                    vhdr.path_length = le16toh(vhdr.path_length);
+                }
+                else
+                {
+                    struct VideoHeader v1;
+                    transport->recvall(&v1, sizeof(v1));
+                    std::memcpy(vhdr.sha256_hash, v1.sha256_hash, SHA256_DIGEST_LENGTH);
+                    vhdr.width = v1.width;
+                    vhdr.height = v1.height;
+                    vhdr.duration = v1.duration;
+                    vhdr.size = v1.size;
+                    vhdr.filename_length = v1.filename_length;
+                    vhdr.path_length = v1.path_length;
+                }
+
+                return new Video(&vhdr, index, transport.get());
+            }
+
+            case DataTypes::Audio:
+            {
+                struct AudioHeader ahdr;
+                transport->recvall(&ahdr, sizeof(ahdr));
+                ahdr.duration = wire32(ahdr.duration);
+                ahdr.sample_rate = wire32(ahdr.sample_rate);
+                ahdr.size = wire64(ahdr.size);
+                ahdr.filename_length = wire16(ahdr.filename_length);
+                ahdr.path_length = wire16(ahdr.path_length);
+                return new Audio(&ahdr, index, transport.get());
+            }
+
+            case DataTypes::Text:
+            {
+                struct TextHeader thdr;
+                transport->recvall(&thdr, sizeof(thdr));
+                thdr.lines = wire32(thdr.lines);
+                thdr.size = wire64(thdr.size);
+                thdr.filename_length = wire16(thdr.filename_length);
+                thdr.path_length = wire16(thdr.path_length);
+                return new Text(&thdr, index, transport.get());
+            }
+
+            default:
+            {
+                struct ImageHeader2 ihdr;
+
+                if (wide())
+                {
+                    transport->recvall(&ihdr, sizeof(ihdr));
+                    ihdr.width = le32toh(ihdr.width);
+                    ihdr.height = le32toh(ihdr.height);
+                    ihdr.size = le64toh(ihdr.size);
+                    ihdr.filename_length = le16toh(ihdr.filename_length);
+                    ihdr.path_length = le16toh(ihdr.path_length);
+                }
+                else
+                {
+                    struct ImageHeader v1;
+                    transport->recvall(&v1, sizeof(v1));
+                    std::memcpy(ihdr.sha256_hash, v1.sha256_hash, SHA256_DIGEST_LENGTH);
+                    ihdr.width = v1.width;
+                    ihdr.height = v1.height;
+                    ihdr.size = v1.size;
+                    ihdr.filename_length = v1.filename_length;
+                    ihdr.path_length = v1.path_length;
+                }
+
+                return new Image(&ihdr, index, transport.get());
+            }
+        }
+    }
+
+    void SimpicClient::receive_preview(Media *img)
+    {
+        struct PreviewHeader phdr;
+        transport->recvall(&phdr, sizeof(phdr));
+        phdr.size = wire32(phdr.size);
+
+        /* More than was asked for is a server that can't be followed anymore, and not worth the memory it asks for. */
+        if (phdr.size > preview_length)
+            throw simpic_networking_exception("The Simpic server sent a preview of " + std::to_string(phdr.size) + " bytes, past the "
+                            + std::to_string(preview_length) + " asked for.", EPROTO);
+
+        img->preview_type = (PreviewTypes) phdr.type;
+        img->preview.resize(phdr.size);
+
+        if (phdr.size)
+            transport->recvall(img->preview.data(), phdr.size);
+
+        /* A server that can't find thumbnails sends the first bytes instead; look for one in them ourselves. */
+        if (preview == PreviewTypes::Thumbnail && img->preview_type == PreviewTypes::FirstBytes)
+        {
+            std::vector<char> thumbnail;
+
+            if (extract_jpeg_thumbnail(img->preview, thumbnail))
+            {
+                img->preview.swap(thumbnail);
+                img->preview_type = PreviewTypes::Thumbnail;
+            }
+        }
+    }
+
+    uint64_t SimpicClient::start_fetch(const char *sha256, uint64_t offset, uint64_t length)
+    {
+        struct ClientRequest req;
+        req.request = (uint8_t) ClientRequests::Fetch;
+        req.types = 0;
+        req.max_ham = 0;
+        req.path_length = 0;
+
+        struct ClientFetchRequest freq;
+        std::memcpy(freq.sha256_hash, sha256, sizeof(freq.sha256_hash));
+        freq.offset = wire64(offset);
+        freq.length = wire64(length);
+
+        OutboundMessage msg;
+        msg.add(req).add(freq);
+        transport->send(msg);
+
+        struct ServerFetchResponse resp;
+        transport->recvall(&resp, sizeof(resp));
+
+        if (resp.code == (uint8_t)MainHeaderCodes::NoResults)
+            throw NoResultsException("Simpic server knows of no file with that hash.");
+
+        if (resp.code == (uint8_t)MainHeaderCodes::Failure)
+            throw ErrnoException(resp._errno);
+
+        return wire64(resp.length);
+    }
+
+    int SimpicClient::fetch(const char *sha256, uint64_t offset, uint64_t length, std::function<void(char*, size_t)> sink)
+    {
+        require(ProtocolCapabilities::Previews, "fetch");
+
+        /* Multiplexed, a fetch is a request of its own, and so may be made in the middle of another. */
+        if (sharing)
+            return concurrently([&](SimpicClient &own) -> int {
+                return own.fetch(sha256, offset, length, sink);
+            });
+
+        char buffer[FETCH_BUFFER_SIZE];
+        uint64_t remaining = start_fetch(sha256, offset, length);
+
+        while (remaining)
+        {
+            size_t amnt = std::min(remaining, (uint64_t) sizeof(buffer));
+            transport->recvall(buffer, amnt);
+            sink(buffer, amnt);
+
+            remaining -= amnt;
+        }
+
+        return 0;
+    }
+
+    int SimpicClient::fetch(const char *sha256, uint64_t offset, uint64_t length, int out, off_t out_offset,
+                        std::function<void(const char*, size_t)> progress)
+    {
+        require(ProtocolCapabilities::Previews, "fetch");
+
+        if (sharing)
+            return concurrently([&](SimpicClient &own) -> int {
+                return own.fetch(sha256, offset, length, out, out_offset, progress);
+            });
+
+        transport->receive_to(out, out_offset, start_fetch(sha256, offset, length), progress);
+        return 0;
+    }
+
+    int SimpicClient::fetch(Media &img, std::vector<char> &body)
+    {
+        body.clear();
+        body.reserve(img.length);
+
+        return fetch(img.sha256, 0, img.length, [&body](char *buf, size_t amnt) -> void {
+            body.insert(body.end(), buf, buf + amnt);
+        });
+    }
+
+    void SimpicClient::handler()
+    {
+        while (true)
+        {
+
+        }
+    }
+
+    void SimpicClient::set_no_data(bool data)
+    {
+        no_data = data;
+    }
+
+    void SimpicClient::set_preview(PreviewTypes type, uint32_t length)
+    {
+        preview = type;
+        preview_length = length;
+    }
+
+    void SimpicClient::set_scorer(QualityScorer *pool)
+    {
+        scorer = pool;
+    }
+
+    void SimpicClient::set_pipelined(unsigned int consumers, size_t memory_budget)
+    {
+        pipeline_consumers = consumers;
+        pipeline_budget = memory_budget;
+    }
+
+    void SimpicClient::set_transport(TransportKinds kind)
+    {
+        transport_kind = kind;
+    }
+
+    std::vector<MainHeaderCodes> SimpicClient::remove_files(std::vector<RemoveTarget> &targets)
+    {
+        require(ProtocolCapabilities::Remove, "remove_files");
+
+        std::vector<MainHeaderCodes> results;
+
+        if (sharing)
+        {
+            concurrently([&](SimpicClient &own) -> int {
+                results = own.remove_files(targets);
+                return 0;
+            });
+
+            return results;
+        }
+
+        /* A request carries at most a uint16_t worth of files. */
+        for (size_t first = 0; first < targets.size(); first += UINT16_MAX)
+        {
+            size_t count = std::min(targets.size() - first, (size_t) UINT16_MAX);
+
+            struct ClientRequest req;
+            req.request = (uint8_t) ClientRequests::Remove;
+            req.types = 0;
+            req.max_ham = 0;
+            req.path_length = 0;
+
+            struct ClientRemoveRequest rreq;
+            rreq.count = wire16(count);
+
+            OutboundMessage msg;
+            msg.add(req).add(rreq);
+
+            for (size_t i = first; i < first + count; i++)
+            {
+                struct ClientRemoveEntry entry;
+                std::memcpy(entry.sha256_hash, targets[i].sha256, SHA256_DIGEST_LENGTH);
+                entry.path_length = wire16(targets[i].path.size() + 1);
+                msg.add(entry).add(targets[i].path);
+            }
+
+            transport->send(msg);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                struct ServerRemoveResponse resp;
+                transport->recvall(&resp, sizeof(resp));
+                results.push_back((MainHeaderCodes) resp.code);
+            }
+        }
+
+        return results;
+    }
+
+    void SimpicClient::receive_hashes()
+    {
+        struct ServerHashesHeader hhdr;
+        transport->recvall(&hhdr, sizeof(hhdr));
+
+        hashes.resize(wire32(hhdr.count));
+
+        for (HashedImage &hashed : hashes)
+        {
+            struct ServerHashEntry entry;
+            transport->recvall(&entry, sizeof(entry));
+            entry.filename_length = wire16(entry.filename_length);
+            entry.path_length = wire16(entry.path_length);
+
+            std::memcpy(hashed.sha256, entry.sha256_hash, SHA256_DIGEST_LENGTH);
+            hashed.phash = wire64(entry.phash);
+
+            std::string name(entry.filename_length, '\0');
+            transport->recvall(name.data(), entry.filename_length);
+            hashed.filename = name.c_str();
+
+            if (entry.path_length != (uint16_t) -1)
+            {
+                std::string where(entry.path_length, '\0');
+                transport->recvall(where.data(), entry.path_length);
+                hashed.path = where.c_str();
+            }
+        }
+    }
+
+    void SimpicClient::set_perceptual_hashes(bool enabled)
+    {
+        want_hashes = enabled;
+    }
+
+    void SimpicClient::set_indexing(bool enabled)
+    {
+        indexing = enabled;
+
+        if (!enabled)
+        {
+            index.reset();
+            return;
+        }
+
+        if (index != nullptr)
+            return;
+
+        std::string folder = simpic_folder(home_folder());
+        mkdir_dir(folder);
+
+        index.reset(new SimilarityIndex(folder + "index"));
+        index->load();
+    }
+
+    SimilarityIndex *SimpicClient::similarity_index()
+    {
+        return index.get();
+    }
+
+    void SimpicClient::learn(std::string &path)
+    {
+        /* The sessions of a multiplexed client all feed the one index. */
+        SimpicClient *keeper = owner != nullptr ? owner : this;
+
+        if (keeper->index == nullptr)
+            return;
+
+        std::lock_guard<std::mutex> guard(keeper->sessions_lock);
+
+        for (HashedImage &hashed : hashes)
+        {
+            /* A scan without recursion sends no path: it is the directory that was scanned. */
+            std::string where = hashed.path.empty() ? path : hashed.path;
+
+            if (!where.empty() && where.back() != '/')
+                where += "/";
+
+            keeper->index->add(hashed.sha256, hashed.phash, where + hashed.filename);
+        }
+
+        keeper->index->save();
+    }
+
+    std::vector<IndexMatch> SimpicClient::similar(std::string &file, std::string &directory, bool recursive, uint8_t max_ham)
+    {
+        std::vector<IndexMatch> matches;
+
+        if (index != nullptr)
+        {
+            int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+            if (fd < 0)
+                throw ErrnoException(errno);
+
+            /* Hashed a chunk at a time; the file is only read whole if it has to be decoded. */
+            std::shared_ptr<EVP_MD_CTX> hasher(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+            EVP_DigestInit_ex(hasher.get(), EVP_sha256(), nullptr);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+            std::vector<char> contents(FETCH_BUFFER_SIZE);
+            off_t size = 0;
+            ssize_t n;
+
+            while ((n = pread(fd, contents.data(), contents.size(), size)) != 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+
+                if (n < 0)
+                {
+                    int err = errno;
+                    ::close(fd);
+                    throw ErrnoException(err);
+                }
+
+                EVP_DigestUpdate(hasher.get(), contents.data(), n);
+                size += n;
+            }
+
+            char sha256[SHA256_DIGEST_LENGTH];
+            EVP_DigestFinal_ex(hasher.get(), (unsigned char*) sha256, nullptr);
+
+            /* The server's own hash if the file was ever scanned, and one made here (much the same) if not. */
+            uint64_t phash = 0;
+            GrayImage gray;
+            bool known = index->lookup(sha256, phash);
+
+            if (!known)
+            {
+                contents.resize(size);
+                known = pread(fd, contents.data(), size, 0) == size && decode_grayscale(contents.data(), size, gray);
+
+                if (known)
+                    phash = dct_phash(gray);
+            }
+
+            ::close(fd);
+
+            if (known)
+            {
+                for (IndexMatch &match : index->query(phash, max_ham))
+                {
+                    /* Not the file itself. */
+                    if (match.path != file || std::memcmp(match.sha256, sha256, SHA256_DIGEST_LENGTH))
+                        matches.push_back(match);
+                }
+            }
+
+            if (!matches.empty())
+            {
+                index->hits++;
+                return matches;
+            }
+
+            index->misses++;
+        }
+
+        if (!connected)
+            make_connection();
+
+        std::vector<std::string> files = { file };
+
+        check(directory, recursive, max_ham, (uint8_t) DataTypes::Image, files, [&matches](void *data, DataTypes) -> void {
+            if (data == nullptr)
+                return;
+
+            Media *media = (Media*) data;
+
+            IndexMatch match;
+            std::memcpy(match.sha256, media->sha256, SHA256_DIGEST_LENGTH);
+            match.phash = 0;
+            match.distance = UINT8_MAX;
+            match.path = media->path.empty() || media->path.back() == '/' ? media->path + media->filename
+                            : media->path + "/" + media->filename;
+
+            matches.push_back(match);
+        });
+
+        return matches;
+    }
+
+    std::vector<HashedImage> &SimpicClient::perceptual_hashes()
+    {
+        return hashes;
+    }
+
+    std::vector<std::string> SimpicClient::list(std::string &path)
+    {
+        require(ProtocolCapabilities::List, "list");
+
+        if (sharing)
+        {
+            std::vector<std::string> names;
+
+            concurrently([&](SimpicClient &own) -> int {
+                names = own.list(path);
+                return 0;
+            });
+
+            return names;
+        }
+
+        struct ClientRequest req;
+        req.request = (uint8_t) ClientRequests::List;
+        req.types = 0;
+        req.max_ham = 0;
+        req.path_length = wire16(path.size() + 1);
+
+        OutboundMessage msg;
+        msg.add(req).add(path);
+        transport->send(msg);
+
+        struct ServerListResponse resp;
+        transport->recvall(&resp, sizeof(resp));
+        resp.count = wire32(resp.count);
+        resp.names_length = wire32(resp.names_length);
+
+        if (resp.code != (uint8_t) MainHeaderCodes::Success)
+            throw ErrnoException(resp._errno);
+
+        /* The names come back to back, each up to its NUL, all in one read. */
+        std::string blob(resp.names_length, '\0');
+        transport->recvall(blob.data(), blob.size());
+
+        std::vector<std::string> names;
+        size_t start = 0;
+
+        while (start < blob.size())
+        {
+            size_t end = blob.find('\0', start);
+
+            if (end == std::string::npos)
+                break;
+
+            names.push_back(blob.substr(start, end - start));
+            start = end + 1;
+        }
+
+        if (names.size() != resp.count || start != blob.size())
+            throw simpic_networking_exception("Error list(): the server sent " + std::to_string(names.size()) + " names in "
+                + std::to_string(blob.size()) + " bytes, not " + std::to_string(resp.count) + ".", EPROTO);
+
+        return names;
+    }
+
+    void SimpicClient::set_recording(std::string path)
+    {
+        record_path = path;
+    }
+
+    void SimpicClient::set_replay(std::string path, bool realtime)
+    {
+        replay_path = path;
+        replay_realtime = realtime;
+    }
+
+    void SimpicClient::set_incremental(bool enabled, bool deltas)
+    {
+        incremental = enabled;
+        server_deltas = deltas;
+    }
+
+    ScanState *SimpicClient::scan_state()
+    {
+        return state.get();
+    }
+
+    void SimpicClient::set_ignore_reviewed(bool enabled, bool server_filter)
+    {
+        ignoring = enabled;
+        server_ignore = server_filter;
+    }
+
+    ReviewedSets *SimpicClient::reviewed_sets()
+    {
+        return reviewed.get();
+    }
+
+    void SimpicClient::close()
+    {
+        struct ClientRequest req;
+        req.request = (uint8_t) ClientRequests::Exit;
+        req.path_length = 0;
+
+        /* The streams are gone with their sessions, each ended by the frame that stands in for its Exit; only the */
+        /* connection is left, which takes no Exit of its own (see StreamFrame). */
+        mux.reset();
+
+        /* A connection that is already gone needs no Exit; it is closed all the same. */
+        for (std::unique_ptr<Transport> &spare : idle)
+        {
+            int spare_fd = spare->fd;
+
+            try
+            {
+                spare->sendall(&req, sizeof(req));
+                spare->flush();
+            }
+            catch (simpic_networking_exception &ex)
+            {
+
+            }
+
+            spare.reset();
+            ::close(spare_fd);
+        }
+
+        idle.clear();
+
+        if (transport != nullptr)
+        {
+            try
+            {
+                transport->sendall(&req, sizeof(req));
+                transport->flush();
+            }
+            catch (simpic_networking_exception &ex)
+            {
+
+            }
+
+            transport.reset();
+        }
+
+        if (fd >= 0)
+            ::close(fd);
+
+        fd = -1;
+        connected = false;
     }
 }
\ No newline at end of file
@@ -12,6 +12,11 @@
 #include <cerrno>
 
 #include <functional>
+#include <future>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -19,12 +24,29 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "networking.hpp"
 #include "simpic_image.hpp"
+#include "simpic_media.hpp"
+#include "simpic_quality.hpp"
+#include "simpic_pipeline.hpp"
+#include "simpic_scan_state.hpp"
+#include "simpic_reviewed.hpp"
+#include "simpic_transport.hpp"
+#include "simpic_capture.hpp"
+#include "simpic_mux.hpp"
+#include "simpic_index.hpp"
+#include "simpic_batch.hpp"
 #include "simpic_protocol.hpp"
 #include "utils.hpp"
 
+/* How much file data SimpicClient::fetch() hands to its sink at a time. */
+#define FETCH_BUFFER_SIZE 65536
+
+/* How much of a set held back by request() (see set_incremental()) may be kept in memory; the rest is spilled to disk. */
+#define STAGING_MEMORY_BUDGET (64 * 1024 * 1024)
+
 namespace SimpicClientLib
 {
     typedef DataTypes SimpicClientTypes;
@@ -68,6 +90,13 @@ namespace SimpicClientLib
         std::string &what();
     };
 
+    /* A file to remove after its scan is over, by where it is; see SimpicClient::remove_files(). */
+    struct RemoveTarget
+    {
+        char sha256[SHA256_DIGEST_LENGTH];
+        std::string path; // the full path, as the server sees it.
+    };
+
     class SimpicClient
     {
     private:
@@ -75,28 +104,174 @@ namespace SimpicClientLib
         bool connected;
         bool no_data;
 
+        /* Whether keep() or remove() was called for the set at hand. */
+        bool answered;
+
+        PreviewTypes preview;
+        uint32_t preview_length;
+
+        QualityScorer *scorer;
+
+        unsigned int pipeline_consumers;
+        size_t pipeline_budget;
+        std::atomic<bool> pipelining;
+
+        bool incremental;
+        bool server_deltas;
+        std::unique_ptr<ScanState> state;
+
+        bool ignoring;
+        bool server_ignore;
+        std::unique_ptr<ReviewedSets> reviewed;
+        std::string reviewing; // the grouping key of the set at hand, while it is with the callback.
+
         std::string dfolder;
 
+        /* Everything on fd goes through this, from make_connection() on. */
+        std::unique_ptr<Transport> transport;
+
+        bool want_hashes;
+        std::vector<HashedImage> hashes;
+
+        /* See set_indexing(). */
+        bool indexing;
+        std::unique_ptr<SimilarityIndex> index;
+
+        /* See set_recording() and set_replay(); empty when not in use. */
+        std::string record_path;
+        std::string replay_path;
+        bool replay_realtime;
+
+        /* The newest protocol version to offer in the hello; see set_protocol(). */
+        uint8_t max_protocol;
+
+        /* See set_multiplexed(). sharing is whether it took effect: every request then runs on a session of its own (a */
+        /* SimpicClient on a stream of mux, or on a connection of its own), found by the thread that made it. */
+        bool multiplexed;
+        bool sharing;
+        std::unique_ptr<Multiplexer> mux;
+        std::mutex sessions_lock;
+        std::map<std::thread::id, SimpicClient*> sessions;
+        std::vector<std::unique_ptr<Transport>> idle; // without mux, the connections of finished sessions, for the next.
+
+        SimpicClient *owner; // of a session, the client it is a session of.
+
+        /* A session of parent, with its settings. */
+        SimpicClient(SimpicClient &parent);
+
+        /* The session of the request the calling thread is in the middle of, if sharing. */
+        SimpicClient *session();
+
+        /* Run call on a new session, as a request of its own. */
+        int concurrently(std::function<int(SimpicClient&)> call);
+
+        /* Name resolution runs in the background from the constructor until make_connection() needs it. */
+        std::future<std::vector<struct sockaddr_storage>> resolution;
+
         void handler();
+
+        /* Connect a socket to whichever address answers first. */
+        int dial();
+
+        /* Offer v2 on sock; false if the server doesn't answer with a ServerHello within HELLO_TIMEOUT_MS. */
+        bool hello(int sock, struct ClientHello &offer, struct ServerHello &reply);
+
+        /* Whether the connection speaks the *2 structures. */
+        bool wide();
+
+        /* Throws simpic_networking_exception (EOPNOTSUPP) before anything is sent, if the server lacks capability. */
+        void require(ProtocolCapabilities capability, const std::string &what);
+
+        /* The structures v2 keeps from v1 are little-endian under v2, and in the host's order (as ever) under v1. */
+        /* Each converts either way. */
+        uint16_t wire16(uint16_t value);
+        uint32_t wire32(uint32_t value);
+        uint64_t wire64(uint64_t value);
+
+        /* Read the v1 or v2 form of each, into the v2 one. */
+        void receive_update(struct UpdateHeader2 &uh);
+        void receive_main(struct MainHeader2 &mhdr);
+        void receive_set(struct SetHeader2 &shdr);
+
+        /* Add a ClientAction (or ClientAction2) with its indices to msg; source is only sent for ClientActions::Link. */
+        void add_action(OutboundMessage &msg, ClientActions action, int source, std::vector<int> &indices);
+        void send_keep();
+
+        void receive_preview(Media *media);
+        void receive_hashes();
+
+        /* Add what receive_hashes() got, of a request of path, to the index. */
+        void learn(std::string &path);
+
+        Media *receive_media(DataTypes type, int index);
+
+        /* Ask for a range of a file by hash; returns how many bytes of it follow. */
+        uint64_t start_fetch(const char *sha256, uint64_t offset, uint64_t length);
+        /* Pass on a set that was held back whole, or (release()) the start of one that turned out to have changed */
+        /* part of the way, and what of it was held; the rest of it follows as usual. */
+        void deliver(DataTypes type, std::vector<Media*> &set, std::vector<Media*> &garbage, Pipeline *pipeline,
+                        std::function<void(void*, DataTypes)> &callback);
+        void release(DataTypes type, std::vector<Media*> &set, std::vector<Media*> &garbage, Pipeline *pipeline,
+                        std::function<void(void*, DataTypes)> &callback);
     public:
-        struct in_addr server_addr;
-        struct sockaddr_in saddr;
+        std::string host;
+        std::vector<struct sockaddr_storage> addresses;
+        struct sockaddr_storage peer; // whichever address won the connection race.
+        struct in_addr server_addr; // the same, if it is IPv4 (as all of them used to be); zeroed otherwise.
+        struct sockaddr_in saddr; // ditto.
         int fd;
         uint16_t port;
 
+        /* What set_transport() asked for, until make_connection(); then, what it got. */
+        TransportKinds transport_kind;
+
+        /* What make_connection() negotiated: 1, or 2 with the ProtocolCapabilities both sides have. */
+        uint8_t protocol_version;
+        uint32_t capabilities;
+
         std::string cache_location;
 
         /* Initialize a client where addr and port form the address of the server. */
+        /* Resolution starts immediately in the background; errors from it are thrown by make_connection(). */
         SimpicClient(std::string &addr, uint16_t port);
 
-        /* Connect to the server if possible. Returns the errno value if it valued; otherwise, it doesn't return, instead calling the handler which blocks the main thread. */
+        /* Connect to the server, racing every address it resolved to (IPv6 and IPv4) per RFC 8305, and negotiate the */
+        /* protocol version (see ClientHello). A server that doesn't speak v2 is connected to again, and spoken v1 to; */
+        /* it is remembered in ~/.simpic/protocol for PROTOCOL_VERDICT_SECONDS, so that later connections to it (of this */
+        /* process or any other) skip the hello. */
+        /* Throws simpic_networking_exception if no address answers. */
         int make_connection();
 
+        /* Offer at most this protocol version (1 never sends a hello); takes effect on make_connection(). */
+        void set_protocol(uint8_t version);
+
+        /* Whether make_connection() found the server to have capability. Without it, request() leaves the extension */
+        /* out and does without (see each setter), and list(), remove_files(), link() and fetch() throw. */
+        bool has(ProtocolCapabilities capability);
+
+        /* Let any number of threads make requests (request(), check(), fetch(), list(), ...) of this one client at */
+        /* once, each callback seeing only its own request's sets, and keep()/remove()/link() answering for the set of */
+        /* the calling thread. With a server that has ProtocolCapabilities::Streams, they all share the one connection; */
+        /* otherwise each gets a connection of its own, handed on to the next request once it is done. The setters are */
+        /* still not thread-safe, and scan_state(), reviewed_sets() and perceptual_hashes() are those of whichever */
+        /* request finished last; what the others reviewed is kept on disk all the same. Takes effect on */
+        /* make_connection(), and not with set_recording() or set_replay(). */
+        void set_multiplexed(bool enabled);
+
         /* After the collections are received, pass a vector of ints to describe which you want to delete. */
         void remove(std::vector<int> &selected);
 
-        /* Keep everything. */
-        void keep();
+        /* Keep everything. With set_ignore_reviewed(), the set is also remembered as reviewed, unless reviewed is false. */
+        void keep(bool reviewed = true);
+
+        /* Have the server replace the duplicates with links to source (see ClientActions::Link), instead of deleting them. */
+        /* With set_ignore_reviewed(), this counts as reviewing the set, as keep() does. Needs ProtocolCapabilities::Link. */
+        void link(int source, std::vector<int> &duplicates);
+
+        /* Remove files once their scan is over (every set having been kept), so that they can be reviewed in any order. */
+        /* Each is only removed if it still has its hash. Returns how it went for each, in order (see ServerRemoveResponse). */
+        /* This cannot be called while a request() is streaming on the same connection. Needs ProtocolCapabilities::Remove. */
+        std::vector<MainHeaderCodes> remove_files(std::vector<RemoveTarget> &targets);
 
 
         /* Send the request to the server to scan a path for duplicate media. */
@@ -105,15 +280,117 @@ namespace SimpicClientLib
         /* Other items of the set will point to a valid object, the type specified by the second parameter*/
         /* When the set is done, another nullptr will be sent. It is up to you to keep track of this. */
         /* Then it shall repeat until it is no longer called. */
-        /* If type == DataTypes::Update, cast the void* to struct UpdateHeader */
+        /* If type == DataTypes::Update, cast the void* to struct UpdateHeader2 (whichever version the server speaks) */
         int request(std::string &path, bool recursive, uint8_t max_ham, uint8_t types,
                         std::function<void(void*, DataTypes)> callback);
 
+
+        /* Like request(), but the callback gets the sets as a SetBatch, window sets at a time (the last one may be short). */
+        /* The server can't wait on a window, so with window > 1 every set is kept, and the callback must not call */
+        /* keep() or remove(). With a window of one, the callback may answer for its set; if it doesn't, the set is kept. */
+        /* Progress updates are not passed on. Combine with set_pipelined() only with a single consumer. */
+        int request_batched(std::string &path, bool recursive, uint8_t max_ham, uint8_t types, unsigned int window,
+                        std::function<void(SetBatch&)> callback);
+
+        /* Ask whether any of files (paths as the server sees them) would be duplicates of something in path. */
+        /* The callback is called as with request(), once per set of conflicts: the set_no of every media in it */
+        /* is the index into files of the file it conflicts with. No action is expected afterwards. */
+        /* Returns how many of the files had conflicts. */
+        int check(std::string &path, bool recursive, uint8_t max_ham, uint8_t types, std::vector<std::string> &files,
+                        std::function<void(void*, DataTypes)> callback);
+
         
         /* When making a request for similar images, do you want to not the server to send the image itself over? This saves time and bandwidth, especially for very large files. */
         void set_no_data(bool data);
 
-        /* After everything is said and done, exit without a hitch. */
+        /* Ask the server for a cheap preview of every file (see PreviewTypes), of at most length bytes. */
+        /* It lands in Media::preview; pair it with set_no_data(true) to leave the full data for fetch(). A server */
+        /* without ProtocolCapabilities::Previews isn't asked, and no preview comes. */
+        void set_preview(PreviewTypes type, uint32_t length);
+
+        /* Buffer the data of every image and score it on this pool before the end of its set is signalled; nullptr turns it off. */
+        /* Only takes effect with data being sent (set_no_data(false)). */
+        void set_scorer(QualityScorer *pool);
+
+        /* Run the callback on consumer threads (round-robin by set) while the calling thread only reads the socket. */
+        /* Set bodies are held in memory up to memory_budget bytes and spilled to a temporary file past it. */
+        /* The server is told to keep every set, since it can't wait on the consumers: keep()/remove() do nothing meanwhile. */
+        /* consumers == 0 turns it back off. */
+        void set_pipelined(unsigned int consumers, size_t memory_budget);
+
+        /* Remember every scan's result in ~/.simpic/scans/, and on the next scan of the same path present only the sets */
+        /* whose membership changed since; the unchanged ones are kept without ever reaching the callback. */
+        /* With server_deltas, the server is asked to send only those sets in the first place (RequestExtensions::Delta); */
+        /* otherwise (or if the server lacks ProtocolCapabilities::Delta) the whole result comes over the wire and the */
+        /* comparison is made here. A set is held back only until */
+        /* a file turns up that no set had last time, with its data in memory up to STAGING_MEMORY_BUDGET and spilled past it. */
+        void set_incremental(bool enabled, bool server_deltas);
+
+        /* Talk to the server over this kind of transport (see TransportKinds); takes effect on make_connection(). */
+        void set_transport(TransportKinds kind);
+
+        /* Have every request() also bring back the perceptual hash of every image it scanned, whether or not it was in a */
+        /* set, into perceptual_hashes(); used to compare scans of different directories (see SubtreeFanout). A server */
+        /* without ProtocolCapabilities::PerceptualHashes isn't asked, and perceptual_hashes() stays empty. */
+        void set_perceptual_hashes(bool enabled);
+
+        /* What the last request() hashed, with set_perceptual_hashes(); this is kept until the next one, even when */
+        /* request() throws NoResultsException. */
+        std::vector<HashedImage> &perceptual_hashes();
+
+        /* Keep the perceptual hash of every image each request() looks at (asking the server for them, as with */
+        /* set_perceptual_hashes()) in a persistent index in ~/.simpic/index, which similar() answers from. Nothing is */
+        /* added from a server without ProtocolCapabilities::PerceptualHashes. */
+        void set_indexing(bool enabled);
+
+        /* The index, with set_indexing(); nullptr otherwise. */
+        SimilarityIndex *similarity_index();
+
+        /* The images within max_ham of the image at file (on this machine), nearest first: from the index, with */
+        /* set_indexing(), if it knows of any; if not, from the server, by a check() of file against directory (so the */
+        /* server must see file where this machine does), connecting first if need be. The file's perceptual hash is */
+        /* the server's if it was ever indexed, and is made here (see dct_phash()) if it wasn't. */
+        std::vector<IndexMatch> similar(std::string &file, std::string &directory, bool recursive, uint8_t max_ham);
+
+        /* The names of the subdirectories of path on the server. Throws ErrnoException if it can't be listed. */
+        /* Needs ProtocolCapabilities::List. */
+        std::vector<std::string> list(std::string &path);
+
+        /* Tee everything the server sends (and everything sent to it), timestamped, into a capture file at path; */
+        /* takes effect on make_connection(), and an empty path turns it off. See RecordingTransport. */
+        void set_recording(std::string path);
+
+        /* Have make_connection() connect to a capture instead of the server, and request() play it back: at the */
+        /* original pace if realtime, otherwise as fast as the callback takes it. Requests should be made as they */
+        /* were when it was recorded; what they ask for makes no difference. An empty path turns it off. */
+        void set_replay(std::string path, bool realtime);
+
+        /* The merged result of the last incremental request(), or nullptr if there wasn't one. */
+        ScanState *scan_state();
+
+        /* Don't present the sets that were kept whole in an earlier request() (of any path) and haven't changed since; */
+        /* they are kept without reaching the callback. The list is in ~/.simpic/reviewed. With server_filter, the server */
+        /* is sent the list as a Bloom filter (RequestExtensions::Ignore) so that it leaves them out in the first place, */
+        /* and whatever it leaves out is checked against the list itself; otherwise (or if the server lacks */
+        /* ProtocolCapabilities::Ignore) every set comes over the wire and the comparison is made here. */
+        void set_ignore_reviewed(bool enabled, bool server_filter);
+
+        /* The list of the last request() with set_ignore_reviewed(), or nullptr if there wasn't one. */
+        ReviewedSets *reviewed_sets();
+
+        /* Fetch length bytes of a file, starting at offset, by its SHA256 hash; the sink is called with each chunk. */
+        /* This cannot be called while a request() is streaming on the same connection. Needs ProtocolCapabilities::Previews. */
+        int fetch(const char *sha256, uint64_t offset, uint64_t length, std::function<void(char*, size_t)> sink);
+
+        /* Like the above, but straight into the file out at out_offset (with io_uring, without a copy in between). */
+        /* progress is called with every chunk before it is written. */
+        int fetch(const char *sha256, uint64_t offset, uint64_t length, int out, off_t out_offset,
+                        std::function<void(const char*, size_t)> progress);
+
+        /* Fetch the whole of a file that was previewed (or sent without data) during a request(). */
+        int fetch(Media &media, std::vector<char> &body);
+
+        /* After everything is said and done, exit without a hitch. Doesn't throw if the connection is gone already. */
         void close();
     };
 }
\ No newline at end of file
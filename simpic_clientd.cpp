@@ -0,0 +1,530 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.hpp"
+#include "simpic_client.hpp"
+#include "simpic_feed.hpp"
+
+using namespace SimpicClientLib;
+
+/* simpic_clientd - runs scans for any number of local frontends and publishes their sets into shared memory feeds */
+/* (see simpic_feed.hpp), keeping its connections to the servers open from scan to scan. A frontend asks for a scan */
+/* on the daemon's UNIX socket and gets the name of a feed back; a scan that is already running (or done) with the */
+/* same parameters is shared rather than run again. */
+/* Commands are tab-separated lines: SCAN/RESCAN host port max_ham types recursive path, LIST, DROP name. */
+
+struct Scan
+{
+    std::string host;
+    uint16_t port;
+    std::string path;
+    bool recursive;
+    uint8_t max_ham;
+    uint8_t types;
+
+    FeedWriter *feed;
+    bool finished; // set (locked) once run_scan() is done with it, so the feed can go.
+    bool dropped; // DROPped while it ran (locked): no longer in scans, and freed by finish_scan().
+};
+
+static std::mutex lock;
+static std::vector<Scan*> scans;
+static std::map<std::pair<std::string, uint16_t>, std::vector<SimpicClient*>> idle;
+
+static uint64_t feed_size = (uint64_t) CLIENTD_FEED_MB << 20;
+static size_t max_feeds = CLIENTD_MAX_FEEDS;
+static unsigned int feeds_made = 0;
+static std::string socket_path;
+
+void help()
+{
+    const char *help_text =
+    "simpic_clientd - Runs Simpic scans for local frontends and shares the results through shared memory.\n"
+    "USAGE:\n\n"
+    "-s, --socket [PATH]                Where to listen (Default: $XDG_RUNTIME_DIR/simpic_clientd.sock).\n"
+    "-fm, --feed-memory [MB]            The most memory each feed's ring of sets takes (Default: 64).\n"
+    "-mf, --max-feeds [N]               Keep up to N feeds; the oldest finished one goes first (Default: 16).\n"
+    "-?, --help                         Shows this menu.\n";
+
+    std::cout << help_text << std::endl;
+}
+
+/* A connection kept open since an earlier scan, or a new one. */
+SimpicClient *take_connection(std::string &host, uint16_t port, bool &warm)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<SimpicClient*> &pool = idle[{host, port}];
+
+        if (!pool.empty())
+        {
+            SimpicClient *client = pool.back();
+            pool.pop_back();
+            warm = true;
+            return client;
+        }
+    }
+
+    warm = false;
+
+    SimpicClient *client = new SimpicClient(host, port);
+    client->set_no_data(true);
+
+    try
+    {
+        client->make_connection();
+    }
+    catch (...)
+    {
+        delete client;
+        throw;
+    }
+
+    return client;
+}
+
+void drop_connection(SimpicClient *client)
+{
+    if (client->fd >= 0)
+        ::close(client->fd);
+
+    delete client;
+}
+
+/* The scan is over; from here on, nothing else of it is touched by its thread. */
+void finish_scan(Scan *scan, FeedStates outcome)
+{
+    scan->feed->finish(outcome);
+
+    std::lock_guard<std::mutex> guard(lock);
+    scan->finished = true;
+
+    /* No one else knows of it anymore. */
+    if (scan->dropped)
+    {
+        delete scan->feed;
+        delete scan;
+    }
+}
+
+void run_scan(Scan *scan)
+{
+    FeedStates outcome = FeedStates::Done;
+    size_t published = 0;
+
+    /* A kept-open connection may have been closed by the server meanwhile: that gets one more try on a new one. */
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        bool warm = false;
+        SimpicClient *client = nullptr;
+        std::vector<Media*> set;
+        bool feed_failed = false; // an ErrnoException of the feed's, rather than the server's.
+
+        try
+        {
+            client = take_connection(scan->host, scan->port, warm);
+
+            client->request(scan->path, scan->recursive, scan->max_ham, scan->types, [scan, client, &set, &published, &feed_failed](void *data, DataTypes type) -> void {
+                if (type == DataTypes::Update)
+                    return;
+
+                if (data != nullptr)
+                {
+                    set.push_back((Media*) data);
+                    return;
+                }
+
+                /* The end of a set (its beginning leaves it empty). */
+                if (set.empty())
+                    return;
+
+                try
+                {
+                    scan->feed->publish(type, set);
+                }
+                catch (ErrnoException &ex)
+                {
+                    feed_failed = true;
+                    throw;
+                }
+
+                published++;
+                set.clear();
+                client->keep();
+            });
+        }
+        catch (NoResultsException &ex)
+        {
+
+        }
+        catch (InUseException &ex)
+        {
+            std::cerr << scan->path << ": the server is already scanning it.\n";
+            outcome = FeedStates::Failed;
+        }
+        catch (ErrnoException &ex)
+        {
+            std::cerr << scan->path << ": " << ex.what() << std::endl;
+            outcome = FeedStates::Failed;
+
+            /* The server failed the scan, and said so, if it wasn't the feed; if it was, the server is mid-set. */
+            if (feed_failed)
+            {
+                drop_connection(client);
+                finish_scan(scan, outcome);
+                return;
+            }
+        }
+        catch (simpic_networking_exception &ex)
+        {
+            std::cerr << scan->path << ": " << ex.what() << std::endl;
+
+            if (client != nullptr)
+                drop_connection(client);
+
+            /* Only retry if nothing was published yet, or the feed would have the first sets twice. */
+            if (warm && !published)
+                continue;
+
+            finish_scan(scan, FeedStates::Failed);
+            return;
+        }
+        catch (std::runtime_error &ex)
+        {
+            /* The server's name didn't resolve. */
+            std::cerr << scan->host << ": " << ex.what() << std::endl;
+            finish_scan(scan, FeedStates::Failed);
+            return;
+        }
+        catch (LimitsException &ex)
+        {
+            std::cerr << scan->path << ": " << ex.what() << std::endl;
+            drop_connection(client);
+            finish_scan(scan, FeedStates::Failed);
+            return;
+        }
+        catch (...)
+        {
+            /* Whatever it was, the connection was left in the middle of the scan. */
+            std::cerr << scan->path << ": the scan stopped on an unexpected error.\n";
+
+            if (client != nullptr)
+                drop_connection(client);
+
+            finish_scan(scan, FeedStates::Failed);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            idle[{scan->host, scan->port}].push_back(client);
+        }
+
+        break;
+    }
+
+    finish_scan(scan, outcome);
+}
+
+/* Make room for one more feed. Called locked. */
+void evict()
+{
+    while (scans.size() >= max_feeds)
+    {
+        auto oldest = scans.end();
+
+        for (auto it = scans.begin(); it != scans.end(); it++)
+        {
+            if ((*it)->finished)
+            {
+                oldest = it;
+                break;
+            }
+        }
+
+        /* Everything is still running. */
+        if (oldest == scans.end())
+            return;
+
+        (*oldest)->feed->unlink();
+        delete (*oldest)->feed;
+        delete *oldest;
+        scans.erase(oldest);
+    }
+}
+
+std::vector<std::string> split(const std::string &line, size_t fields)
+{
+    std::vector<std::string> out;
+    size_t at = 0;
+
+    /* The last field takes the rest of the line, tabs and all. */
+    while (out.size() + 1 < fields)
+    {
+        size_t tab = line.find('\t', at);
+
+        if (tab == std::string::npos)
+            break;
+
+        out.push_back(line.substr(at, tab - at));
+        at = tab + 1;
+    }
+
+    out.push_back(line.substr(at));
+    return out;
+}
+
+std::string command(const std::string &line)
+{
+    std::vector<std::string> args = split(line, 7);
+
+    if ((args[0] == "SCAN" || args[0] == "RESCAN") && args.size() == 7)
+    {
+        Scan *scan = new Scan;
+        scan->feed = nullptr;
+        scan->finished = false;
+        scan->dropped = false;
+
+        try
+        {
+            scan->host = args[1];
+            scan->port = std::stoi(args[2]);
+            scan->max_ham = std::stoi(args[3]);
+            scan->types = std::stoi(args[4]);
+            scan->recursive = args[5] == "1";
+            scan->path = args[6];
+        }
+        catch (std::exception &ex)
+        {
+            delete scan;
+            return "ERR " + std::to_string(EINVAL) + " bad arguments";
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        /* Attach to the same scan if there is one, unless it failed or a fresh one was asked for. */
+        if (args[0] == "SCAN")
+        {
+            for (Scan *other : scans)
+            {
+                if (other->host == scan->host && other->port == scan->port && other->path == scan->path
+                                && other->recursive == scan->recursive && other->max_ham == scan->max_ham
+                                && other->types == scan->types && other->feed->state() != FeedStates::Failed)
+                {
+                    delete scan;
+                    return "OK " + other->feed->name;
+                }
+            }
+        }
+
+        evict();
+
+        try
+        {
+            std::string name = FEED_PREFIX + std::to_string(getpid()) + "-" + std::to_string(feeds_made++);
+            scan->feed = new FeedWriter(name, feed_size);
+            scan->feed->describe(scan->host, scan->port, scan->path, scan->recursive, scan->max_ham, scan->types);
+        }
+        catch (ErrnoException &ex)
+        {
+            delete scan;
+            return "ERR " + std::to_string(ex._errno) + " " + ex.what();
+        }
+
+        scans.push_back(scan);
+        std::thread(run_scan, scan).detach();
+
+        return "OK " + scan->feed->name;
+    }
+
+    if (args[0] == "LIST")
+    {
+        const char *states[] = {"scanning", "done", "failed"};
+        std::string out;
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (Scan *scan : scans)
+        {
+            out += "FEED\t" + scan->feed->name + "\t" + states[(int) scan->feed->state()] + "\t" + scan->host + "\t"
+                            + std::to_string(scan->port) + "\t" + scan->path + "\n";
+        }
+
+        return out + "END";
+    }
+
+    if (args[0] == "DROP" && args.size() == 2)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (auto it = scans.begin(); it != scans.end(); it++)
+        {
+            if ((*it)->feed->name != args[1])
+                continue;
+
+            /* A running scan keeps writing into it, so only its name goes now; finish_scan() frees the rest. */
+            (*it)->feed->unlink();
+
+            if ((*it)->finished)
+            {
+                delete (*it)->feed;
+                delete *it;
+            }
+            else
+            {
+                (*it)->dropped = true;
+            }
+
+            scans.erase(it);
+            return "OK";
+        }
+
+        return "ERR " + std::to_string(ENOENT) + " no such feed";
+    }
+
+    return "ERR " + std::to_string(EINVAL) + " unknown command";
+}
+
+void serve(int fd)
+{
+    std::string line;
+    char buffer[4096];
+
+    while (true)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+
+        if (n <= 0)
+            break;
+
+        line.append(buffer, n);
+
+        size_t newline;
+
+        while ((newline = line.find('\n')) != std::string::npos)
+        {
+            std::string reply = command(line.substr(0, newline)) + "\n";
+            line.erase(0, newline + 1);
+
+            if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+            {
+                ::close(fd);
+                return;
+            }
+        }
+    }
+
+    ::close(fd);
+}
+
+/* The feeds are named objects that outlive the process; they go with it. */
+void shutdown_on_signal(sigset_t signals)
+{
+    int sig;
+    sigwait(&signals, &sig);
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (Scan *scan : scans)
+        scan->feed->unlink();
+
+    unlink(socket_path.c_str());
+    std::_Exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    socket_path = clientd_socket_path();
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "-?") || !std::strcmp(argv[i], "--help"))
+        {
+            help();
+            return 0;
+        }
+
+        if (argv[i + 1] == nullptr)
+        {
+            std::cerr << argv[i] << " requires an argument, or is unrecognized.\n";
+            return -1;
+        }
+
+        try
+        {
+            if (!std::strcmp(argv[i], "-s") || !std::strcmp(argv[i], "--socket"))
+                socket_path = argv[++i];
+
+            else if (!std::strcmp(argv[i], "-fm") || !std::strcmp(argv[i], "--feed-memory"))
+                feed_size = (uint64_t) std::stoi(argv[++i]) << 20;
+
+            else if (!std::strcmp(argv[i], "-mf") || !std::strcmp(argv[i], "--max-feeds"))
+                max_feeds = std::max(std::stoi(argv[++i]), 1);
+
+            else
+            {
+                std::cerr << "Unrecognized command-line argument '" << argv[i] << "'.\n";
+                return -1;
+            }
+        }
+        catch (std::exception &ex)
+        {
+            std::cerr << "Error parsing " << argv[i] << ": " << ex.what() << std::endl;
+            return -1;
+        }
+    }
+
+    /* Every thread from here on leaves SIGINT and SIGTERM to the one that cleans up. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread(shutdown_on_signal, signals).detach();
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    /* A socket left behind by a daemon that died. */
+    unlink(socket_path.c_str());
+
+    if (listener < 0 || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(listener, 16) < 0)
+    {
+        std::cerr << "Could not listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    std::cerr << "simpic_clientd listening on " << socket_path << std::endl;
+
+    while (true)
+    {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            std::cerr << "accept(): " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+
+        std::thread(serve, fd).detach();
+    }
+}
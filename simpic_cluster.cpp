@@ -0,0 +1,229 @@
+#include "simpic_cluster.hpp"
+
+#include <cstring>
+#include <utility>
+
+namespace SimpicClientLib
+{
+    MediaInterner::MediaInterner()
+    {
+        slots.assign(1024, 0);
+    }
+
+    uint64_t MediaInterner::hash(const char *sha256, const char *path, size_t length)
+    {
+        /* The hash is already uniform; the path is folded in with FNV-1a. */
+        uint64_t h;
+        std::memcpy(&h, sha256, sizeof(h));
+
+        for (size_t i = 0; i < length; i++)
+            h = (h ^ (uint8_t) path[i]) * 0x100000001b3ULL;
+
+        return h ^ (h >> 29);
+    }
+
+    bool MediaInterner::same(uint32_t id, const char *sha256, const char *path, size_t length) const
+    {
+        if (std::memcmp(sha256s.data() + (size_t) id * SHA256_DIGEST_LENGTH, sha256, SHA256_DIGEST_LENGTH))
+            return false;
+
+        const char *ours = paths.data() + path_offsets[id];
+        return !std::strncmp(ours, path, length) && ours[length] == '\0';
+    }
+
+    void MediaInterner::grow()
+    {
+        std::vector<uint32_t> bigger(slots.size() * 2, 0);
+        size_t mask = bigger.size() - 1;
+
+        for (uint32_t id = 0; id < path_offsets.size(); id++)
+        {
+            const char *path = paths.data() + path_offsets[id];
+            size_t at = hash((const char*) sha256s.data() + (size_t) id * SHA256_DIGEST_LENGTH, path, std::strlen(path)) & mask;
+
+            while (bigger[at])
+                at = (at + 1) & mask;
+
+            bigger[at] = id + 1;
+        }
+
+        slots.swap(bigger);
+    }
+
+    uint32_t MediaInterner::intern(const char *sha256, const std::string &path)
+    {
+        if ((path_offsets.size() + 1) * 100 > slots.size() * INTERN_MAX_LOAD)
+            grow();
+
+        size_t mask = slots.size() - 1;
+        size_t at = hash(sha256, path.c_str(), path.size()) & mask;
+
+        while (slots[at])
+        {
+            if (same(slots[at] - 1, sha256, path.c_str(), path.size()))
+                return slots[at] - 1;
+
+            at = (at + 1) & mask;
+        }
+
+        uint32_t id = path_offsets.size();
+        slots[at] = id + 1;
+
+        sha256s.insert(sha256s.end(), (const uint8_t*) sha256, (const uint8_t*) sha256 + SHA256_DIGEST_LENGTH);
+        path_offsets.push_back(paths.size());
+        paths.insert(paths.end(), path.c_str(), path.c_str() + path.size() + 1);
+
+        return id;
+    }
+
+    size_t MediaInterner::size() const
+    {
+        return path_offsets.size();
+    }
+
+    const char *MediaInterner::path(uint32_t id) const
+    {
+        return paths.data() + path_offsets[id];
+    }
+
+    const uint8_t *MediaInterner::sha256(uint32_t id) const
+    {
+        return sha256s.data() + (size_t) id * SHA256_DIGEST_LENGTH;
+    }
+
+    size_t Clusters::count() const
+    {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    uint32_t ClusterMerger::find(uint32_t id)
+    {
+        /* Path halving: every other node on the way up is pointed at its grandparent. */
+        while (parent[id] != id)
+        {
+            parent[id] = parent[parent[id]];
+            id = parent[id];
+        }
+
+        return id;
+    }
+
+    void ClusterMerger::unite(uint32_t a, uint32_t b)
+    {
+        a = find(a);
+        b = find(b);
+
+        if (a == b)
+            return;
+
+        if (rank[a] < rank[b])
+            std::swap(a, b);
+
+        parent[b] = a;
+
+        if (rank[a] == rank[b])
+            rank[a]++;
+    }
+
+    uint32_t ClusterMerger::add_member(const char *sha256, const std::string &path)
+    {
+        uint32_t id = files.intern(sha256, path);
+
+        if (id == parent.size())
+        {
+            parent.push_back(id);
+            rank.push_back(0);
+        }
+
+        return id;
+    }
+
+    void ClusterMerger::add(std::vector<Media*> &set)
+    {
+        if (set.empty())
+            return;
+
+        uint32_t first = add_member(set[0]->sha256, set[0]->path + "/" + set[0]->filename);
+
+        for (size_t i = 1; i < set.size(); i++)
+            unite(first, add_member(set[i]->sha256, set[i]->path + "/" + set[i]->filename));
+    }
+
+    void ClusterMerger::add(SetBatch &batch)
+    {
+        for (size_t s = 0; s < batch.sets(); s++)
+        {
+            uint32_t begin = batch.set_offsets[s];
+            uint32_t end = batch.set_offsets[s + 1];
+
+            if (begin == end)
+                continue;
+
+            uint32_t first = 0;
+
+            for (uint32_t i = begin; i < end; i++)
+            {
+                std::string path = std::string(batch.path(i)) + "/" + batch.filename(i);
+                uint32_t id = add_member((const char*) batch.sha256.data() + (size_t) i * SHA256_DIGEST_LENGTH, path);
+
+                if (i == begin)
+                    first = id;
+                else
+                    unite(first, id);
+            }
+        }
+    }
+
+    void ClusterMerger::add_pair(const char *sha256_a, const std::string &path_a, const char *sha256_b, const std::string &path_b)
+    {
+        uint32_t a = add_member(sha256_a, path_a);
+        unite(a, add_member(sha256_b, path_b));
+    }
+
+    Clusters ClusterMerger::clusters()
+    {
+        size_t n = parent.size();
+        const uint32_t none = (uint32_t) -1;
+
+        std::vector<uint32_t> root(n);
+        std::vector<uint32_t> sizes(n, 0);
+
+        for (uint32_t id = 0; id < n; id++)
+        {
+            root[id] = find(id);
+            sizes[root[id]]++;
+        }
+
+        /* Number the clusters in the order their first file was seen, and lay them out one after another. */
+        std::vector<uint32_t> cluster_of(n, none);
+        Clusters result;
+        result.offsets.push_back(0);
+
+        for (uint32_t id = 0; id < n; id++)
+        {
+            uint32_t r = root[id];
+
+            if (sizes[r] < 2 || cluster_of[r] != none)
+                continue;
+
+            cluster_of[r] = result.offsets.size() - 1;
+            result.offsets.push_back(result.offsets.back() + sizes[r]);
+        }
+
+        /* sizes becomes each cluster's fill cursor. */
+        for (uint32_t c = 0; c + 1 < result.offsets.size(); c++)
+            sizes[c] = result.offsets[c];
+
+        result.members.resize(result.offsets.back());
+
+        for (uint32_t id = 0; id < n; id++)
+        {
+            uint32_t c = cluster_of[root[id]];
+
+            if (c != none)
+                result.members[sizes[c]++] = id;
+        }
+
+        return result;
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include <cstdint>
+
+#include <openssl/sha.h>
+
+#include "simpic_media.hpp"
+#include "simpic_batch.hpp"
+
+/* The interning table grows once it is this full (in percent). */
+#define INTERN_MAX_LOAD 70
+
+namespace SimpicClientLib
+{
+    /* Every file (by SHA256 hash and full path) gets a small integer, so that everything else can be arrays. */
+    /* Open addressing with linear probing over the ids themselves; the keys live in sha256s and paths. */
+    class MediaInterner
+    {
+    private:
+        std::vector<uint32_t> slots; // id + 1, or 0 for an empty slot.
+
+        std::vector<uint8_t> sha256s; // SHA256_DIGEST_LENGTH bytes per id.
+        std::vector<uint32_t> path_offsets;
+        std::vector<char> paths;
+
+        static uint64_t hash(const char *sha256, const char *path, size_t length);
+        bool same(uint32_t id, const char *sha256, const char *path, size_t length) const;
+        void grow();
+
+    public:
+        MediaInterner();
+
+        /* The id of the file, which is given a new one if it hasn't been seen. */
+        uint32_t intern(const char *sha256, const std::string &path);
+
+        size_t size() const;
+        const char *path(uint32_t id) const;
+        const uint8_t *sha256(uint32_t id) const;
+    };
+
+    /* The transitive clusters, flattened: the members of cluster c are members[offsets[c]] to members[offsets[c + 1] - 1]. */
+    struct Clusters
+    {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> members;
+
+        size_t count() const;
+    };
+
+    /* Merges sets from any number of scans (subdirectories, servers, repeated runs) into clusters: two sets that share */
+    /* a file are the same cluster, transitively, so each cluster needs reviewing once. A union-find over interned ids, */
+    /* with path halving and union by rank. */
+    class ClusterMerger
+    {
+    private:
+        std::vector<uint32_t> parent;
+        std::vector<uint8_t> rank;
+
+        uint32_t find(uint32_t id);
+        void unite(uint32_t a, uint32_t b);
+        uint32_t add_member(const char *sha256, const std::string &path);
+
+    public:
+        MediaInterner files;
+
+        /* Add a set as a callback gets it from SimpicClient::request() (before the set is over). */
+        void add(std::vector<Media*> &set);
+
+        /* Add every set of a batch from SimpicClient::request_batched(). */
+        void add(SetBatch &batch);
+
+        /* Two files found to be similar outside of any set (by comparing the hashes of separate scans, say). */
+        void add_pair(const char *sha256_a, const std::string &path_a, const char *sha256_b, const std::string &path_b);
+
+        /* Every cluster of two or more files, each listed once, in the order their first file was seen. */
+        Clusters clusters();
+    };
+}
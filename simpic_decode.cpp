@@ -0,0 +1,50 @@
+#include "simpic_decode.hpp"
+#include "simpic_plugins.hpp"
+
+#include <cstring>
+
+namespace SimpicClientLib
+{
+    ImageType sniff_image_type(const char *data, size_t length)
+    {
+        const unsigned char *bytes = (const unsigned char*) data;
+
+        if (length >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF)
+            return ImageType::JPEG;
+
+        if (length >= 8 && !std::memcmp(bytes, "\x89PNG\r\n\x1a\n", 8))
+            return ImageType::PNG;
+
+        if (length >= 6 && (!std::memcmp(bytes, "GIF87a", 6) || !std::memcmp(bytes, "GIF89a", 6)))
+            return ImageType::GIF;
+
+        return ImageType::Undefined;
+    }
+
+    typedef bool (*decode_function)(int type, const char *data, size_t length, GrayImage *out);
+
+    bool decode_grayscale(const char *data, size_t length, GrayImage &out)
+    {
+        ImageType type = sniff_image_type(data, length);
+
+        if (type != ImageType::JPEG && type != ImageType::PNG)
+            return false;
+
+        /* Resolved once; a missing plugin leaves every image unscored rather than failing the scan. */
+        static decode_function decode = []() -> decode_function {
+            try
+            {
+                return (decode_function) plugin_symbol(DECODE_PLUGIN, "simpic_decode_grayscale");
+            }
+            catch (PluginException &ex)
+            {
+                return nullptr;
+            }
+        }();
+
+        if (decode == nullptr)
+            return false;
+
+        return decode((int) type, data, length, &out);
+    }
+}
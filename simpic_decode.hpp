@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "simpic_image.hpp"
+
+namespace SimpicClientLib
+{
+    /* A decoded image, reduced to one float luminance channel so the scoring kernels can vectorize over it. */
+    struct GrayImage
+    {
+        uint32_t width;
+        uint32_t height;
+        std::vector<float> pixels; // width * height, row major.
+    };
+
+    /* Tell what format the file is in from its first bytes. */
+    ImageType sniff_image_type(const char *data, size_t length);
+
+    /* Decode a JPEG or PNG from memory with libjpeg/libpng, which live in DECODE_PLUGIN and are loaded on first use. */
+    /* Returns false if it is neither, is corrupt, or the plugin is not installed. */
+    bool decode_grayscale(const char *data, size_t length, GrayImage &out);
+}
@@ -0,0 +1,109 @@
+#include "simpic_decode.hpp"
+
+#include <cstdio>
+#include <csetjmp>
+#include <cstring>
+
+#include <jpeglib.h>
+#include <png.h>
+
+namespace SimpicClientLib
+{
+    /* libjpeg's default error handler calls exit(); jump back out of the decoder instead. */
+    struct jpeg_error_jump
+    {
+        struct jpeg_error_mgr mgr;
+        std::jmp_buf jump;
+    };
+
+    static void jpeg_error_exit(j_common_ptr cinfo)
+    {
+        struct jpeg_error_jump *err = (struct jpeg_error_jump*) cinfo->err;
+        std::longjmp(err->jump, 1);
+    }
+
+    static bool decode_jpeg(const char *data, size_t length, GrayImage &out)
+    {
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_jump err;
+
+        cinfo.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = jpeg_error_exit;
+
+        /* Nothing below may hold anything that needs destructing across the longjmp. */
+        if (setjmp(err.jump))
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, (const unsigned char*) data, length);
+        jpeg_read_header(&cinfo, TRUE);
+
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        jpeg_start_decompress(&cinfo);
+
+        out.width = cinfo.output_width;
+        out.height = cinfo.output_height;
+        out.pixels.resize((size_t) out.width * out.height);
+
+        /* libjpeg's own pool frees this, even if we leave by longjmp. */
+        JSAMPARRAY rows = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, out.width, 1);
+
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            float *dst = out.pixels.data() + (size_t) cinfo.output_scanline * out.width;
+            jpeg_read_scanlines(&cinfo, rows, 1);
+
+            for (uint32_t x = 0; x < out.width; x++)
+                dst[x] = rows[0][x];
+        }
+
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+    static bool decode_png(const char *data, size_t length, GrayImage &out)
+    {
+        png_image image;
+        std::memset(&image, 0, sizeof(image));
+        image.version = PNG_IMAGE_VERSION;
+
+        if (!png_image_begin_read_from_memory(&image, data, length))
+            return false;
+
+        image.format = PNG_FORMAT_GRAY;
+
+        std::vector<unsigned char> buffer(PNG_IMAGE_SIZE(image));
+
+        if (!png_image_finish_read(&image, nullptr, buffer.data(), 0, nullptr))
+        {
+            png_image_free(&image);
+            return false;
+        }
+
+        out.width = image.width;
+        out.height = image.height;
+        out.pixels.assign(buffer.begin(), buffer.end());
+
+        return true;
+    }
+}
+
+/* Looked up by name from libsimpicclient.so (see decode_grayscale()); type is an ImageType it already sniffed. */
+extern "C" bool simpic_decode_grayscale(int type, const char *data, size_t length, SimpicClientLib::GrayImage *out)
+{
+    switch ((SimpicClientLib::ImageType) type)
+    {
+        case SimpicClientLib::ImageType::JPEG:
+            return SimpicClientLib::decode_jpeg(data, length, *out);
+
+        case SimpicClientLib::ImageType::PNG:
+            return SimpicClientLib::decode_png(data, length, *out);
+
+        default:
+            return false;
+    }
+}
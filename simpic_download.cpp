@@ -0,0 +1,228 @@
+#include "simpic_download.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+
+namespace SimpicClientLib
+{
+    StripedDownload::StripedDownload(SimpicClient &client, Media &img, std::string &destination, int count)
+    {
+        host = client.host;
+        port = client.port;
+        transport_kind = client.transport_kind;
+
+        std::memcpy(sha256, img.sha256, sizeof(sha256));
+        length = img.length;
+        this->destination = destination;
+
+        /* No more stripes than would each get MIN_STRIPE_SIZE bytes, but always at least one. */
+        stripes = std::max(1, std::min(count, (int)(length / MIN_STRIPE_SIZE)));
+
+        std::string candidate = img.path + "/" + img.filename;
+        struct stat st;
+
+        /* A file of the wrong size there can't be this one; a file of the right size still has to pass verify(). */
+        if (!img.path.empty() && good_path(candidate, false) && stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t) st.st_size == length)
+            local_source = candidate;
+
+        received = 0;
+        out = -1;
+    }
+
+    StripedDownload::~StripedDownload()
+    {
+        for (std::thread &t : workers)
+        {
+            if (t.joinable())
+                t.join();
+        }
+
+        if (out != -1)
+            ::close(out);
+    }
+
+    void StripedDownload::start()
+    {
+        out = open(destination.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (out < 0)
+            throw ErrnoException(errno);
+
+        /* Reserve the whole file up front, so the stripes never extend it (or fragment it) out of order. */
+        int err = posix_fallocate(out, 0, length);
+
+        if (err == EOPNOTSUPP || err == EINVAL)
+            err = ftruncate(out, length) < 0 ? errno : 0;
+
+        if (err)
+            throw ErrnoException(err);
+
+        uint64_t per_stripe = length / stripes;
+
+        for (int i = 0; i < stripes; i++)
+        {
+            uint64_t offset = i * per_stripe;
+            uint64_t amount = (i == stripes - 1) ? length - offset : per_stripe;
+
+            workers.emplace_back([this, offset, amount]() -> void {
+                try
+                {
+                    if (!local_source.empty())
+                        stripe_local(offset, amount);
+                    else
+                        stripe(offset, amount);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+
+                    if (!failure)
+                        failure = std::current_exception();
+                }
+            });
+        }
+    }
+
+    void StripedDownload::stripe(uint64_t offset, uint64_t amount)
+    {
+        /* Every stripe is its own connection, and so its own TCP flow. */
+        SimpicClient side(host, port);
+        side.set_transport(transport_kind);
+        side.make_connection();
+
+        side.fetch(sha256, offset, amount, out, offset, [this](const char *, size_t amnt) -> void {
+            received += amnt;
+        });
+
+        side.close();
+    }
+
+    void StripedDownload::stripe_local(uint64_t offset, uint64_t amount)
+    {
+        int in = open(local_source.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (in < 0)
+            throw ErrnoException(errno);
+
+        char buffer[FETCH_BUFFER_SIZE];
+
+        while (amount)
+        {
+            ssize_t n = pread(in, buffer, std::min(amount, (uint64_t) sizeof(buffer)), offset);
+
+            if (n <= 0 || pwrite(out, buffer, n, offset) != n)
+            {
+                int err = n == 0 ? EIO : errno;
+                ::close(in);
+                throw ErrnoException(err);
+            }
+
+            offset += n;
+            amount -= n;
+            received += n;
+        }
+
+        ::close(in);
+    }
+
+    void StripedDownload::wait()
+    {
+        for (std::thread &t : workers)
+        {
+            if (t.joinable())
+                t.join();
+        }
+
+        if (local_source.empty())
+        {
+            if (failure)
+                std::rethrow_exception(failure);
+
+            verify();
+            return;
+        }
+
+        try
+        {
+            if (failure)
+                std::rethrow_exception(failure);
+
+            verify();
+        }
+        catch (HashMismatchException &)
+        {
+            network();
+        }
+        catch (ErrnoException &)
+        {
+            network();
+        }
+    }
+
+    void StripedDownload::network()
+    {
+        /* Same path, different file (a remote server, or it changed since the scan): fetch it after all. */
+        workers.clear();
+        failure = nullptr;
+        received = 0;
+        local_source.clear();
+
+        if (out != -1)
+        {
+            ::close(out);
+            out = -1;
+        }
+
+        start();
+        wait();
+    }
+
+    void StripedDownload::verify()
+    {
+        /* Already checked by an earlier wait(). */
+        if (out < 0)
+            return;
+
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+
+        char buffer[FETCH_BUFFER_SIZE];
+        uint64_t offset = 0;
+        int err = 0;
+
+        while (offset < length)
+        {
+            ssize_t n = pread(out, buffer, std::min(length - offset, (uint64_t) sizeof(buffer)), offset);
+
+            if (n <= 0)
+            {
+                err = n == 0 ? EIO : errno;
+                break;
+            }
+
+            EVP_DigestUpdate(ctx, buffer, n);
+            offset += n;
+        }
+
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        EVP_DigestFinal_ex(ctx, digest, nullptr);
+        EVP_MD_CTX_free(ctx);
+
+        ::close(out);
+        out = -1;
+
+        if (err)
+            throw ErrnoException(err);
+
+        if (std::memcmp(digest, sha256, sizeof(digest)))
+            throw HashMismatchException("The file downloaded does not match its SHA256 hash.", destination);
+    }
+
+    uint64_t StripedDownload::progress()
+    {
+        return received;
+    }
+}
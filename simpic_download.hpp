@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+
+#include <cstdint>
+
+#include "simpic_client.hpp"
+
+/* Stripes smaller than this aren't worth a connection of their own. */
+#define MIN_STRIPE_SIZE (8 << 20)
+
+namespace SimpicClientLib
+{
+    /* Download one large file over several extra connections at once, each fetching a byte range of it by its SHA256 hash. */
+    /* The stripes are written in place (pwrite()) into a file preallocated to the full size, while the scan on the main connection carries on. */
+    class StripedDownload
+    {
+    private:
+        std::string host;
+        uint16_t port;
+        TransportKinds transport_kind; // the stripes talk to the server the way the client does.
+
+        /* If the file is readable right here (self-hosting, or a shared mount) and is the right size, the stripes are copied from it instead. */
+        std::string local_source;
+
+        std::vector<std::thread> workers;
+        std::atomic<uint64_t> received;
+
+        std::mutex lock;
+        std::exception_ptr failure;
+
+        int out;
+
+        void stripe(uint64_t offset, uint64_t amount);
+        void stripe_local(uint64_t offset, uint64_t amount);
+
+        /* Hash what was written, once every stripe is done. */
+        void verify();
+
+        /* Start over from the server, after the local copy turned out not to be the file. */
+        void network();
+    public:
+        char sha256[SHA256_DIGEST_LENGTH];
+        uint64_t length;
+        std::string destination;
+        int stripes;
+
+        /* Download img, which the client has just been told about, to destination over (up to) count connections. */
+        StripedDownload(SimpicClient &client, Media &img, std::string &destination, int count);
+        ~StripedDownload();
+
+        /* Preallocate the destination and start every stripe in the background. */
+        void start();
+
+        /* Block until every stripe is done; rethrows the first error any of them hit. Throws HashMismatchException if */
+        /* the file they put together does not match its SHA256 hash. A local copy that fails either way is dropped for the network. */
+        void wait();
+
+        /* How many bytes have been written so far. */
+        uint64_t progress();
+    };
+}
@@ -0,0 +1,180 @@
+#include "simpic_fanout.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace SimpicClientLib
+{
+    SubtreeFanout::SubtreeFanout(std::string &host, uint16_t port, unsigned int connections, std::function<void(SimpicClient&)> setup)
+    {
+        this->host = host;
+        this->port = port;
+        this->connections = connections;
+        this->setup = setup;
+    }
+
+    std::string SubtreeFanout::full_path(const std::string &dir, const std::string &path, const std::string &filename)
+    {
+        /* A scan without recursion sends no path: it is the directory that was scanned. */
+        const std::string &where = path.empty() ? dir : path;
+
+        if (!where.empty() && where.back() == '/')
+            return where + filename;
+
+        return where + "/" + filename;
+    }
+
+    void SubtreeFanout::match_hashes(uint8_t max_ham)
+    {
+        size_t n = hashed.size();
+        unsigned int blocks = std::min((unsigned int) max_ham + 1, 64u);
+
+        std::vector<std::string> paths(n);
+
+        for (size_t i = 0; i < n; i++)
+            paths[i] = hashed[i].path + (hashed[i].path.empty() || hashed[i].path.back() == '/' ? "" : "/") + hashed[i].filename;
+
+        auto block_of = [blocks](uint64_t phash, unsigned int b) -> uint64_t {
+            unsigned int lo = 64 * b / blocks;
+            unsigned int width = 64 * (b + 1) / blocks - lo;
+            uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+            return (phash >> lo) & mask;
+        };
+
+        std::vector<std::pair<uint64_t, uint32_t>> keyed(n);
+
+        for (unsigned int b = 0; b < blocks; b++)
+        {
+            for (uint32_t i = 0; i < n; i++)
+                keyed[i] = {block_of(hashed[i].phash, b), i};
+
+            std::sort(keyed.begin(), keyed.end());
+
+            for (size_t start = 0; start < n; )
+            {
+                size_t end = start + 1;
+
+                while (end < n && keyed[end].first == keyed[start].first)
+                    end++;
+
+                for (size_t x = start; x < end; x++)
+                {
+                    for (size_t y = x + 1; y < end; y++)
+                    {
+                        uint32_t i = keyed[x].second;
+                        uint32_t j = keyed[y].second;
+
+                        /* Within a subtree, the server has already decided. */
+                        if (subtree_of[i] == subtree_of[j])
+                            continue;
+
+                        if (std::popcount(hashed[i].phash ^ hashed[j].phash) > max_ham)
+                            continue;
+
+                        /* A pair that agrees on several blocks is only taken at the first of them. */
+                        bool earlier = false;
+
+                        for (unsigned int e = 0; e < b && !earlier; e++)
+                            earlier = block_of(hashed[i].phash, e) == block_of(hashed[j].phash, e);
+
+                        if (!earlier)
+                            merger.add_pair(hashed[i].sha256, paths[i], hashed[j].sha256, paths[j]);
+                    }
+                }
+
+                start = end;
+            }
+        }
+    }
+
+    Clusters SubtreeFanout::run(std::string &root, unsigned int levels, uint8_t max_ham, uint8_t types,
+                        std::function<void(ScanJob&, JobOutcomes)> done)
+    {
+        ScanScheduler scheduler(connections, [this](SimpicClient &client) -> void {
+            setup(client);
+            client.set_no_data(true);
+            client.set_perceptual_hashes(true);
+        });
+
+        /* Walk down the tree on one connection: the directories on the way are scanned flat, the ones at the bottom whole. */
+        SimpicClient lister(host, port);
+        setup(lister);
+        lister.make_connection();
+
+        std::vector<std::string> frontier = {root};
+
+        for (unsigned int level = 0; level < levels; level++)
+        {
+            std::vector<std::string> below;
+
+            for (std::string &dir : frontier)
+            {
+                scheduler.add(host, port, dir, false, max_ham, types, 0);
+
+                for (std::string &name : lister.list(dir))
+                    below.push_back(dir + (dir.back() == '/' ? "" : "/") + name);
+            }
+
+            frontier.swap(below);
+        }
+
+        lister.close();
+
+        /* The subtrees are the bulk of the work; they go first. */
+        for (std::string &dir : frontier)
+        {
+            scheduler.add(host, port, dir, true, max_ham, types, 1);
+            subtrees.push_back(dir);
+        }
+
+        scheduler.run([this](ScanJob &job, SimpicClient &client, void *data, DataTypes type) -> void {
+            if (type == DataTypes::Update)
+                return;
+
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<std::pair<const char*, std::string>> &set = current[&job];
+
+            if (data != nullptr)
+            {
+                Media *media = (Media*) data;
+                set.push_back({media->sha256, full_path(job.path, media->path, media->filename)});
+                return;
+            }
+
+            /* The end of a set (its beginning leaves it empty). */
+            for (size_t i = 1; i < set.size(); i++)
+                merger.add_pair(set[0].first, set[0].second, set[i].first, set[i].second);
+
+            if (!set.empty())
+                client.keep();
+
+            set.clear();
+        },
+        [this, &done](ScanJob &job, JobOutcomes outcome) -> void {
+            done(job, outcome);
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+
+                for (HashedImage &image : job.hashes)
+                {
+                    if (image.path.empty())
+                        image.path = job.path;
+
+                    hashed.push_back(image);
+                    subtree_of.push_back(job.order);
+                }
+
+                job.hashes.clear();
+            }
+        },
+        [this](ScanJob &job) -> void {
+            /* Whatever a failed try left of a set was never finished; the next try sends it again whole. */
+            std::lock_guard<std::mutex> guard(lock);
+            current[&job].clear();
+        });
+
+        match_hashes(max_ham);
+        return merger.clusters();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+
+#include "simpic_client.hpp"
+#include "simpic_scheduler.hpp"
+#include "simpic_cluster.hpp"
+
+namespace SimpicClientLib
+{
+    /* Splits one recursive scan of a big tree into scans of its subtrees, run side by side over several connections */
+    /* so that the server runs them as that many jobs, and puts the results back together. The sets of every subscan go */
+    /* into a ClusterMerger; similar images that landed in different subtrees, which no subscan could have paired, are */
+    /* found by comparing the perceptual hashes every subscan brings back. */
+    /* Needs a server that knows ClientRequests::List and RequestExtensions::PerceptualHashes. */
+    class SubtreeFanout
+    {
+    private:
+        std::string host;
+        uint16_t port;
+        unsigned int connections;
+        std::function<void(SimpicClient&)> setup;
+
+        std::mutex lock;
+        std::map<ScanJob*, std::vector<std::pair<const char*, std::string>>> current;
+
+        /* Every image any subscan hashed, with the subscan (ScanJob::order) it came from. */
+        std::vector<HashedImage> hashed;
+        std::vector<uint64_t> subtree_of;
+
+        static std::string full_path(const std::string &dir, const std::string &path, const std::string &filename);
+
+        /* Multi-index hashing: split the 64 bits into max_ham + 1 blocks, and any two hashes within max_ham of each */
+        /* other agree exactly on at least one of them. Only images that share a block are compared in full. */
+        void match_hashes(uint8_t max_ham);
+
+    public:
+        ClusterMerger merger;
+
+        /* What was scanned recursively, one subscan each; the directories above them were scanned without recursion. */
+        std::vector<std::string> subtrees;
+
+        /* setup is called on every connection before it connects, as with ScanScheduler. */
+        SubtreeFanout(std::string &host, uint16_t port, unsigned int connections, std::function<void(SimpicClient&)> setup);
+
+        /* Scan root with every directory levels below it as a subscan of its own, and those on the way down without */
+        /* their subdirectories. Blocks until every subscan is done; done is called once per subscan, as with */
+        /* ScanScheduler::run(). Every set is kept. Returns the merged clusters (the paths are in merger.files). */
+        /* Throws what SimpicClient::make_connection() and list() do if the tree can't be listed. */
+        Clusters run(std::string &root, unsigned int levels, uint8_t max_ham, uint8_t types,
+                        std::function<void(ScanJob&, JobOutcomes)> done);
+    };
+}
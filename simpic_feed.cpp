@@ -0,0 +1,422 @@
+#include "simpic_feed.hpp"
+#include "simpic_image.hpp"
+#include "simpic_client.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+namespace SimpicClientLib
+{
+    /* Where the index and the data ring start, past the header. */
+    static size_t index_start()
+    {
+        return (sizeof(FeedHeader) + 63) & ~(size_t) 63;
+    }
+
+    static size_t data_start(uint32_t entries)
+    {
+        return (index_start() + entries * sizeof(FeedIndexEntry) + 4095) & ~(size_t) 4095;
+    }
+
+    static size_t item_size(size_t filename_length, size_t path_length)
+    {
+        return (sizeof(FeedItem) + filename_length + path_length + 7) & ~(size_t) 7;
+    }
+
+    const char *FeedSetView::filename(const FeedItem *item)
+    {
+        return (const char*) (item + 1);
+    }
+
+    const char *FeedSetView::path(const FeedItem *item)
+    {
+        return (const char*) (item + 1) + item->filename_length;
+    }
+
+    FeedWriter::FeedWriter(const std::string &_name, uint64_t data_size)
+    {
+        name = _name;
+        head = 0;
+        data_size = (data_size + 4095) & ~(uint64_t) 4095;
+        map_size = data_start(FEED_INDEX_ENTRIES) + data_size;
+
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+        if (fd < 0)
+            throw ErrnoException(errno);
+
+        if (ftruncate(fd, map_size) < 0)
+        {
+            int err = errno;
+            ::close(fd);
+            shm_unlink(name.c_str());
+            throw ErrnoException(err);
+        }
+
+        map = (char*) mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            int err = errno;
+            ::close(fd);
+            shm_unlink(name.c_str());
+            throw ErrnoException(err);
+        }
+
+        /* The object starts out zeroed, which is what the atomics need; everything else is set here. */
+        header = (FeedHeader*) map;
+        index = (FeedIndexEntry*) (map + index_start());
+        data = map + data_start(FEED_INDEX_ENTRIES);
+
+        std::memcpy(header->magic, FEED_MAGIC, sizeof(header->magic));
+        header->index_entries = FEED_INDEX_ENTRIES;
+        header->data_size = data_size;
+        header->state.store((uint32_t) FeedStates::Scanning);
+    }
+
+    FeedWriter::~FeedWriter()
+    {
+        munmap(map, map_size);
+        ::close(fd);
+    }
+
+    void FeedWriter::describe(const std::string &host, uint16_t port, const std::string &path, bool recursive, uint8_t max_ham, uint8_t types)
+    {
+        std::strncpy(header->host, host.c_str(), sizeof(header->host) - 1);
+        std::strncpy(header->path, path.c_str(), sizeof(header->path) - 1);
+        header->port = port;
+        header->recursive = recursive;
+        header->max_ham = max_ham;
+        header->types = types;
+    }
+
+    void FeedWriter::wake()
+    {
+        header->wake.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, (uint32_t*) &header->wake, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    void FeedWriter::publish(DataTypes type, std::vector<Media*> &set)
+    {
+        size_t length = 0;
+
+        for (Media *media : set)
+            length += item_size(media->filename.size() + 1, media->path.size() + 1);
+
+        if (length > header->data_size)
+            throw ErrnoException(EMSGSIZE);
+
+        /* A set never wraps: if it doesn't fit before the end of the ring, it starts over at the beginning. */
+        uint64_t at = head % header->data_size;
+
+        if (at + length > header->data_size)
+            head += header->data_size - at;
+
+        uint64_t end = head + length;
+        uint64_t published = header->published.load(std::memory_order_relaxed);
+        uint64_t oldest = header->oldest.load(std::memory_order_relaxed);
+
+        /* Whatever is about to be written over, or pushed out of the index, drops out before it is touched. */
+        while (oldest < published && (published - oldest >= header->index_entries
+                        || index[oldest % header->index_entries].offset + header->data_size < end))
+            oldest++;
+
+        header->oldest.store(oldest, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        char *out = data + head % header->data_size;
+
+        for (Media *media : set)
+        {
+            FeedItem *item = (FeedItem*) out;
+            std::memcpy(item->sha256, media->sha256, SHA256_DIGEST_LENGTH);
+            item->size = media->length;
+            item->index = media->index;
+            item->width = 0;
+            item->height = 0;
+
+            if (type == DataTypes::Image)
+            {
+                item->width = ((Image*) media)->width;
+                item->height = ((Image*) media)->height;
+            }
+            else if (type == DataTypes::Video)
+            {
+                item->width = ((Video*) media)->width;
+                item->height = ((Video*) media)->height;
+            }
+
+            item->filename_length = media->filename.size() + 1;
+            item->path_length = media->path.size() + 1;
+            item->next = item_size(item->filename_length, item->path_length);
+
+            std::memcpy(out + sizeof(FeedItem), media->filename.c_str(), item->filename_length);
+            std::memcpy(out + sizeof(FeedItem) + item->filename_length, media->path.c_str(), item->path_length);
+            out += item->next;
+        }
+
+        FeedIndexEntry &entry = index[published % header->index_entries];
+        entry.offset = head;
+        entry.length = length;
+        entry.type = (uint8_t) type;
+        entry.count = set.size();
+
+        head = end;
+        header->published.store(published + 1, std::memory_order_release);
+        wake();
+    }
+
+    void FeedWriter::finish(FeedStates state)
+    {
+        header->state.store((uint32_t) state, std::memory_order_release);
+        wake();
+    }
+
+    FeedStates FeedWriter::state()
+    {
+        return (FeedStates) header->state.load(std::memory_order_acquire);
+    }
+
+    void FeedWriter::unlink()
+    {
+        shm_unlink(name.c_str());
+    }
+
+    FeedReader::FeedReader(const std::string &_name)
+    {
+        name = _name;
+
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            int err = errno;
+
+            if (fd >= 0)
+                ::close(fd);
+
+            throw ErrnoException(err);
+        }
+
+        map_size = st.st_size;
+        map = (const char*) MAP_FAILED;
+
+        if (map_size >= sizeof(FeedHeader))
+            map = (const char*) mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        ::close(fd);
+
+        header = (const FeedHeader*) map;
+
+        if (map == MAP_FAILED || std::memcmp(header->magic, FEED_MAGIC, sizeof(header->magic))
+                        || data_start(header->index_entries) + header->data_size > map_size)
+        {
+            if (map != MAP_FAILED)
+                munmap((void*) map, map_size);
+
+            throw ErrnoException(EINVAL);
+        }
+
+        index = (const FeedIndexEntry*) (map + index_start());
+        data = map + data_start(header->index_entries);
+    }
+
+    FeedReader::~FeedReader()
+    {
+        munmap((void*) map, map_size);
+    }
+
+    uint64_t FeedReader::published()
+    {
+        return header->published.load(std::memory_order_acquire);
+    }
+
+    uint64_t FeedReader::oldest()
+    {
+        return header->oldest.load(std::memory_order_acquire);
+    }
+
+    FeedStates FeedReader::state()
+    {
+        return (FeedStates) header->state.load(std::memory_order_acquire);
+    }
+
+    std::string FeedReader::host()
+    {
+        return std::string(header->host, strnlen(header->host, sizeof(header->host)));
+    }
+
+    uint16_t FeedReader::port()
+    {
+        return header->port;
+    }
+
+    std::string FeedReader::path()
+    {
+        return std::string(header->path, strnlen(header->path, sizeof(header->path)));
+    }
+
+    bool FeedReader::wait(uint64_t s, int timeout_ms)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+        while (true)
+        {
+            /* Read the counter first, so that a publish after the checks below still wakes the wait. */
+            uint32_t seen = header->wake.load(std::memory_order_acquire);
+
+            if (published() > s)
+                return true;
+
+            if (state() != FeedStates::Scanning)
+                return published() > s;
+
+            struct timespec ts;
+            struct timespec *timeout = nullptr;
+
+            if (timeout_ms >= 0)
+            {
+                auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+                if (left <= 0)
+                    return false;
+
+                ts.tv_sec = left / 1000000000;
+                ts.tv_nsec = left % 1000000000;
+                timeout = &ts;
+            }
+
+            syscall(SYS_futex, (uint32_t*) &header->wake, FUTEX_WAIT, seen, timeout, nullptr, 0);
+        }
+    }
+
+    bool FeedReader::set(uint64_t s, FeedSetView &view)
+    {
+        if (s >= published() || s < oldest())
+            return false;
+
+        FeedIndexEntry entry = index[s % header->index_entries];
+
+        /* The entry may have been reused while it was being copied. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (!still_there(s) || entry.offset % header->data_size + entry.length > header->data_size)
+            return false;
+
+        const char *at = data + entry.offset % header->data_size;
+        const char *end = at + entry.length;
+
+        view.type = (DataTypes) entry.type;
+        view.items.clear();
+
+        for (uint32_t i = 0; i < entry.count; i++)
+        {
+            const FeedItem *item = (const FeedItem*) at;
+
+            if (at + sizeof(FeedItem) > end || item->next < sizeof(FeedItem) || at + item->next > end)
+                return false;
+
+            view.items.push_back(item);
+            at += item->next;
+        }
+
+        return still_there(s);
+    }
+
+    bool FeedReader::still_there(uint64_t s)
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s >= oldest();
+    }
+
+    std::string clientd_socket_path()
+    {
+        const char *runtime = std::getenv("XDG_RUNTIME_DIR");
+
+        if (runtime != nullptr && *runtime)
+            return std::string(runtime) + "/simpic_clientd.sock";
+
+        return "/tmp/simpic_clientd-" + std::to_string(getuid()) + ".sock";
+    }
+
+    std::string clientd_scan(const std::string &socket_path, const std::string &host, uint16_t port, const std::string &path,
+                    bool recursive, uint8_t max_ham, uint8_t types, bool rescan)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        struct sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+        if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+        {
+            uint8_t err = errno;
+
+            if (fd >= 0)
+                ::close(fd);
+
+            throw simpic_networking_exception("Error reaching simpic_clientd at " + socket_path + ": " + std::string(std::strerror(err)), err);
+        }
+
+        /* One tab-separated line each way; the path goes last, as it is the only field that can hold anything. */
+        std::string line = std::string(rescan ? "RESCAN" : "SCAN") + "\t" + host + "\t" + std::to_string(port) + "\t"
+                        + std::to_string(max_ham) + "\t" + std::to_string(types) + "\t" + (recursive ? "1" : "0") + "\t" + path + "\n";
+
+        std::string reply;
+
+        try
+        {
+            sendall(fd, line.data(), line.size());
+
+            char c;
+
+            while (true)
+            {
+                ssize_t n = recv(fd, &c, 1, 0);
+
+                if (n <= 0)
+                {
+                    uint8_t err = n == 0 ? ECONNRESET : errno;
+                    throw simpic_networking_exception("Error reading from simpic_clientd: " + std::string(std::strerror(err)), err);
+                }
+
+                if (c == '\n')
+                    break;
+
+                reply += c;
+            }
+        }
+        catch (simpic_networking_exception &ex)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        ::close(fd);
+
+        /* "OK name" or "ERR errno message". */
+        if (!reply.compare(0, 3, "OK "))
+            return reply.substr(3);
+
+        if (!reply.compare(0, 4, "ERR "))
+            throw ErrnoException(std::atoi(reply.c_str() + 4));
+
+        throw simpic_networking_exception("simpic_clientd replied with nonsense: " + reply, EPROTO);
+    }
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <cstdint>
+#include <cstddef>
+
+#include <openssl/sha.h>
+
+#include "simpic_protocol.hpp"
+#include "simpic_media.hpp"
+
+/* The first bytes of every feed. */
+#define FEED_MAGIC "SIMPFED2"
+
+/* How many sets a feed indexes before the oldest ones drop out of it. */
+#define FEED_INDEX_ENTRIES 65536
+
+/* Feed names (for shm_open()) start with this. */
+#define FEED_PREFIX "/simpic-feed-"
+
+namespace SimpicClientLib
+{
+    enum class FeedStates
+    {
+        Scanning, // sets are still being published.
+        Done, // every set is in (there may be none).
+        Failed // the scan ended early; what is in stays readable.
+    };
+
+    /* A feed is one shared memory object: this header, FeedHeader::index_entries FeedIndexEntry, then the data ring. */
+    /* It is written by one process (simpic_clientd) and mapped read-only by any number of readers, which take the */
+    /* sets straight out of the mapping. */
+    struct FeedHeader
+    {
+        char magic[8];
+        uint32_t index_entries;
+        uint32_t reserved;
+        uint64_t data_size;
+
+        /* Sets [oldest, published) are readable; set s is at index entry s % index_entries. */
+        std::atomic<uint64_t> published;
+        std::atomic<uint64_t> oldest;
+
+        std::atomic<uint32_t> state; // a FeedStates.
+
+        /* Bumped on every publish and on the end of the scan; readers futex-wait on it. */
+        std::atomic<uint32_t> wake;
+
+        /* What was scanned, for listing feeds. */
+        char host[256];
+        uint16_t port;
+        uint8_t max_ham;
+        uint8_t types;
+        uint8_t recursive;
+        char path[4096];
+    };
+
+    struct FeedIndexEntry
+    {
+        uint64_t offset; // where the set starts, counted in bytes ever written (the ring position is offset % data_size).
+        uint32_t length;
+        uint32_t count;
+        uint8_t type; // a DataTypes.
+        uint8_t reserved[7];
+    };
+
+    /* A set in the data ring is count of these, each followed by its NUL-terminated filename and path, and padded */
+    /* to 8 bytes. A set never wraps around the end of the ring. */
+    struct FeedItem
+    {
+        char sha256[SHA256_DIGEST_LENGTH];
+        uint64_t size;
+        uint32_t index; // its index in its set, as SimpicClient::remove() takes.
+        uint32_t width; // 0 for media without one (audio, text).
+        uint32_t height;
+        uint16_t filename_length; // with the NUL.
+        uint16_t path_length;
+        uint32_t next; // bytes from this item to the next one.
+        uint32_t reserved;
+    };
+
+    /* A set as it sits in the mapping; only good until FeedReader::still_there() says otherwise. */
+    struct FeedSetView
+    {
+        DataTypes type;
+        std::vector<const FeedItem*> items;
+
+        static const char *filename(const FeedItem *item);
+        static const char *path(const FeedItem *item);
+    };
+
+    /* Creates a feed and publishes sets into it. The data ring is a sparse file, so only what is written costs memory. */
+    /* Throws ErrnoException if the shared memory can't be had. */
+    class FeedWriter
+    {
+    private:
+        int fd;
+        size_t map_size;
+        char *map;
+
+        FeedHeader *header;
+        FeedIndexEntry *index;
+        char *data;
+
+        uint64_t head; // bytes ever written.
+
+        void wake();
+
+    public:
+        std::string name;
+
+        FeedWriter(const std::string &_name, uint64_t data_size);
+
+        /* Unmaps it; the feed stays until unlink(). */
+        ~FeedWriter();
+
+        void describe(const std::string &host, uint16_t port, const std::string &path, bool recursive, uint8_t max_ham, uint8_t types);
+
+        /* Copy a completed set in and make it visible; sets that it overwrites drop out first. */
+        void publish(DataTypes type, std::vector<Media*> &set);
+
+        /* The scan is over, one way or another. */
+        void finish(FeedStates state);
+
+        FeedStates state();
+
+        /* Remove the feed's name; readers that have it mapped keep it until they let go. */
+        void unlink();
+    };
+
+    /* Maps a feed read-only, and waits for and reads its sets. Any number of processes can read the same feed, each */
+    /* at its own pace; one that falls more than a ring behind finds the sets it missed gone. */
+    /* Throws ErrnoException if the feed doesn't exist (or isn't one). */
+    class FeedReader
+    {
+    private:
+        size_t map_size;
+        const char *map;
+
+        const FeedHeader *header;
+        const FeedIndexEntry *index;
+        const char *data;
+
+    public:
+        std::string name;
+
+        FeedReader(const std::string &_name);
+        ~FeedReader();
+
+        /* Sets [oldest(), published()) can be read. */
+        uint64_t published();
+        uint64_t oldest();
+        FeedStates state();
+
+        /* What was scanned. */
+        std::string host();
+        uint16_t port();
+        std::string path();
+
+        /* Block until set s is published (true), or the scan ends without it or timeout_ms passes (false); -1 waits forever. */
+        bool wait(uint64_t s, int timeout_ms);
+
+        /* Point view at set s; false if it isn't published, or has dropped out. No data is copied. */
+        bool set(uint64_t s, FeedSetView &view);
+
+        /* Whether set s is still intact; check after using a view of it, since the writer may have lapped it meanwhile. */
+        bool still_there(uint64_t s);
+    };
+
+    /* Ask simpic_clientd, on its UNIX socket, for the feed of a scan: one already running or done, or a new one. */
+    /* Returns the feed's name, for FeedReader. rescan starts over even if there is one. */
+    /* Throws simpic_networking_exception if the daemon can't be reached, and ErrnoException if it refuses. */
+    std::string clientd_scan(const std::string &socket_path, const std::string &host, uint16_t port, const std::string &path,
+                    bool recursive, uint8_t max_ham, uint8_t types, bool rescan);
+
+    /* Where simpic_clientd listens by default: $XDG_RUNTIME_DIR/simpic_clientd.sock, or /tmp/simpic_clientd-UID.sock. */
+    std::string clientd_socket_path();
+}
@@ -1,45 +1,101 @@
 #include "simpic_image.hpp"
 
+#include <algorithm>
+
 namespace SimpicClientLib
 {
-    Image::Image(struct ImageHeader *hdr, int _index, int _fd)
+    Image::Image(struct ImageHeader2 *hdr, int _index, Transport *_transport)
+        : Media(DataTypes::Image, hdr->sha256_hash, hdr->size, hdr->filename_length, hdr->path_length, _index, _transport)
     {
-        currently_read = 0;
-
-        index = _index;
         width = hdr->width;
         height = hdr->height;
-        fd = _fd;
-        std::memcpy(sha256, hdr->sha256_hash, sizeof(sha256));
+        type = ImageType::Undefined;
+        std::memset(&quality, 0, sizeof(quality));
+    }
 
-        length = hdr->size;
+    bool extract_jpeg_thumbnail(const std::vector<char> &jpeg, std::vector<char> &thumbnail)
+    {
+        const uint8_t *data = (const uint8_t*) jpeg.data();
+        size_t size = jpeg.size();
+        bool progressive = false;
 
-        /* Initialize VLAs for the filename and path information. */
-        char c_filename[hdr->filename_length] = {0};
-        char c_pathname[hdr->path_length] = {0};
+        /* Not a JPEG at all. */
+        if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+            return false;
 
-        recvall(fd, c_filename, sizeof(c_filename));
-        recvall(fd, c_pathname, sizeof(c_pathname));
+        size_t pos = 2;
 
-        filename += c_filename;
-        path += c_pathname;
-    }
+        /* Walk the marker segments: each is 0xFF, the marker, then a big-endian length that counts itself. */
+        while (pos + 4 <= size)
+        {
+            if (data[pos] != 0xFF)
+                return false;
 
-    size_t Image::readbytes(char *buf, size_t amnt)
-    {
-        /* The entire image was read... we don't need to read from it anymore. */
-        if (currently_read == length)
-            return -1;
+            uint8_t marker = data[pos + 1];
 
-        /* If the next read would exceed the length of the file. */
-        if ((currently_read + amnt) > length)
-        {
-            amnt = length - currently_read;
-        }
+            /* Fill bytes. */
+            if (marker == 0xFF)
+            {
+                pos++;
+                continue;
+            }
+
+            size_t seglen = (data[pos + 2] << 8) | data[pos + 3];
+            size_t end = pos + 2 + seglen;
 
-        size_t amntread = recv(fd, buf, amnt, MSG_WAITALL);
-        currently_read += amntread;
+            if (seglen < 2)
+                return false;
+
+            /* APP0 (JFXX) and APP1 (EXIF) carry the thumbnail as a whole JPEG of its own. */
+            if (marker == 0xE0 || marker == 0xE1)
+            {
+                size_t stop = std::min(end, size);
+
+                for (size_t i = pos + 4; i + 1 < stop; i++)
+                {
+                    if (data[i] != 0xFF || data[i + 1] != 0xD8)
+                        continue;
+
+                    for (size_t j = i + 2; j + 1 < stop; j++)
+                    {
+                        if (data[j] == 0xFF && data[j + 1] == 0xD9)
+                        {
+                            thumbnail.assign(jpeg.begin() + i, jpeg.begin() + j + 2);
+                            return true;
+                        }
+                    }
+
+                    break;
+                }
+            }
+
+            if (marker == 0xC2)
+                progressive = true;
+
+            /* Start of scan: in a progressive JPEG, the first scan alone is a whole (if coarse) image. */
+            if (marker == 0xDA)
+            {
+                if (!progressive)
+                    return false;
+
+                /* The scan ends at the first marker that isn't a stuffed byte or a restart marker. */
+                for (size_t i = end; i + 1 < size; i++)
+                {
+                    if (data[i] == 0xFF && data[i + 1] != 0x00 && !(data[i + 1] >= 0xD0 && data[i + 1] <= 0xD7))
+                    {
+                        thumbnail.assign(jpeg.begin(), jpeg.begin() + i);
+                        thumbnail.push_back((char) 0xFF);
+                        thumbnail.push_back((char) 0xD9);
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            pos = end;
+        }
 
-        return amntread;
+        return false;
     }
 }
\ No newline at end of file
@@ -2,12 +2,11 @@
 
 #include <iostream>
 #include <vector>
-#include <openssl/ssl.h>
 
 #include <cstring>
 
 #include "simpic_protocol.hpp"
-#include "networking.hpp"
+#include "simpic_media.hpp"
 
 namespace SimpicClientLib
 {
@@ -19,30 +18,40 @@ namespace SimpicClientLib
         Undefined
     };
 
-    class Image
+    /* Filled in by a QualityScorer (simpic_quality.hpp), if the SimpicClient was given one. */
+    struct QualityScore
     {
-    private:
-        int fd;
-        size_t currently_read;
-    public:
-        char sha256[SHA256_DIGEST_LENGTH];
-        size_t length;
-
-        int index;
-        int no_sets;
-        int set_no;
+        bool scored;
+        double sharpness; // variance of the Laplacian.
+        double blockiness; // 8x8 block boundary gradient over interior gradient; 1.0 is no blocking.
+        double noise; // estimated standard deviation of the noise.
+        double score; // higher is a better copy.
+    };
 
-        uint16_t width;
-        uint16_t height;
-        
-        std::string filename;
-        std::string path; 
+    class Image : public Media
+    {
+    public:
+        uint32_t width;
+        uint32_t height;
         
         ImageType type; 
 
-        Image(struct ImageHeader *hdr, int _index, int _fd);
+        QualityScore quality;
 
-        /* If read mode was turned on, read until this returns -1. */
-        size_t readbytes(char *buf, size_t amnt);
+        /* A v1 ImageHeader is widened into one of these first. */
+        Image(struct ImageHeader2 *hdr, int _index, Transport *_transport);
     };
+
+    /* An image a scan looked at, by its perceptual hash; see SimpicClient::set_perceptual_hashes(). */
+    struct HashedImage
+    {
+        char sha256[SHA256_DIGEST_LENGTH];
+        uint64_t phash;
+        std::string filename;
+        std::string path; // empty if the scan wasn't recursive.
+    };
+
+    /* Pull the embedded (EXIF/JFIF) thumbnail, or failing that the first progressive scan, out of the start of a JPEG. */
+    /* Returns false if neither is within the bytes given. */
+    bool extract_jpeg_thumbnail(const std::vector<char> &jpeg, std::vector<char> &thumbnail);
 }
\ No newline at end of file
@@ -0,0 +1,537 @@
+#include "simpic_index.hpp"
+#include "simpic_client.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The buckets of one block, and the one past the last. */
+#define INDEX_BUCKETS ((1 << INDEX_BLOCK_BITS) + 1)
+
+namespace SimpicClientLib
+{
+    /* Every client of a multiplexed session has an index of its own; only one of them writes it at a time. */
+    static std::mutex saving;
+
+    static uint32_t block_of(uint64_t phash, unsigned int b)
+    {
+        return (phash >> (b * INDEX_BLOCK_BITS)) & ((1 << INDEX_BLOCK_BITS) - 1);
+    }
+
+    /* Every value within radius of value, flipping only bits from the from-th on. */
+    static void neighbours(uint32_t value, int radius, unsigned int from, std::vector<uint32_t> &out)
+    {
+        out.push_back(value);
+
+        if (!radius)
+            return;
+
+        for (unsigned int bit = from; bit < INDEX_BLOCK_BITS; bit++)
+            neighbours(value ^ (1 << bit), radius - 1, bit + 1, out);
+    }
+
+    SimilarityIndex::SimilarityIndex(const std::string &_location)
+    {
+        location = _location;
+        map = (char*) MAP_FAILED;
+        map_size = 0;
+        header = nullptr;
+        entries = nullptr;
+        buckets = nullptr;
+        postings = nullptr;
+        names = nullptr;
+        hits = 0;
+        misses = 0;
+    }
+
+    SimilarityIndex::~SimilarityIndex()
+    {
+        unmap();
+    }
+
+    void SimilarityIndex::unmap()
+    {
+        if (map != MAP_FAILED)
+            munmap(map, map_size);
+
+        map = (char*) MAP_FAILED;
+        map_size = 0;
+        header = nullptr;
+        entries = nullptr;
+        buckets = nullptr;
+        postings = nullptr;
+        names = nullptr;
+    }
+
+    bool SimilarityIndex::load()
+    {
+        unmap();
+        added_at.clear();
+        added.clear();
+        added_names.clear();
+
+        int fd = open(location.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+
+        if (fd < 0)
+            return false;
+
+        if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct IndexHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        map_size = st.st_size;
+        map = (char*) mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (map == MAP_FAILED)
+        {
+            map_size = 0;
+            return false;
+        }
+
+        const struct IndexHeader *hdr = (const struct IndexHeader*) map;
+        uint64_t count = hdr->count;
+        uint64_t expected = sizeof(struct IndexHeader) + count * sizeof(struct IndexEntry)
+                        + (uint64_t) INDEX_BLOCKS * INDEX_BUCKETS * sizeof(uint32_t)
+                        + (uint64_t) INDEX_BLOCKS * count * sizeof(uint32_t) + hdr->names_length;
+
+        /* A truncated index is as good as none. */
+        if (std::memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) || expected != map_size)
+        {
+            unmap();
+            return false;
+        }
+
+        header = hdr;
+        entries = (const struct IndexEntry*) (map + sizeof(struct IndexHeader));
+        buckets = (const uint32_t*) (entries + count);
+        postings = buckets + (size_t) INDEX_BLOCKS * INDEX_BUCKETS;
+        names = (const char*) (postings + (size_t) INDEX_BLOCKS * count);
+
+        /* The right size isn't enough to be searched where it lies: every offset into it has to stay inside it. */
+        if (!consistent())
+        {
+            unmap();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool SimilarityIndex::consistent()
+    {
+        uint32_t count = header->count;
+
+        /* Then every name_offset below names_length ends at a NUL inside the names. */
+        if (count && (!header->names_length || names[header->names_length - 1] != '\0'))
+            return false;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (entries[i].name_offset >= header->names_length)
+                return false;
+        }
+
+        for (unsigned int b = 0; b < INDEX_BLOCKS; b++)
+        {
+            const uint32_t *start = buckets + (size_t) b * INDEX_BUCKETS;
+            const uint32_t *list = postings + (size_t) b * count;
+
+            if (start[0] != 0 || start[INDEX_BUCKETS - 1] != count)
+                return false;
+
+            for (size_t v = 1; v < INDEX_BUCKETS; v++)
+            {
+                if (start[v] < start[v - 1])
+                    return false;
+            }
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (list[i] >= count)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    void SimilarityIndex::save()
+    {
+        if (added.empty())
+            return;
+
+        struct Pending
+        {
+            struct IndexEntry entry;
+            std::string name;
+        };
+
+        /* The sessions of a multiplexed client each have an index of their own, loaded when they began: whatever */
+        /* the others saved since is merged in first, as with ReviewedSets, rather than written over. */
+        std::lock_guard<std::mutex> guard(saving);
+        SimilarityIndex saved(location);
+        saved.load();
+
+        /* By SHA256; what is on disk now is newer than what was mapped, and what was added since is newer still. */
+        std::map<std::string, Pending> merged;
+
+        for (SimilarityIndex *from : { this, &saved })
+        {
+            uint32_t mapped = from->header != nullptr ? from->header->count : 0;
+
+            for (uint32_t i = 0; i < mapped; i++)
+            {
+                const struct IndexEntry &entry = from->entries[i];
+                merged[std::string(entry.sha256, SHA256_DIGEST_LENGTH)] = {entry, from->names + entry.name_offset};
+            }
+        }
+
+        for (size_t i = 0; i < added.size(); i++)
+            merged[std::string(added[i].sha256, SHA256_DIGEST_LENGTH)] = {added[i], added_names[i]};
+
+        /* Sorted by hash already, as find() needs them. */
+        std::vector<Pending> all;
+        all.reserve(merged.size());
+
+        for (auto &pair : merged)
+            all.push_back(pair.second);
+
+        uint32_t count = all.size();
+        std::string blob;
+
+        for (Pending &pending : all)
+        {
+            pending.entry.name_offset = blob.size();
+            pending.entry.reserved = 0;
+            blob.append(pending.name.c_str(), pending.name.size() + 1);
+        }
+
+        /* Counting sort of the entries by each block, into the buckets and their postings. */
+        std::vector<uint32_t> starts((size_t) INDEX_BLOCKS * INDEX_BUCKETS, 0);
+        std::vector<uint32_t> lists((size_t) INDEX_BLOCKS * count);
+
+        for (unsigned int b = 0; b < INDEX_BLOCKS; b++)
+        {
+            uint32_t *start = starts.data() + (size_t) b * INDEX_BUCKETS;
+
+            for (Pending &pending : all)
+                start[block_of(pending.entry.phash, b) + 1]++;
+
+            for (size_t v = 1; v < INDEX_BUCKETS; v++)
+                start[v] += start[v - 1];
+
+            std::vector<uint32_t> next(start, start + INDEX_BUCKETS - 1);
+            uint32_t *list = lists.data() + (size_t) b * count;
+
+            for (uint32_t i = 0; i < count; i++)
+                list[next[block_of(all[i].entry.phash, b)]++] = i;
+        }
+
+        /* Write it beside the old one and rename it over, as ReviewedSets does. */
+        std::string temporary = location + ".";
+        int fd = make_temporary(temporary, ".tmp");
+
+        if (fd < 0)
+            throw ErrnoException(errno);
+
+        ::close(fd);
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+
+        if (!out)
+        {
+            int err = errno;
+            unlink(temporary.c_str());
+            throw ErrnoException(err);
+        }
+
+        struct IndexHeader hdr;
+        std::memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+        hdr.count = count;
+        hdr.names_length = blob.size();
+
+        out.write((char*) &hdr, sizeof(hdr));
+
+        for (Pending &pending : all)
+            out.write((char*) &pending.entry, sizeof(pending.entry));
+
+        out.write((char*) starts.data(), starts.size() * sizeof(uint32_t));
+        out.write((char*) lists.data(), lists.size() * sizeof(uint32_t));
+        out.write(blob.data(), blob.size());
+        out.close();
+
+        if (!out || rename(temporary.c_str(), location.c_str()) < 0)
+        {
+            int err = errno;
+            unlink(temporary.c_str());
+            throw ErrnoException(err);
+        }
+
+        load();
+    }
+
+    const struct IndexEntry *SimilarityIndex::find(const char *sha256)
+    {
+        if (header == nullptr)
+            return nullptr;
+
+        const struct IndexEntry *end = entries + header->count;
+        const struct IndexEntry *found = std::lower_bound(entries, end, sha256, [](const struct IndexEntry &entry, const char *hash) -> bool {
+            return std::memcmp(entry.sha256, hash, SHA256_DIGEST_LENGTH) < 0;
+        });
+
+        if (found == end || std::memcmp(found->sha256, sha256, SHA256_DIGEST_LENGTH))
+            return nullptr;
+
+        return found;
+    }
+
+    void SimilarityIndex::add(const char *sha256, uint64_t phash, const std::string &path)
+    {
+        std::string key(sha256, SHA256_DIGEST_LENGTH);
+        auto known = added_at.find(key);
+
+        if (known != added_at.end())
+        {
+            added[known->second].phash = phash;
+            added_names[known->second] = path;
+            return;
+        }
+
+        /* Already in the file just like this: nothing to write. */
+        const struct IndexEntry *mapped = find(sha256);
+
+        if (mapped != nullptr && mapped->phash == phash && path == names + mapped->name_offset)
+            return;
+
+        struct IndexEntry entry;
+        std::memcpy(entry.sha256, sha256, SHA256_DIGEST_LENGTH);
+        entry.phash = phash;
+        entry.name_offset = 0;
+        entry.reserved = 0;
+
+        added_at[key] = added.size();
+        added.push_back(entry);
+        added_names.push_back(path);
+    }
+
+    bool SimilarityIndex::lookup(const char *sha256, uint64_t &phash)
+    {
+        auto known = added_at.find(std::string(sha256, SHA256_DIGEST_LENGTH));
+
+        if (known != added_at.end())
+        {
+            phash = added[known->second].phash;
+            return true;
+        }
+
+        const struct IndexEntry *mapped = find(sha256);
+
+        if (mapped == nullptr)
+            return false;
+
+        phash = mapped->phash;
+        return true;
+    }
+
+    void SimilarityIndex::collect(const struct IndexEntry &entry, const char *name, uint64_t phash, uint8_t max_ham,
+                        std::vector<IndexMatch> &out)
+    {
+        int distance = std::popcount(entry.phash ^ phash);
+
+        if (distance > max_ham)
+            return;
+
+        IndexMatch match;
+        std::memcpy(match.sha256, entry.sha256, SHA256_DIGEST_LENGTH);
+        match.phash = entry.phash;
+        match.distance = distance;
+        match.path = name;
+        out.push_back(match);
+    }
+
+    std::vector<IndexMatch> SimilarityIndex::query(uint64_t phash, uint8_t max_ham)
+    {
+        std::vector<IndexMatch> matches;
+
+        if (header != nullptr)
+        {
+            uint32_t count = header->count;
+            int radius = max_ham / INDEX_BLOCKS;
+
+            /* Anything within max_ham is within radius on at least one block, so only those buckets need looking in. */
+            std::vector<uint32_t> candidates;
+
+            if (radius <= INDEX_MAX_PROBE_RADIUS)
+            {
+                std::vector<uint32_t> values;
+
+                for (unsigned int b = 0; b < INDEX_BLOCKS; b++)
+                {
+                    const uint32_t *start = buckets + (size_t) b * INDEX_BUCKETS;
+                    const uint32_t *list = postings + (size_t) b * count;
+
+                    values.clear();
+                    neighbours(block_of(phash, b), radius, 0, values);
+
+                    for (uint32_t value : values)
+                        candidates.insert(candidates.end(), list + start[value], list + start[value + 1]);
+                }
+
+                /* An entry near on several blocks is only compared once. */
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+            }
+            else
+            {
+                candidates.resize(count);
+
+                for (uint32_t i = 0; i < count; i++)
+                    candidates[i] = i;
+            }
+
+            for (uint32_t i : candidates)
+            {
+                /* Superseded by what was added since. */
+                if (!added.empty() && added_at.count(std::string(entries[i].sha256, SHA256_DIGEST_LENGTH)))
+                    continue;
+
+                collect(entries[i], names + entries[i].name_offset, phash, max_ham, matches);
+            }
+        }
+
+        for (size_t i = 0; i < added.size(); i++)
+            collect(added[i], added_names[i].c_str(), phash, max_ham, matches);
+
+        std::stable_sort(matches.begin(), matches.end(), [](const IndexMatch &a, const IndexMatch &b) -> bool {
+            return a.distance < b.distance;
+        });
+
+        return matches;
+    }
+
+    size_t SimilarityIndex::size()
+    {
+        size_t count = added.size();
+
+        if (header == nullptr)
+            return count;
+
+        for (uint32_t i = 0; i < header->count; i++)
+        {
+            if (added.empty() || !added_at.count(std::string(entries[i].sha256, SHA256_DIGEST_LENGTH)))
+                count++;
+        }
+
+        return count;
+    }
+
+    uint64_t dct_phash(const GrayImage &image)
+    {
+        const int N = 32;
+
+        /* The DCT-II matrix, only the rows that are kept (1 to 8). */
+        static const std::vector<float> dct = []() -> std::vector<float> {
+            std::vector<float> c(9 * N);
+
+            for (int u = 1; u <= 8; u++)
+                for (int x = 0; x < N; x++)
+                    c[u * N + x] = std::sqrt(2.0 / N) * std::cos(M_PI / 2 / N * u * (2 * x + 1));
+
+            return c;
+        }();
+
+        uint32_t w = image.width;
+        uint32_t h = image.height;
+
+        if (!w || !h)
+            return 0;
+
+        /* The blur is only needed where the reduction samples it: the sum of the 7x7 around, with the edges repeated. */
+        float small[N][N];
+
+        for (int y = 0; y < N; y++)
+        {
+            int64_t sy = (uint64_t) y * h / N;
+
+            for (int x = 0; x < N; x++)
+            {
+                int64_t sx = (uint64_t) x * w / N;
+                float sum = 0;
+
+                for (int dy = -3; dy <= 3; dy++)
+                {
+                    const float *row = image.pixels.data() + (size_t) std::clamp<int64_t>(sy + dy, 0, h - 1) * w;
+
+                    for (int dx = -3; dx <= 3; dx++)
+                        sum += row[std::clamp<int64_t>(sx + dx, 0, w - 1)];
+                }
+
+                small[y][x] = sum;
+            }
+        }
+
+        /* C * small * C^T, for the 8x8 frequencies after the first row and column. */
+        float half[9][N];
+
+        for (int u = 1; u <= 8; u++)
+        {
+            for (int x = 0; x < N; x++)
+            {
+                float sum = 0;
+
+                for (int y = 0; y < N; y++)
+                    sum += dct[u * N + y] * small[y][x];
+
+                half[u][x] = sum;
+            }
+        }
+
+        float coefficients[64];
+
+        for (int u = 1; u <= 8; u++)
+        {
+            for (int v = 1; v <= 8; v++)
+            {
+                float sum = 0;
+
+                for (int x = 0; x < N; x++)
+                    sum += half[u][x] * dct[v * N + x];
+
+                coefficients[(u - 1) * 8 + (v - 1)] = sum;
+            }
+        }
+
+        float sorted[64];
+        std::copy(coefficients, coefficients + 64, sorted);
+        std::nth_element(sorted, sorted + 32, sorted + 64);
+        float above = sorted[32];
+        float below = *std::max_element(sorted, sorted + 32);
+        float median = (below + above) / 2;
+
+        uint64_t phash = 0;
+
+        for (int i = 0; i < 64; i++)
+        {
+            if (coefficients[i] > median)
+                phash |= 1ULL << i;
+        }
+
+        return phash;
+    }
+}
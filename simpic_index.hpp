@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <cstdint>
+
+#include <openssl/sha.h>
+
+#include "simpic_decode.hpp"
+
+#define INDEX_MAGIC "SPINDX01"
+
+/* Multi-index hashing: the 64 bits of a perceptual hash are cut into this many blocks, each with a bucket for every */
+/* value it can take. Two hashes within r of each other are within r / INDEX_BLOCKS of each other on some block. */
+#define INDEX_BLOCKS 4
+#define INDEX_BLOCK_BITS 16
+
+/* Past this radius within a block, probing every bucket nearby costs more than comparing every entry. */
+#define INDEX_MAX_PROBE_RADIUS 2
+
+namespace SimpicClientLib
+{
+    /* The index file, mapped as it is: this, count IndexEntry sorted by hash, then for every block the number of the */
+    /* first posting of every bucket (and one past the last), then for every block count postings (entry numbers) */
+    /* grouped by bucket, then the names. */
+    struct __attribute__((__packed__)) IndexHeader
+    {
+        char magic[8];
+        uint32_t count;
+        uint32_t names_length;
+    };
+
+    struct __attribute__((__packed__)) IndexEntry
+    {
+        char sha256[SHA256_DIGEST_LENGTH];
+        uint64_t phash;
+        uint32_t name_offset; // into the names: the full path it was last seen at, null-terminated.
+        uint32_t reserved; // keeps the buckets after the entries aligned.
+    };
+
+    /* An image the index knows of, near what was asked about. */
+    struct IndexMatch
+    {
+        char sha256[SHA256_DIGEST_LENGTH];
+        uint64_t phash;
+        uint8_t distance; // UINT8_MAX if it came from the server, which doesn't say.
+        std::string path;
+    };
+
+    /* Every image that a request() looked at, by its SHA256 and the perceptual hash the server gave it, persisted in */
+    /* ~/.simpic/index (see SimpicClient::set_indexing()). The file is mapped, and searched where it lies; what is */
+    /* added meanwhile is held in memory, searched in full, and merged in by save(). */
+    class SimilarityIndex
+    {
+    private:
+        std::string location;
+
+        char *map;
+        size_t map_size;
+
+        const struct IndexHeader *header;
+        const struct IndexEntry *entries;
+        const uint32_t *buckets;
+        const uint32_t *postings;
+        const char *names;
+
+        /* By SHA256, into added (and the name of each, in added_names). */
+        std::unordered_map<std::string, size_t> added_at;
+        std::vector<struct IndexEntry> added;
+        std::vector<std::string> added_names;
+
+        void unmap();
+
+        /* Whether what load() mapped can be searched safely: names inside the names, postings inside the entries. */
+        bool consistent();
+
+        /* The mapped entry with this hash, if there is one. */
+        const struct IndexEntry *find(const char *sha256);
+
+        void collect(const struct IndexEntry &entry, const char *name, uint64_t phash, uint8_t max_ham,
+                        std::vector<IndexMatch> &out);
+
+    public:
+        uint64_t hits; // queries of SimpicClient::similar() the index could answer...
+        uint64_t misses; // ...and those it couldn't, which went to the server.
+
+        SimilarityIndex(const std::string &_location);
+        ~SimilarityIndex();
+
+        /* Returns false if there is no index yet (or it was unreadable), leaving it empty. */
+        bool load();
+
+        /* Only writes if anything was added since load(); merges with whatever is in the file by then. */
+        void save();
+
+        /* Remember an image, or where it was seen last if it is known already. */
+        void add(const char *sha256, uint64_t phash, const std::string &path);
+
+        /* The perceptual hash of the image with this SHA256, if it is known. */
+        bool lookup(const char *sha256, uint64_t &phash);
+
+        /* Every image within max_ham of phash, nearest first. */
+        std::vector<IndexMatch> query(uint64_t phash, uint8_t max_ham);
+
+        size_t size();
+    };
+
+    /* The DCT perceptual hash the server gives images (that of pHash's ph_dct_imagehash(), on the luminance): a 7x7 */
+    /* box blur, a nearest-neighbour reduction to 32x32, and then a bit for each of the 8x8 lowest frequencies but the */
+    /* first, set if it is above their median. Decoders round differently, so a bit or two may differ from the server's. */
+    uint64_t dct_phash(const GrayImage &image);
+}
@@ -0,0 +1,261 @@
+#include "simpic_link.hpp"
+#include "utils.hpp"
+
+#include <memory>
+#include <set>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+
+/* How much of a file is hashed at a time. */
+#define LINK_HASH_BUFFER (1 << 20)
+
+/* How many free names a hard link is tried under before giving up with EEXIST. */
+#define LINK_NAME_ATTEMPTS 16
+
+namespace SimpicClientLib
+{
+    /* Whether the file open on fd still has this hash; errno is left set if it couldn't be read. */
+    static bool same_hash(int fd, const char *sha256, std::vector<char> &buffer)
+    {
+        std::shared_ptr<EVP_MD_CTX> hasher(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        EVP_DigestInit_ex(hasher.get(), EVP_sha256(), nullptr);
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        off_t offset = 0;
+
+        while (true)
+        {
+            ssize_t n = pread(fd, buffer.data(), buffer.size(), offset);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n < 0)
+                return false;
+
+            if (n == 0)
+                break;
+
+            EVP_DigestUpdate(hasher.get(), buffer.data(), n);
+            offset += n;
+        }
+
+        unsigned char result[SHA256_DIGEST_LENGTH];
+        EVP_DigestFinal_ex(hasher.get(), result, nullptr);
+
+        errno = 0;
+        return !std::memcmp(result, sha256, SHA256_DIGEST_LENGTH);
+    }
+
+    static std::string directory_of(const std::string &path)
+    {
+        size_t slash = path.find_last_of('/');
+
+        if (slash == std::string::npos)
+            return ".";
+
+        return slash ? path.substr(0, slash) : "/";
+    }
+
+    /* Make a reflink of source_fd at a new file named temp and some random characters (which temp is set to), */
+    /* with the metadata of the file it is to replace. */
+    static bool reflink_to(int source_fd, std::string &temp, struct stat &replaced)
+    {
+        int fd = make_temporary(temp);
+
+        if (fd < 0)
+            return false;
+
+        if (fchmod(fd, replaced.st_mode & 07777) < 0 || ioctl(fd, FICLONE, source_fd) < 0)
+        {
+            int err = errno;
+            ::close(fd);
+            unlink(temp.c_str());
+            errno = err;
+            return false;
+        }
+
+        /* Best effort: only root can give a file away, and the copy is already good without it. */
+        if (fchown(fd, replaced.st_uid, replaced.st_gid) < 0)
+            errno = 0;
+
+        struct timespec times[2] = { replaced.st_atim, replaced.st_mtim };
+        futimens(fd, times);
+
+        /* The clone has to be on disk before it is renamed over the duplicate, or a crash could leave neither. */
+        if (fsync(fd) < 0)
+        {
+            int err = errno;
+            ::close(fd);
+            unlink(temp.c_str());
+            errno = err;
+            return false;
+        }
+
+        ::close(fd);
+        return true;
+    }
+
+    /* Hard link source at a new name, temp and some random characters, which temp is set to. */
+    static bool hardlink_to(const std::string &source, std::string &temp)
+    {
+        /* link() won't take a name mkstemp() made already, so pick names until one is free. */
+        for (int attempt = 0; attempt < LINK_NAME_ATTEMPTS; attempt++)
+        {
+            std::string name = temp + random_chars(12);
+
+            if (link(source.c_str(), name.c_str()) == 0)
+            {
+                temp = name;
+                return true;
+            }
+
+            if (errno != EEXIST)
+                return false;
+        }
+
+        return false;
+    }
+
+    std::vector<LinkResult> link_duplicates(RemoveTarget &source, std::vector<RemoveTarget> &duplicates)
+    {
+        std::vector<LinkResult> results(duplicates.size(), LinkResult{LinkOutcomes::Failed, 0});
+        std::vector<char> buffer(LINK_HASH_BUFFER);
+
+        int source_fd = open(source.path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat source_st;
+
+        if (source_fd < 0 || fstat(source_fd, &source_st) < 0)
+        {
+            int err = errno;
+
+            if (source_fd >= 0)
+                ::close(source_fd);
+
+            throw ErrnoException(err);
+        }
+
+        if (!same_hash(source_fd, source.sha256, buffer))
+        {
+            int err = errno;
+            ::close(source_fd);
+
+            if (err)
+                throw ErrnoException(err);
+
+            for (LinkResult &result : results)
+                result.outcome = LinkOutcomes::Changed;
+
+            return results;
+        }
+
+        /* Once the filesystem turns down a reflink, the rest of the batch goes straight to hard links. */
+        bool reflinks = true;
+        std::set<std::string> touched;
+
+        for (size_t i = 0; i < duplicates.size(); i++)
+        {
+            LinkResult &result = results[i];
+            const std::string &path = duplicates[i].path;
+
+            struct stat st;
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+            if (fd < 0 || fstat(fd, &st) < 0)
+            {
+                result._errno = errno;
+
+                if (fd >= 0)
+                    ::close(fd);
+
+                continue;
+            }
+
+            if (st.st_dev == source_st.st_dev && st.st_ino == source_st.st_ino)
+            {
+                ::close(fd);
+                result.outcome = LinkOutcomes::AlreadyLinked;
+                continue;
+            }
+
+            /* Neither kind of link crosses filesystems. */
+            if (st.st_dev != source_st.st_dev)
+            {
+                ::close(fd);
+                result._errno = EXDEV;
+                continue;
+            }
+
+            bool same = same_hash(fd, duplicates[i].sha256, buffer) && !std::memcmp(duplicates[i].sha256, source.sha256, SHA256_DIGEST_LENGTH);
+            int err = errno;
+            ::close(fd);
+
+            if (!same)
+            {
+                result.outcome = err ? LinkOutcomes::Failed : LinkOutcomes::Changed;
+                result._errno = err;
+                continue;
+            }
+
+            std::string directory = directory_of(path);
+            std::string temp = directory + "/.simpic-link-";
+
+            if (reflinks && reflink_to(source_fd, temp, st))
+            {
+                result.outcome = LinkOutcomes::Reflinked;
+            }
+            else if (reflinks && errno != EOPNOTSUPP && errno != EINVAL && errno != ENOTTY && errno != EXDEV)
+            {
+                /* Not a matter of the filesystem; a hard link would fail the same way. */
+                result._errno = errno;
+                continue;
+            }
+            else
+            {
+                reflinks = false;
+
+                if (!hardlink_to(source.path, temp))
+                {
+                    result._errno = errno;
+                    continue;
+                }
+
+                result.outcome = LinkOutcomes::Hardlinked;
+            }
+
+            if (rename(temp.c_str(), path.c_str()) < 0)
+            {
+                result.outcome = LinkOutcomes::Failed;
+                result._errno = errno;
+                unlink(temp.c_str());
+                continue;
+            }
+
+            touched.insert(directory);
+        }
+
+        ::close(source_fd);
+
+        for (const std::string &directory : touched)
+        {
+            int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (fd >= 0)
+            {
+                fsync(fd);
+                ::close(fd);
+            }
+        }
+
+        return results;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "simpic_client.hpp"
+
+namespace SimpicClientLib
+{
+    enum class LinkOutcomes
+    {
+        Reflinked, // it now shares its blocks with the source (FICLONE).
+        Hardlinked, // it is now another name for the source.
+        AlreadyLinked, // it already was the source.
+        Changed, // it (or the source) no longer has the hash it was scanned with; left alone.
+        Failed // see _errno; left alone.
+    };
+
+    struct LinkResult
+    {
+        LinkOutcomes outcome;
+        int _errno;
+    };
+
+    /* The same thing ClientActions::Link has the server do, for files on this machine (a self-hosted scan). */
+    /* Each of duplicates that still has the hash of source is replaced by a reflink to it where the filesystem can */
+    /* make one, and by a hard link otherwise; either is made under a temporary name in the duplicate's directory and */
+    /* renamed over it, so that a duplicate is never missing. Each directory is synced once, after the whole batch. */
+    /* Returns how it went for each, in order. Throws ErrnoException if source can't be read. */
+    std::vector<LinkResult> link_duplicates(RemoveTarget &source, std::vector<RemoveTarget> &duplicates);
+}
@@ -0,0 +1,203 @@
+#include "simpic_media.hpp"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace SimpicClientLib
+{
+    HashMismatchException::HashMismatchException(std::string msg, std::string _filename)
+    {
+        message = msg;
+        filename = _filename;
+    }
+
+    std::string &HashMismatchException::what()
+    {
+        return message;
+    }
+
+    Media::Media(DataTypes _kind, const char *hash, uint64_t size, uint16_t filename_length, uint16_t path_length, int _index, Transport *_transport)
+    {
+        kind = _kind;
+        currently_read = 0;
+        preview_type = PreviewTypes::None;
+        buffered = false;
+        spilled = false;
+        spill_fd = -1;
+        spill_offset = 0;
+        verification = Verification::Unverified;
+
+        /* EVP picks the SHA-NI/AVX2 implementation the CPU has. */
+        hasher = std::shared_ptr<EVP_MD_CTX>(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        EVP_DigestInit_ex(hasher.get(), EVP_sha256(), nullptr);
+
+        index = _index;
+        no_sets = 0;
+        set_no = 0;
+        transport = _transport;
+        std::memcpy(sha256, hash, sizeof(sha256));
+
+        length = size;
+        limit = size;
+
+        std::string c_filename(filename_length, '\0');
+        transport->recvall(c_filename.data(), filename_length);
+        filename = c_filename.c_str();
+
+        /* A path_length of -1 means that no path is coming at all (non-recursive scans). */
+        if (path_length != (uint16_t) -1)
+        {
+            std::string c_pathname(path_length, '\0');
+            transport->recvall(c_pathname.data(), path_length);
+            path = c_pathname.c_str();
+        }
+    }
+
+    Media::~Media()
+    {
+
+    }
+
+    size_t Media::readbytes(char *buf, size_t amnt)
+    {
+        /* The entire file (or as much as was wanted) was read... we don't need to read from it anymore. */
+        if (currently_read >= limit)
+            return -1;
+
+        /* If the next read would exceed the length of the file. */
+        if ((currently_read + amnt) > limit)
+        {
+            amnt = limit - currently_read;
+        }
+
+        if (buffered)
+        {
+            std::memcpy(buf, body.data() + currently_read, amnt);
+            currently_read += amnt;
+            return amnt;
+        }
+
+        if (spilled)
+        {
+            ssize_t amntread = pread(spill_fd, buf, amnt, spill_offset + currently_read);
+
+            if (amntread <= 0)
+                return -1;
+
+            currently_read += amntread;
+            return amntread;
+        }
+
+        ssize_t amntread = transport->receive(buf, amnt);
+
+        if (amntread <= 0)
+            return -1;
+
+        currently_read += amntread;
+        digest(buf, amntread);
+
+        return amntread;
+    }
+
+    void Media::digest(const char *buf, size_t amnt)
+    {
+        EVP_DigestUpdate(hasher.get(), buf, amnt);
+
+        if (currently_read < length)
+            return;
+
+        unsigned char result[SHA256_DIGEST_LENGTH];
+        EVP_DigestFinal_ex(hasher.get(), result, nullptr);
+
+        verification = std::memcmp(result, sha256, sizeof(result)) ? Verification::Mismatch : Verification::Verified;
+    }
+
+    void Media::limit_to(size_t amnt)
+    {
+        limit = std::min(amnt, length);
+    }
+
+    void Media::skip()
+    {
+        if (buffered || spilled || currently_read >= length)
+            return;
+
+        /* Still hashed, without being copied anywhere if the transport can help it. */
+        transport->discard(length - currently_read, [this](const char *buf, size_t amnt) -> void {
+            currently_read += amnt;
+            digest(buf, amnt);
+        });
+    }
+
+    void Media::buffer()
+    {
+        body.resize(length);
+
+        /* Hash each chunk right after it lands, rather than in a second pass over the whole body. */
+        while (currently_read < length)
+        {
+            size_t amnt = std::min(length - currently_read, (size_t) RECEIVE_CHUNK_SIZE);
+            transport->recvall(body.data() + currently_read, amnt);
+
+            currently_read += amnt;
+            digest(body.data() + currently_read - amnt, amnt);
+        }
+
+        currently_read = 0;
+        buffered = true;
+    }
+
+    void Media::spill(int spill_to, off_t offset)
+    {
+        /* Each chunk is hashed on its way to the file. */
+        transport->receive_to(spill_to, offset + currently_read, length - currently_read, [this](const char *buf, size_t amnt) -> void {
+            currently_read += amnt;
+            digest(buf, amnt);
+        });
+
+        spill_fd = spill_to;
+        spill_offset = offset;
+        currently_read = 0;
+        spilled = true;
+    }
+
+    void Media::unspill()
+    {
+        if (!spilled)
+            return;
+
+        /* Not every filesystem can punch holes; there, the room is only had back with the file. */
+        fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, spill_offset, length);
+        spilled = false;
+    }
+
+    void Media::verify()
+    {
+        if (verification == Verification::Mismatch)
+            throw HashMismatchException("The data received does not match its SHA256 hash.", filename);
+    }
+
+    Video::Video(struct VideoHeader2 *hdr, int _index, Transport *_transport)
+        : Media(DataTypes::Video, hdr->sha256_hash, hdr->size, hdr->filename_length, hdr->path_length, _index, _transport)
+    {
+        width = hdr->width;
+        height = hdr->height;
+        duration = hdr->duration;
+    }
+
+    Audio::Audio(struct AudioHeader *hdr, int _index, Transport *_transport)
+        : Media(DataTypes::Audio, hdr->sha256_hash, hdr->size, hdr->filename_length, hdr->path_length, _index, _transport)
+    {
+        duration = hdr->duration;
+        sample_rate = hdr->sample_rate;
+        channels = hdr->channels;
+    }
+
+    Text::Text(struct TextHeader *hdr, int _index, Transport *_transport)
+        : Media(DataTypes::Text, hdr->sha256_hash, hdr->size, hdr->filename_length, hdr->path_length, _index, _transport)
+    {
+        lines = hdr->lines;
+    }
+}
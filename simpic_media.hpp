@@ -0,0 +1,140 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+
+#include <cstring>
+
+#include <sys/types.h>
+
+#include "simpic_protocol.hpp"
+#include "networking.hpp"
+#include "simpic_transport.hpp"
+
+/* Bodies are pulled off the socket (and hashed) this much at a time, so each chunk is hashed while it is still in cache. */
+#define RECEIVE_CHUNK_SIZE (1 << 20)
+
+namespace SimpicClientLib
+{
+    enum class Verification
+    {
+        Unverified, // the body hasn't been read all the way through (or wasn't sent).
+        Verified, // the body matched the SHA256 hash in its header.
+        Mismatch // the body was corrupted on its way.
+    };
+
+    class HashMismatchException : std::exception
+    {
+    public:
+        std::string message;
+        std::string filename;
+
+        HashMismatchException(std::string msg, std::string _filename);
+        std::string &what();
+    };
+
+    /* Everything a scan result has, whatever its type: its names, its hash, and a body that can be streamed, */
+    /* skipped, range-limited, buffered or spilled. Image, Video, Audio and Text derive from it (and only from it), */
+    /* so the void* a callback gets can be cast to either Media* or the type the DataTypes names. */
+    class Media
+    {
+    private:
+        Transport *transport;
+        size_t currently_read;
+        size_t limit;
+
+        /* The body is hashed as it arrives, and checked against sha256 once the last byte is in. */
+        std::shared_ptr<EVP_MD_CTX> hasher;
+        void digest(const char *buf, size_t amnt);
+
+        int spill_fd;
+        off_t spill_offset;
+
+    protected:
+        /* Reads the filename and path that follow every header. */
+        Media(DataTypes _kind, const char *hash, uint64_t size, uint16_t filename_length, uint16_t path_length, int _index, Transport *_transport);
+
+    public:
+        DataTypes kind;
+
+        char sha256[SHA256_DIGEST_LENGTH];
+        size_t length;
+
+        int index;
+        int no_sets;
+        int set_no;
+
+        std::string filename;
+        std::string path;
+
+        /* A cheap preview of the file, if one was asked for with SimpicClient::set_preview(). */
+        /* The full data can still be had later with SimpicClient::fetch(). */
+        std::vector<char> preview;
+        PreviewTypes preview_type;
+
+        /* The whole file data, if it was buffered (rather than left on the socket for readbytes()). */
+        std::vector<char> body;
+        bool buffered;
+
+        /* Or, past a memory budget, written out to a spill file (see SimpicClient::set_pipelined()). */
+        bool spilled;
+
+        Verification verification;
+
+        virtual ~Media();
+
+        /* If read mode was turned on, read until this returns -1. */
+        size_t readbytes(char *buf, size_t amnt);
+
+        /* Make readbytes() stop after the first amnt bytes; the rest is skipped once the callback returns. */
+        void limit_to(size_t amnt);
+
+        /* Discard whatever of the body is still on the socket, a chunk at a time (and still hashed), so memory stays constant. */
+        void skip();
+
+        /* Read all of the file data off the socket into body, before any readbytes(); readbytes() then serves it from memory. */
+        void buffer();
+
+        /* Like buffer(), but into the file spill_to at offset, which is left open for readbytes() to pread() from. */
+        void spill(int spill_to, off_t offset);
+
+        /* Once nothing will read it again, hand the room spill() took in the file back to the filesystem. */
+        void unspill();
+
+        /* Throws HashMismatchException if the body that was read did not match its hash. */
+        void verify();
+    };
+
+    class Video : public Media
+    {
+    public:
+        uint32_t width;
+        uint32_t height;
+        uint32_t duration; // in milliseconds.
+
+        /* A v1 VideoHeader is widened into one of these first. */
+        Video(struct VideoHeader2 *hdr, int _index, Transport *_transport);
+    };
+
+    class Audio : public Media
+    {
+    public:
+        uint32_t duration; // in milliseconds.
+        uint32_t sample_rate;
+        uint8_t channels;
+
+        Audio(struct AudioHeader *hdr, int _index, Transport *_transport);
+    };
+
+    class Text : public Media
+    {
+    public:
+        uint32_t lines;
+
+        Text(struct TextHeader *hdr, int _index, Transport *_transport);
+    };
+}
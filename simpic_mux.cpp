@@ -0,0 +1,346 @@
+#include "simpic_mux.hpp"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <endian.h>
+#include <sys/socket.h>
+
+namespace SimpicClientLib
+{
+    StreamTransport::StreamTransport(Multiplexer *_mux, uint32_t _id) : Transport(-1, TransportKinds::Stream)
+    {
+        mux = _mux;
+        id = _id;
+    }
+
+    StreamTransport::~StreamTransport()
+    {
+        std::lock_guard<std::mutex> guard(mux->lock);
+        auto found = mux->streams.find(id);
+
+        if (found == mux->streams.end())
+            return;
+
+        Multiplexer::Stream &stream = *found->second;
+        stream.detached = true;
+        stream.inbound.clear();
+
+        /* Nothing can be sent anymore; let it go now rather than wait on a writer that has stopped. */
+        if (mux->error)
+        {
+            mux->streams.erase(found);
+            return;
+        }
+
+        mux->queue(id, stream, std::vector<char>());
+    }
+
+    ssize_t StreamTransport::receive(void *buffer, size_t length)
+    {
+        std::unique_lock<std::mutex> guard(mux->lock);
+        Multiplexer::Stream &stream = *mux->streams[id];
+
+        stream.readable.wait(guard, [&stream, this]() -> bool {
+            return !stream.inbound.empty() || stream.ended || mux->error;
+        });
+
+        /* What was already routed to it is still good after the connection is gone. */
+        if (stream.inbound.empty())
+        {
+            errno = mux->error;
+            return stream.ended ? 0 : -1;
+        }
+
+        std::vector<char> &front = stream.inbound.front();
+        size_t amnt = std::min(length, front.size() - stream.inbound_offset);
+
+        std::memcpy(buffer, front.data() + stream.inbound_offset, amnt);
+        stream.inbound_offset += amnt;
+
+        if (stream.inbound_offset == front.size())
+        {
+            stream.inbound.pop_front();
+            stream.inbound_offset = 0;
+        }
+
+        /* The server gets room for as much again. */
+        stream.credit_due += amnt;
+
+        if (stream.credit_due >= STREAM_CREDIT_THRESHOLD)
+            mux->schedule(id, stream);
+
+        return amnt;
+    }
+
+    void StreamTransport::sendall(void *buffer, size_t length)
+    {
+        const char *at = (const char*) buffer;
+
+        while (length)
+        {
+            size_t amnt = std::min(length, (size_t) STREAM_FRAME_SIZE);
+
+            std::unique_lock<std::mutex> guard(mux->lock);
+            Multiplexer::Stream &stream = *mux->streams[id];
+
+            stream.writable.wait(guard, [&stream, this]() -> bool {
+                return stream.queued < STREAM_SEND_WINDOW || mux->error;
+            });
+
+            if (mux->error)
+            {
+                uint8_t err = mux->error;
+                throw simpic_networking_exception("Error sendall(): " + std::string(std::strerror(err)), err);
+            }
+
+            mux->queue(id, stream, std::vector<char>(at, at + amnt));
+
+            at += amnt;
+            length -= amnt;
+        }
+    }
+
+    Multiplexer::Multiplexer(int _fd)
+    {
+        fd = _fd;
+
+        /* One thread only receives and the other only sends, which a plain socket allows. */
+        link.reset(new SocketTransport(fd));
+
+        next_id = 1;
+        stopping = false;
+        error = 0;
+
+        reader = std::thread(&Multiplexer::read_loop, this);
+        writer = std::thread(&Multiplexer::write_loop, this);
+    }
+
+    Multiplexer::~Multiplexer()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        pending.notify_all();
+        writer.join();
+
+        /* The reader is most likely waiting on the server, which has nothing more to say. */
+        shutdown(fd, SHUT_RDWR);
+        reader.join();
+    }
+
+    StreamTransport *Multiplexer::open()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (error)
+            throw simpic_networking_exception("Error opening a stream: " + std::string(std::strerror(error)), error);
+
+        uint32_t id = next_id++;
+        std::shared_ptr<Stream> stream(new Stream);
+        stream->inbound_offset = 0;
+        stream->queued = 0;
+        stream->scheduled = false;
+        stream->ended = false;
+        stream->detached = false;
+        stream->received = 0;
+        stream->credit_due = 0;
+        stream->send_window = STREAM_RECEIVE_WINDOW;
+
+        streams[id] = stream;
+        return new StreamTransport(this, id);
+    }
+
+    void Multiplexer::fail(int err)
+    {
+        if (!error)
+            error = err ? err : ECONNRESET;
+
+        for (auto &entry : streams)
+        {
+            entry.second->readable.notify_all();
+            entry.second->writable.notify_all();
+        }
+
+        pending.notify_all();
+    }
+
+    void Multiplexer::queue(uint32_t id, Stream &stream, std::vector<char> &&frame)
+    {
+        stream.queued += frame.size();
+        stream.outbound.push_back(std::move(frame));
+
+        schedule(id, stream);
+    }
+
+    void Multiplexer::schedule(uint32_t id, Stream &stream)
+    {
+        if (stream.scheduled)
+            return;
+
+        bool sendable = !stream.outbound.empty() && stream.outbound.front().size() <= stream.send_window;
+
+        if (!sendable && (!stream.credit_due || stream.detached))
+            return;
+
+        stream.scheduled = true;
+        ready.push_back(id);
+        pending.notify_one();
+    }
+
+    void Multiplexer::read_loop()
+    {
+        try
+        {
+            while (true)
+            {
+                struct StreamFrame frame;
+                link->recvall(&frame, sizeof(frame));
+
+                uint32_t id = le32toh(frame.stream);
+                uint32_t length = le32toh(frame.length);
+
+                if (length & STREAM_FRAME_CREDIT)
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    auto found = streams.find(id);
+
+                    /* What a stream that is ending still has to send may be waiting on this. */
+                    if (found == streams.end())
+                        continue;
+
+                    Stream &stream = *found->second;
+                    stream.send_window += length & ~STREAM_FRAME_CREDIT;
+                    schedule(id, stream);
+                    continue;
+                }
+
+                if (length > STREAM_FRAME_SIZE)
+                    throw simpic_networking_exception("Error demultiplexing: a frame of " + std::to_string(length) + " bytes", EPROTO);
+
+                std::vector<char> data(length);
+
+                if (!data.empty())
+                    link->recvall(data.data(), data.size());
+
+                std::lock_guard<std::mutex> guard(lock);
+                auto found = streams.find(id);
+
+                /* A stream that is no more; whatever was still on its way to it goes nowhere. */
+                if (found == streams.end() || found->second->detached)
+                    continue;
+
+                Stream &stream = *found->second;
+
+                if (data.empty())
+                {
+                    stream.ended = true;
+                }
+                else
+                {
+                    stream.received += data.size();
+
+                    /* Past the window, the server isn't waiting for credit; nothing says when it would stop. */
+                    if (stream.received > STREAM_RECEIVE_WINDOW)
+                    {
+                        fail(EPROTO);
+                        return;
+                    }
+
+                    stream.inbound.push_back(std::move(data));
+                }
+
+                stream.readable.notify_all();
+            }
+        }
+        catch (simpic_networking_exception &ex)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            fail(ex.errnum);
+        }
+    }
+
+    void Multiplexer::write_loop()
+    {
+        std::vector<char> batch;
+
+        while (true)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            pending.wait(guard, [this]() -> bool {
+                return !ready.empty() || stopping || error;
+            });
+
+            if (error || (ready.empty() && stopping))
+                return;
+
+            /* A frame from each stream in turn, so that each gets an equal share of every send. */
+            batch.clear();
+
+            while (!ready.empty() && batch.size() < STREAM_BATCH_SIZE)
+            {
+                uint32_t id = ready.front();
+                ready.pop_front();
+
+                auto found = streams.find(id);
+
+                if (found == streams.end())
+                    continue;
+
+                Stream &stream = *found->second;
+                stream.scheduled = false;
+
+                struct StreamFrame frame;
+                frame.stream = htole32(id);
+
+                if (stream.credit_due && !stream.detached)
+                {
+                    frame.length = htole32(stream.credit_due | STREAM_FRAME_CREDIT);
+                    batch.insert(batch.end(), (char*) &frame, (char*) &frame + sizeof(frame));
+
+                    stream.received -= stream.credit_due;
+                    stream.credit_due = 0;
+                }
+
+                /* Only once the server has room for it; its credit puts the stream back in ready. */
+                if (!stream.outbound.empty() && stream.outbound.front().size() <= stream.send_window)
+                {
+                    std::vector<char> &data = stream.outbound.front();
+
+                    frame.length = htole32(data.size());
+                    batch.insert(batch.end(), (char*) &frame, (char*) &frame + sizeof(frame));
+                    batch.insert(batch.end(), data.begin(), data.end());
+
+                    stream.send_window -= data.size();
+                    stream.queued -= data.size();
+                    stream.outbound.pop_front();
+                    stream.writable.notify_all();
+                }
+
+                if (stream.outbound.empty() && stream.detached)
+                    streams.erase(found);
+                else
+                    schedule(id, stream);
+            }
+
+            /* The streams keep queueing while this is on its way. */
+            guard.unlock();
+
+            try
+            {
+                link->sendall(batch.data(), batch.size());
+            }
+            catch (simpic_networking_exception &ex)
+            {
+                guard.lock();
+                fail(ex.errnum);
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <cstdint>
+
+#include "simpic_transport.hpp"
+#include "simpic_protocol.hpp"
+
+/* How much a stream may have waiting to go out before its sendall() waits for the writer. */
+#define STREAM_SEND_WINDOW (256 * 1024)
+
+/* The writer gathers frames (from every stream with some, in turn) into sends of about this much. */
+#define STREAM_BATCH_SIZE 65536
+
+/* Credit for what a stream has read is given back once it comes to this much, rather than a frame at a time. */
+#define STREAM_CREDIT_THRESHOLD (STREAM_RECEIVE_WINDOW / 4)
+
+namespace SimpicClientLib
+{
+    class Multiplexer;
+
+    /* One stream of a Multiplexer, as a transport of its own: what is sent on it goes out in StreamFrames with its ID, */
+    /* and what is received is whatever the demultiplexer routed to it. Destroying it ends the stream. */
+    /* Like every transport, it belongs to one thread; the streams of a connection may each have their own. */
+    class StreamTransport : public Transport
+    {
+    private:
+        Multiplexer *mux;
+
+    public:
+        uint32_t id;
+
+        StreamTransport(Multiplexer *_mux, uint32_t _id);
+        ~StreamTransport();
+
+        ssize_t receive(void *buffer, size_t length);
+        void sendall(void *buffer, size_t length);
+    };
+
+    /* Carries any number of streams over one connection (see ProtocolCapabilities::Streams). A reader thread routes */
+    /* every frame that comes in to its stream; a writer thread sends what the streams queued, a frame of each in turn, */
+    /* so that a stream with a lot to send can't starve the others. Incoming frames are held until their stream reads */
+    /* them, which is at most STREAM_RECEIVE_WINDOW of each: the server sends no more until it is given credit. */
+    class Multiplexer
+    {
+    private:
+        friend class StreamTransport;
+
+        struct Stream
+        {
+            std::deque<std::vector<char>> inbound;
+            size_t inbound_offset; // into the first of inbound.
+
+            std::deque<std::vector<char>> outbound; // an empty one ends the stream.
+            size_t queued; // bytes in outbound.
+            bool scheduled; // whether it is in ready.
+
+            size_t received; // bytes the server sent that it wasn't given credit for yet...
+            uint32_t credit_due; // ...of which the stream read this much, which the next credit frame gives back.
+            size_t send_window; // what the server still has room for.
+
+            bool ended; // the server ended it.
+            bool detached; // its StreamTransport is gone; it goes once outbound is empty.
+
+            std::condition_variable readable;
+            std::condition_variable writable;
+        };
+
+        int fd;
+        std::unique_ptr<Transport> link;
+
+        std::mutex lock;
+        std::condition_variable pending;
+        std::map<uint32_t, std::shared_ptr<Stream>> streams;
+
+        /* The streams with something to send, in the order they get to. */
+        std::deque<uint32_t> ready;
+
+        uint32_t next_id;
+        bool stopping;
+        int error; // once the connection is gone, why.
+
+        std::thread reader;
+        std::thread writer;
+
+        void read_loop();
+        void write_loop();
+
+        /* All with lock held. */
+        void fail(int err);
+        void queue(uint32_t id, Stream &stream, std::vector<char> &&frame);
+
+        /* Into ready, if it isn't already and it has credit to give, or a frame the server has room for. */
+        void schedule(uint32_t id, Stream &stream);
+
+    public:
+        /* Takes over fd, which must have negotiated ProtocolCapabilities::Streams, and starts both threads. */
+        Multiplexer(int _fd);
+
+        /* Sends whatever the streams still had queued, then stops both threads; fd is left open. */
+        ~Multiplexer();
+
+        /* A new stream, ready for a ClientRequest as on a connection of its own. */
+        StreamTransport *open();
+    };
+}
@@ -0,0 +1,212 @@
+#include "simpic_pipeline.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include <unistd.h>
+
+namespace SimpicClientLib
+{
+    /* Neither side of the queue ever blocks on a lock: spin a little, then back off to short sleeps. */
+    static void backoff(int &spins)
+    {
+        if (++spins < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    Pipeline::Pipeline(unsigned int count, size_t memory_budget, std::function<void(void*, DataTypes)> cb, QualityScorer *pool)
+    {
+        callback = cb;
+        scorer = pool;
+        budget = memory_budget;
+        in_memory = 0;
+
+        spill_file = nullptr;
+        spill_end = 0;
+        current = 0;
+        aborted = false;
+
+        if (!count)
+            count = 1;
+
+        for (unsigned int i = 0; i < count; i++)
+            queues.push_back(new SpscQueue<PipelineEvent>(PIPELINE_QUEUE_SIZE));
+
+        for (unsigned int i = 0; i < count; i++)
+            consumers.emplace_back(&Pipeline::consume, this, queues[i]);
+    }
+
+    Pipeline::~Pipeline()
+    {
+        finish();
+
+        for (SpscQueue<PipelineEvent> *queue : queues)
+            delete queue;
+
+        if (spill_file != nullptr)
+            std::fclose(spill_file);
+    }
+
+    void Pipeline::push(size_t queue, PipelineEvent ev)
+    {
+        int spins = 0;
+
+        while (!queues[queue]->push(ev))
+            backoff(spins);
+    }
+
+    void Pipeline::update(struct UpdateHeader2 *uh)
+    {
+        struct UpdateHeader2 *copy = new struct UpdateHeader2;
+        *copy = *uh;
+
+        push(0, {PipelineEvents::Update, copy, DataTypes::Update});
+    }
+
+    void Pipeline::begin_set(DataTypes type)
+    {
+        push(current, {PipelineEvents::SetStart, nullptr, type});
+    }
+
+    void Pipeline::media(Media *img, bool with_data)
+    {
+        /* It was already buffered, by a request() that had to see the whole set before passing it on. */
+        if (img->buffered)
+        {
+            in_memory += img->length;
+        }
+        else if (with_data)
+        {
+            /* Within budget, keep it in memory; past it, spill it to disk. Either way, off the socket now. */
+            if (in_memory + img->length <= budget)
+            {
+                in_memory += img->length;
+                img->buffer();
+            }
+            else
+            {
+                if (spill_file == nullptr)
+                    spill_file = std::tmpfile();
+
+                if (spill_file == nullptr)
+                    throw simpic_networking_exception("Could not make a spill file: " + std::string(std::strerror(errno)), errno);
+
+                img->spill(fileno(spill_file), spill_end);
+                spill_end += img->length;
+            }
+
+            if (scorer != nullptr && img->buffered && img->kind == DataTypes::Image)
+                scorer->submit((Image*) img);
+        }
+
+        push(current, {PipelineEvents::Media, img, img->kind});
+    }
+
+    void Pipeline::end_set(DataTypes type)
+    {
+        push(current, {PipelineEvents::SetEnd, nullptr, type});
+
+        /* The next set goes to the next consumer. */
+        current = (current + 1) % queues.size();
+    }
+
+    void Pipeline::finish()
+    {
+        if (consumers.empty())
+            return;
+
+        for (size_t i = 0; i < queues.size(); i++)
+            push(i, {PipelineEvents::Done, nullptr, DataTypes::Unspecified});
+
+        for (std::thread &t : consumers)
+            t.join();
+
+        consumers.clear();
+    }
+
+    void Pipeline::abort()
+    {
+        aborted = true;
+        finish();
+    }
+
+    void Pipeline::consume(SpscQueue<PipelineEvent> *queue)
+    {
+        /* The images of the set in progress, freed once its end has been handled. */
+        std::vector<Media*> garbage;
+
+        while (true)
+        {
+            PipelineEvent ev;
+            int spins = 0;
+
+            while (!queue->pop(ev))
+                backoff(spins);
+
+            switch (ev.kind)
+            {
+                case PipelineEvents::Update:
+                {
+                    if (!aborted)
+                        callback(ev.data, DataTypes::Update);
+
+                    delete (struct UpdateHeader2*) ev.data;
+                    break;
+                }
+
+                case PipelineEvents::SetStart:
+                {
+                    if (!aborted)
+                        callback(nullptr, ev.type);
+
+                    break;
+                }
+
+                case PipelineEvents::Media:
+                {
+                    garbage.push_back((Media*) ev.data);
+
+                    if (!aborted)
+                        callback(ev.data, ev.type);
+
+                    break;
+                }
+
+                case PipelineEvents::SetEnd:
+                case PipelineEvents::Done:
+                {
+                    if (ev.kind == PipelineEvents::SetEnd && !aborted)
+                    {
+                        if (scorer != nullptr)
+                            scorer->wait();
+
+                        callback(nullptr, ev.type);
+                    }
+
+                    /* Scoring may still be under way on a set that was cut short. */
+                    else if (!garbage.empty() && scorer != nullptr)
+                        scorer->wait();
+
+                    /* The spill files outlive the consumers, so what was spilled can go now too. */
+                    for (Media *img : garbage)
+                    {
+                        if (img->buffered)
+                            in_memory -= img->length;
+
+                        img->unspill();
+                        delete img;
+                    }
+
+                    garbage.clear();
+
+                    if (ev.kind == PipelineEvents::Done)
+                        return;
+
+                    break;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#include <cstdio>
+
+#include "spsc_queue.hpp"
+#include "simpic_image.hpp"
+#include "simpic_media.hpp"
+#include "simpic_protocol.hpp"
+#include "simpic_quality.hpp"
+
+/* Slots in each consumer's queue; the network thread only waits once one fills up. */
+#define PIPELINE_QUEUE_SIZE 65536
+
+namespace SimpicClientLib
+{
+    enum class PipelineEvents
+    {
+        SetStart,
+        Media,
+        SetEnd,
+        Update,
+        Done
+    };
+
+    struct PipelineEvent
+    {
+        PipelineEvents kind;
+        void *data;
+        DataTypes type;
+    };
+
+    /* Decouples reading the socket from running the callback: the network thread parses frames into one lock-free */
+    /* SPSC queue per consumer thread, handing out whole sets round-robin, and consumers run the callback on their own time. */
+    /* File data is read off the socket straight away: into memory up to the budget, and into a temporary spill file past it. */
+    class Pipeline
+    {
+    private:
+        std::vector<SpscQueue<PipelineEvent>*> queues;
+        std::vector<std::thread> consumers;
+
+        std::function<void(void*, DataTypes)> callback;
+        QualityScorer *scorer;
+
+        size_t budget;
+        std::atomic<size_t> in_memory;
+
+        std::FILE *spill_file;
+        off_t spill_end;
+
+        size_t current; // the queue the set being received goes to.
+
+        std::atomic<bool> aborted; // what is still queued is freed, not passed on.
+
+        void push(size_t queue, PipelineEvent ev);
+        void consume(SpscQueue<PipelineEvent> *queue);
+    public:
+        Pipeline(unsigned int count, size_t memory_budget, std::function<void(void*, DataTypes)> cb, QualityScorer *pool);
+        ~Pipeline();
+
+        /* All of these are called by the network thread only. */
+        void update(struct UpdateHeader2 *uh);
+        void begin_set(DataTypes type);
+        void media(Media *media, bool with_data);
+        void end_set(DataTypes type);
+
+        /* Tell every consumer there is nothing more, and wait for them to drain their queues. */
+        void finish();
+
+        /* For a request() that failed part of the way: the consumers stop calling back, free whatever is still */
+        /* queued (a set cut short included) and end. */
+        void abort();
+    };
+}
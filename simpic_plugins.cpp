@@ -0,0 +1,79 @@
+#include "simpic_plugins.hpp"
+
+#include <map>
+#include <mutex>
+
+#include <dlfcn.h>
+
+namespace SimpicClientLib
+{
+    PluginException::PluginException(std::string msg, std::string _library)
+    {
+        message = msg;
+        library = _library;
+    }
+
+    std::string &PluginException::what()
+    {
+        return message;
+    }
+
+    static std::mutex plugins_lock;
+    static std::map<std::string, void*> plugins; // nullptr for one that couldn't be loaded.
+
+    static void *open_plugin(const char *library, std::string &error)
+    {
+        void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+
+        if (handle != nullptr)
+            return handle;
+
+        error = dlerror();
+
+        /* Not installed system-wide: try the directory this library was loaded from. */
+        Dl_info info;
+
+        if (!dladdr((void*) &plugin_symbol, &info) || info.dli_fname == nullptr)
+            return nullptr;
+
+        std::string ours(info.dli_fname);
+        size_t slash = ours.rfind('/');
+
+        if (slash == std::string::npos)
+            return nullptr;
+
+        return dlopen((ours.substr(0, slash + 1) + library).c_str(), RTLD_NOW | RTLD_LOCAL);
+    }
+
+    void *plugin_symbol(const char *library, const char *symbol)
+    {
+        void *handle;
+
+        {
+            std::lock_guard<std::mutex> guard(plugins_lock);
+            auto found = plugins.find(library);
+
+            if (found == plugins.end())
+            {
+                std::string error;
+                handle = open_plugin(library, error);
+                plugins[library] = handle;
+
+                if (handle == nullptr)
+                    throw PluginException(error, library);
+            }
+            else
+                handle = found->second;
+        }
+
+        if (handle == nullptr)
+            throw PluginException(std::string(library) + " could not be loaded", library);
+
+        void *address = dlsym(handle, symbol);
+
+        if (address == nullptr)
+            throw PluginException(std::string(library) + " has no " + symbol, library);
+
+        return address;
+    }
+}
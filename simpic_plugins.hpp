@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+/* The self-hosted server (simpic_server, pHash, libtiff and the rest), only loaded when there is no -h. */
+#define SELFHOST_PLUGIN "libsimpicselfhost.so"
+
+/* libjpeg and libpng, only loaded when something is decoded (quality ranking). */
+#define DECODE_PLUGIN "libsimpicdecode.so"
+
+namespace SimpicClientLib
+{
+    class PluginException : std::exception
+    {
+    public:
+        std::string message;
+        std::string library;
+
+        PluginException(std::string msg, std::string _library);
+        std::string &what();
+    };
+
+    /* Look a symbol up in a plugin, dlopen()ing it the first time it is asked for; thread safe. */
+    /* The plugin is searched for the usual way (LD_LIBRARY_PATH, the cache, /usr/lib), then next to libsimpicclient.so. */
+    /* Throws PluginException if the plugin or the symbol can't be found; a plugin that failed once isn't tried again. */
+    void *plugin_symbol(const char *library, const char *symbol);
+}
@@ -3,6 +3,24 @@
 #include <cstdint>
 #include <openssl/sha.h>
 
+/* Opens every ClientHello. */
+#define PROTOCOL_MAGIC "SIMPIC"
+
+/* Where a MainHeader would have its set_no, a ServerHello has this. */
+#define PROTOCOL_HELLO_MARK 0x3256
+
+/* The newest version of the protocol that this client speaks. */
+#define PROTOCOL_VERSION 2
+
+/* The most of a stream's data that one StreamFrame carries; a longer one fails the connection. */
+#define STREAM_FRAME_SIZE 16384
+
+/* How much of a stream's data either side may have sent that the other hasn't given credit for (see StreamFrame). */
+#define STREAM_RECEIVE_WINDOW (256 * 1024)
+
+/* With the length of a StreamFrame, marks it as credit: it carries no data. */
+#define STREAM_FRAME_CREDIT (1U << 31)
+
 namespace SimpicClientLib
 {
     /* The header which is sent first and only once on each query. It describes how many manual checks that the user is going to have to make, among other things.*/
@@ -49,10 +67,16 @@ namespace SimpicClientLib
     /* In this set of similar media types to keep, what type are they and how many are there of them, so that the client can process all of this? */
     struct __attribute__((__packed__)) SetHeader
     {
-        uint8_t type; // that of a value in DataTypes.
+        uint8_t type; // that of a value in DataTypes, possibly with SetHeaderFlags.
         uint8_t count; 
     };
 
+    /* ORed into SetHeader.type. */
+    enum class SetHeaderFlags
+    {
+        Suppressed = (1 << 7) // with RequestExtensions::Ignore, only the set's grouping key follows; see ClientIgnoreRequest.
+    };
+
     /* This is every image. It describes the file extension, the filename, the width, height, and its length in bytes, all of which are very useful to the client. After this header, it will send the picture data in bytes, the length of which being described by length. */
     struct __attribute__((__packed__)) ImageHeader
     {
@@ -77,13 +101,83 @@ namespace SimpicClientLib
         // read/send size bytes for the whole file data. 
     };
 
+    /* The three headers below extend the protocol: the server only sends sets of DataTypes::Image, and has no headers */
+    /* for the other types. These are what this client reads for sets of the others, so that a server that */
+    /* sends them (a newer one, or a stand-in such as a capture to replay) can be followed past them; against the */
+    /* server as it is, no such set ever comes, and asking for those types finds nothing. */
+
+    /* Like ImageHeader, for every video of a set of DataTypes::Video; the same names, pleas, previews and data follow. */
+    struct __attribute__((__packed__)) VideoHeader
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+
+        uint16_t width;
+        uint16_t height;
+        uint32_t duration; // in milliseconds.
+
+        uint64_t size; // videos easily pass 4 GB.
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
+    /* The same, for every audio file of a set of DataTypes::Audio. */
+    struct __attribute__((__packed__)) AudioHeader
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+
+        uint32_t duration; // in milliseconds.
+        uint32_t sample_rate;
+        uint8_t channels;
+
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
+    /* The same, for every text file of a set of DataTypes::Text. */
+    struct __attribute__((__packed__)) TextHeader
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+
+        uint32_t lines;
+
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
     enum class ClientRequests
     {
         Exit, // Close the connection, no more requests. 
         Scan, // Scan a directory for similar images. 
         ScanRecursive, // Scan recursively in a directory for similar images. 
         Check, // Check if a file or a set of files would be duplicates in a directory.
-        CheckRecursive // Check recursively the same thing as above ^^^
+        CheckRecursive, // Check recursively the same thing as above ^^^
+        Fetch, // Fetch (a range of) a file's data by its SHA256 hash, after a scan has shown it.
+        List, // List the subdirectories of the path, to split a scan of it into smaller ones.
+        Remove, // Remove files by path, after the scan that showed them is over (see ClientRemoveRequest).
+        Hello // Negotiate the protocol version and capabilities, first thing on a connection (see ClientHello).
+    };
+
+    /* Bits OR'd into ClientRequest.types, above those of DataTypes, which announce extensions to the request. */
+    enum class ClientRequestFlags
+    {
+        Extended = (1 << 7) // a ClientRequestExtensions follows the null-terminated path.
+    };
+
+    enum class RequestExtensions
+    {
+        Previews = (1), // a ClientPreviewRequest follows.
+        Delta = (1 << 1), // a ClientDeltaRequest follows.
+        PerceptualHashes = (1 << 2), // a ClientHashesRequest follows.
+        Ignore = (1 << 3) // a ClientIgnoreRequest follows.
+    };
+
+    /* Sent after the path when ClientRequestFlags::Extended is set. */
+    struct __attribute__((__packed__)) ClientRequestExtensions
+    {
+        uint32_t flags; // bitwise field of RequestExtensions.
+        // then, for every flag set, in ascending order, the structure that extension describes.
     };
 
     struct __attribute__((__packed__)) ClientRequest
@@ -133,6 +227,243 @@ namespace SimpicClientLib
         // the type and number of subsequent headers that you may plea to receive data or not
     };
 
+    enum class PreviewTypes
+    {
+        None, // no preview; the server could not make one.
+        FirstBytes, // the first bytes of the file, up to the length asked for.
+        Thumbnail // the embedded (EXIF/JFIF) thumbnail or the first progressive scan of a JPEG.
+    };
+
+    /* With RequestExtensions::Previews, the client asks for a cheap preview of every file, besides (or instead of) its data. */
+    struct __attribute__((__packed__)) ClientPreviewRequest
+    {
+        uint8_t type; // an enum from PreviewTypes
+        uint32_t length; // the most bytes of preview the client wants per file.
+    };
+
+    /* With RequestExtensions::Previews, sent after every ClientPlea (unless skip_file) and before the file data. */
+    struct __attribute__((__packed__)) PreviewHeader
+    {
+        uint8_t type; // what the server could actually provide, from PreviewTypes.
+        uint32_t size; // then send size bytes of preview.
+    };
+
+    /* After a ClientRequest of ClientRequests::Fetch (with an empty path), name the file and the range of it wanted. */
+    struct __attribute__((__packed__)) ClientFetchRequest
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t offset;
+        uint64_t length; // clamped by the server to the end of the file.
+    };
+
+    struct __attribute__((__packed__)) ServerFetchResponse
+    {
+        uint8_t code; // that of a value in MainHeaderCodes; NoResults if the hash is unknown.
+        uint8_t _errno;
+        uint64_t length; // then send length bytes of file data.
+    };
+
+    /* With RequestExtensions::Delta, the client asks for only the sets whose membership changed since an earlier scan of the same path. */
+    struct __attribute__((__packed__)) ClientDeltaRequest
+    {
+        uint64_t generation; // the token from the ServerDeltaHeader of that scan; 0 for none.
+    };
+
+    /* With RequestExtensions::Delta, sent right after a successful MainHeader. */
+    struct __attribute__((__packed__)) ServerDeltaHeader
+    {
+        uint64_t generation; // the token to give back next time.
+        uint8_t delta; // if 0, the server couldn't honour the token and every set follows, as usual.
+        uint32_t removed; // then send removed SHA256 hashes of files no longer in any set.
+        // MainHeader.set_no then counts only the sets that changed.
+    };
+
+    /* With RequestExtensions::PerceptualHashes, the client asks for the perceptual hash of every image the scan looked at, */
+    /* so that the results of scans of different directories can be compared with each other. */
+    struct __attribute__((__packed__)) ClientHashesRequest
+    {
+        uint8_t singletons; // if 0, only the images that made it into a set; otherwise, every image scanned.
+    };
+
+    /* With RequestExtensions::PerceptualHashes, sent after the ClientAction of the last set (or right after a MainHeader */
+    /* of NoResults, since the images are still worth comparing elsewhere). */
+    struct __attribute__((__packed__)) ServerHashesHeader
+    {
+        uint32_t count; // then send count ServerHashEntry.
+    };
+
+    struct __attribute__((__packed__)) ServerHashEntry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t phash; // the 64-bit perceptual hash from the DCT of the image, as ClientCheckRequestTypes::ByPHash.
+        uint16_t filename_length;
+        uint16_t path_length;
+        // then the null-terminated filename and path, as after an ImageHeader.
+    };
+
+    /* With RequestExtensions::Ignore, the client names the sets it has already reviewed, so that they aren't sent again. */
+    /* A set's grouping key is the SHA256 over its members' SHA256 hashes, sorted (bytewise) and concatenated; the */
+    /* filter holds every reviewed key. For hash function i, a key sets bit (h1 + i * (h2 | 1)) % bits, where h1 and h2 */
+    /* are the first and second little-endian uint64 of the key; bit b is (1 << (b % 8)) of byte b / 8. */
+    /* A set whose key hits every one of its bits is sent as just its SetHeader, with SetHeaderFlags::Suppressed, and */
+    /* its key; the client answers with a ClientSuppressionReply. MainHeader.set_no counts suppressed sets too. */
+    struct __attribute__((__packed__)) ClientIgnoreRequest
+    {
+        uint8_t hashes; // how many hash functions.
+        uint32_t bits; // a multiple of 8; then send bits / 8 bytes of filter.
+    };
+
+    /* The answer to a suppressed set: the filter can be wrong, the client's own list can't. */
+    struct __attribute__((__packed__)) ClientSuppressionReply
+    {
+        uint8_t send; // if 0, the set was reviewed: nothing more of it is sent, and it is kept. Otherwise it follows as usual (without the SetHeader).
+    };
+
+    /* Protocol v2. A client that speaks it opens every connection with a ClientRequest of ClientRequests::Hello (with an */
+    /* empty path) and a ClientHello; a v2 server answers with a ServerHello, and from then on both speak the version and */
+    /* the capabilities that they have in common. A v1 server answers with anything else (or nothing, or a closed */
+    /* connection): the client then connects again and speaks v1, without a hello. */
+    /* Every structure of v2, the v1 ones it keeps included, is little-endian. */
+    enum class ProtocolCapabilities
+    {
+        WideHeaders = (1), // the *2 structures below take the place of their v1 namesakes, for counts and sizes past 8/16/32 bits.
+        Previews = (1 << 1), // RequestExtensions::Previews and ClientRequests::Fetch are understood.
+        Delta = (1 << 2), // RequestExtensions::Delta
+        PerceptualHashes = (1 << 3), // RequestExtensions::PerceptualHashes
+        Ignore = (1 << 4), // RequestExtensions::Ignore
+        List = (1 << 5), // ClientRequests::List
+        Remove = (1 << 6), // ClientRequests::Remove
+        Link = (1 << 7), // ClientActions::Link
+        Streams = (1 << 8) // everything after the ServerHello goes in StreamFrames; only offered when asked for.
+    };
+
+    struct __attribute__((__packed__)) ClientHello
+    {
+        char magic[6]; // PROTOCOL_MAGIC, without its NUL.
+        uint8_t version; // the highest the client speaks.
+        uint32_t capabilities; // bitwise field of ProtocolCapabilities the client can use.
+    };
+
+    /* Starts as a MainHeader would, so that it can't be mistaken for a v1 server's refusal of the hello. */
+    struct __attribute__((__packed__)) ServerHello
+    {
+        uint8_t code; // MainHeaderCodes::Success.
+        uint8_t _errno;
+        uint16_t mark; // PROTOCOL_HELLO_MARK.
+        uint8_t version; // the one the connection will speak: the lower of the two.
+        uint32_t capabilities; // those of the client's that the server has too.
+    };
+
+    /* With ProtocolCapabilities::WideHeaders, in place of MainHeader. */
+    struct __attribute__((__packed__)) MainHeader2
+    {
+        uint8_t code;
+        uint8_t _errno;
+        uint32_t set_no;
+    };
+
+    /* ...of UpdateHeader. */
+    struct __attribute__((__packed__)) UpdateHeader2
+    {
+        uint8_t done;
+        uint32_t images;
+        uint32_t audios;
+        uint32_t videos;
+        uint32_t texts;
+    };
+
+    /* ...of SetHeader; type may carry SetHeaderFlags as before. */
+    struct __attribute__((__packed__)) SetHeader2
+    {
+        uint8_t type;
+        uint32_t count;
+    };
+
+    /* ...of ImageHeader. */
+    struct __attribute__((__packed__)) ImageHeader2
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint32_t width;
+        uint32_t height;
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
+    /* ...of VideoHeader. AudioHeader and TextHeader are wide enough already, and stay. */
+    struct __attribute__((__packed__)) VideoHeader2
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint32_t width;
+        uint32_t height;
+        uint32_t duration;
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
+    /* ...of ClientAction: the indices (and the index to link to) that follow are uint32_t each. */
+    struct __attribute__((__packed__)) ClientAction2
+    {
+        uint8_t action;
+        uint32_t deletions; // UINT32_MAX on ClientActions::Keep.
+    };
+
+    /* ...of the uint16_t count of a check, and of ServerCheckResponse and ServerCheckIndividualGenericResponse. */
+    struct __attribute__((__packed__)) ServerCheckResponse2
+    {
+        uint32_t results; // UINT32_MAX if nothing was found.
+    };
+
+    struct __attribute__((__packed__)) ServerCheckIndividualGenericResponse2
+    {
+        uint32_t index;
+        struct SetHeader2 info;
+    };
+
+    /* With ProtocolCapabilities::Streams, everything after the ServerHello, both ways, is cut into these. A stream is */
+    /* as a connection of its own that has already said hello: it starts with a ClientRequest, and the server runs it */
+    /* as a session of its own, side by side with the others. The client numbers its streams from 1 and never uses a */
+    /* number twice. A frame of length 0 ends a stream, from the side that sends it, and stands in for its Exit: the */
+    /* connection itself has no Exit, and is just closed once the client has ended every stream. */
+    /* Each side may have at most STREAM_RECEIVE_WINDOW bytes of a stream out that the other hasn't given credit for; */
+    /* a side gives credit, as it reads a stream's data, with a frame of STREAM_FRAME_CREDIT | the bytes it read. */
+    /* Going past the window, or past STREAM_FRAME_SIZE in a frame, fails the connection. */
+    struct __attribute__((__packed__)) StreamFrame
+    {
+        uint32_t stream;
+        uint32_t length; // then send length bytes of that stream, unless it has STREAM_FRAME_CREDIT.
+    };
+
+    /* The reply to a ClientRequest of ClientRequests::List. */
+    struct __attribute__((__packed__)) ServerListResponse
+    {
+        uint8_t code; // that of a value in MainHeaderCodes.
+        uint8_t _errno;
+        uint32_t count;
+        uint32_t names_length; // then send count null-terminated names of subdirectories (without the path before them), names_length bytes in all.
+    };
+
+    /* After a ClientRequest of ClientRequests::Remove (with an empty path), how many files are to go. */
+    /* Each goes to the recycling bin, as with ClientActions::Delete. */
+    struct __attribute__((__packed__)) ClientRemoveRequest
+    {
+        uint16_t count; // then send count ClientRemoveEntry.
+    };
+
+    struct __attribute__((__packed__)) ClientRemoveEntry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH]; // the file is only removed if it still has this hash.
+        uint16_t path_length; // then send the null-terminated full path, as the scan reported it.
+    };
+
+    /* One per ClientRemoveEntry, in order. */
+    struct __attribute__((__packed__)) ServerRemoveResponse
+    {
+        uint8_t code; // that of a value in MainHeaderCodes: NoResults if the file is gone or has changed.
+        uint8_t _errno;
+    };
+
     /* A plea containing bitwise flags (abstracted through bitfields) of what the client does not want from the file or whether they want to skip the file entirely. */
     struct __attribute__((__packed__)) ClientPlea
     {
@@ -155,7 +486,8 @@ namespace SimpicClientLib
     enum class ClientActions
     {
         Keep, // Keep all files. If so, (deprecated: no hashes for deletion) indices will be sent.
-        Delete // Delete selected files by their (deprecated: SHA256 hash.) index 
+        Delete, // Delete selected files by their (deprecated: SHA256 hash.) index 
+        Link // Replace selected files with links to another file of the set, if they have its SHA256 hash.
     };
 
     struct __attribute__((__packed__)) ClientAction
@@ -164,5 +496,8 @@ namespace SimpicClientLib
         uint8_t deletions; // should be -1 on ClientActions::Keep
         // an array of indices will then be sent specifying which files should be deleted.
         // the indices should correspond to the order that the files were sent in, 0 indexed.
+        // on ClientActions::Link, the index of the file to link to comes first, then the deletions indices to replace.
+        // each is reflinked (FICLONE) where the filesystem can, and hard linked otherwise, under a temporary name
+        // that is then renamed over it; one that doesn't have the hash of the file to link to is left alone.
     };
 }
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include "simpic_quality.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+/* GCC vector extensions: four floats at a time, which become SSE on x86-64 and NEON on ARM. */
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+#define LANES 4
+
+namespace SimpicClientLib
+{
+    static inline v4f load4(const float *p)
+    {
+        v4f v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline void store4(float *p, v4f v)
+    {
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    static inline v4f abs4(v4f v)
+    {
+        return (v4f)((v4i) v & 0x7FFFFFFF);
+    }
+
+    static inline float sum4(v4f v)
+    {
+        float sum = 0;
+
+        for (int i = 0; i < LANES; i++)
+            sum += v[i];
+
+        return sum;
+    }
+
+    /* Variance of the 4-neighbour Laplacian: blur flattens it, sharp edges raise it. */
+    static double laplacian_variance(const GrayImage &img)
+    {
+        size_t w = img.width;
+        size_t h = img.height;
+
+        if (w < 3 || h < 3)
+            return 0;
+
+        double sum = 0;
+        double sumsq = 0;
+
+        for (size_t y = 1; y < h - 1; y++)
+        {
+            const float *up = img.pixels.data() + (y - 1) * w;
+            const float *mid = up + w;
+            const float *down = mid + w;
+
+            v4f s = {0};
+            v4f sq = {0};
+            size_t x = 1;
+
+            for (; x + LANES <= w - 1; x += LANES)
+            {
+                v4f l = 4 * load4(mid + x) - load4(up + x) - load4(down + x) - load4(mid + x - 1) - load4(mid + x + 1);
+                s += l;
+                sq += l * l;
+            }
+
+            double row_sum = sum4(s);
+            double row_sumsq = sum4(sq);
+
+            for (; x < w - 1; x++)
+            {
+                float l = 4 * mid[x] - up[x] - down[x] - mid[x - 1] - mid[x + 1];
+                row_sum += l;
+                row_sumsq += l * l;
+            }
+
+            sum += row_sum;
+            sumsq += row_sumsq;
+        }
+
+        double n = (double)(w - 2) * (h - 2);
+        double mean = sum / n;
+
+        return sumsq / n - mean * mean;
+    }
+
+    /* Immerkaer's fast noise estimate: the response to a mask that cancels out image structure, leaving noise. */
+    static double noise_sigma(const GrayImage &img)
+    {
+        size_t w = img.width;
+        size_t h = img.height;
+
+        if (w < 3 || h < 3)
+            return 0;
+
+        double total = 0;
+
+        for (size_t y = 1; y < h - 1; y++)
+        {
+            const float *up = img.pixels.data() + (y - 1) * w;
+            const float *mid = up + w;
+            const float *down = mid + w;
+
+            v4f acc = {0};
+            size_t x = 1;
+
+            for (; x + LANES <= w - 1; x += LANES)
+            {
+                v4f r = load4(up + x - 1) - 2 * load4(up + x) + load4(up + x + 1)
+                      - 2 * load4(mid + x - 1) + 4 * load4(mid + x) - 2 * load4(mid + x + 1)
+                      + load4(down + x - 1) - 2 * load4(down + x) + load4(down + x + 1);
+
+                acc += abs4(r);
+            }
+
+            double row = sum4(acc);
+
+            for (; x < w - 1; x++)
+            {
+                float r = up[x - 1] - 2 * up[x] + up[x + 1]
+                        - 2 * mid[x - 1] + 4 * mid[x] - 2 * mid[x + 1]
+                        + down[x - 1] - 2 * down[x] + down[x + 1];
+
+                row += std::fabs(r);
+            }
+
+            total += row;
+        }
+
+        return total * std::sqrt(M_PI / 2) / (6.0 * (w - 2) * (h - 2));
+    }
+
+    /* Mean gradient across 8x8 block boundaries over the mean gradient inside blocks; recompression pushes it above 1. */
+    static double blockiness(const GrayImage &img)
+    {
+        size_t w = img.width;
+        size_t h = img.height;
+
+        if (w < 16 || h < 16)
+            return 1.0;
+
+        std::vector<float> columns(w - 1, 0.0f);
+        std::vector<double> rows(h - 1, 0.0);
+
+        for (size_t y = 0; y < h; y++)
+        {
+            const float *cur = img.pixels.data() + y * w;
+            const float *down = cur + w;
+
+            /* Horizontal gradients, summed per column over every row. */
+            size_t x = 0;
+
+            for (; x + LANES <= w - 1; x += LANES)
+                store4(columns.data() + x, load4(columns.data() + x) + abs4(load4(cur + x + 1) - load4(cur + x)));
+
+            for (; x < w - 1; x++)
+                columns[x] += std::fabs(cur[x + 1] - cur[x]);
+
+            if (y == h - 1)
+                break;
+
+            /* Vertical gradients, summed per row. */
+            v4f acc = {0};
+            x = 0;
+
+            for (; x + LANES <= w; x += LANES)
+                acc += abs4(load4(down + x) - load4(cur + x));
+
+            double row = sum4(acc);
+
+            for (; x < w; x++)
+                row += std::fabs(down[x] - cur[x]);
+
+            rows[y] = row;
+        }
+
+        /* Both directions as mean gradient per pixel, so they can share one ratio. */
+        double boundary = 0, interior = 0;
+        size_t nboundary = 0, ninterior = 0;
+
+        for (size_t x = 0; x < columns.size(); x++)
+        {
+            if ((x & 7) == 7)
+            {
+                boundary += columns[x] / h;
+                nboundary++;
+            }
+            else
+            {
+                interior += columns[x] / h;
+                ninterior++;
+            }
+        }
+
+        for (size_t y = 0; y < rows.size(); y++)
+        {
+            if ((y & 7) == 7)
+            {
+                boundary += rows[y] / w;
+                nboundary++;
+            }
+            else
+            {
+                interior += rows[y] / w;
+                ninterior++;
+            }
+        }
+
+        if (!ninterior || interior <= 0)
+            return 1.0;
+
+        return (boundary / nboundary) / (interior / ninterior);
+    }
+
+    QualityScore score_grayscale(const GrayImage &img)
+    {
+        QualityScore result;
+        result.scored = true;
+        result.sharpness = laplacian_variance(img);
+        result.noise = noise_sigma(img);
+        result.blockiness = blockiness(img);
+
+        result.score = 10 * std::log10(1 + result.sharpness / (1 + result.noise * result.noise))
+                     - 10 * std::max(0.0, result.blockiness - 1)
+                     + 0.5 * std::log2((double) img.width * img.height);
+
+        return result;
+    }
+
+    QualityScorer::QualityScorer(unsigned int threads)
+    {
+        outstanding = 0;
+        stopping = false;
+
+        if (!threads)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (unsigned int i = 0; i < threads; i++)
+            workers.emplace_back(&QualityScorer::worker, this);
+    }
+
+    QualityScorer::~QualityScorer()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        work_ready.notify_all();
+
+        for (std::thread &t : workers)
+            t.join();
+    }
+
+    void QualityScorer::submit(Image *img)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(img);
+            outstanding++;
+        }
+
+        work_ready.notify_one();
+    }
+
+    void QualityScorer::wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        work_done.wait(guard, [this]() -> bool { return outstanding == 0; });
+    }
+
+    void QualityScorer::worker()
+    {
+        while (true)
+        {
+            Image *img;
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                work_ready.wait(guard, [this]() -> bool { return stopping || !jobs.empty(); });
+
+                if (jobs.empty())
+                    return;
+
+                img = jobs.front();
+                jobs.pop_front();
+            }
+
+            /* Decoding is the expensive part, and happens outside of the lock. */
+            GrayImage gray;
+            img->type = sniff_image_type(img->body.data(), img->body.size());
+
+            if (decode_grayscale(img->body.data(), img->body.size(), gray))
+                img->quality = score_grayscale(gray);
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+
+                if (--outstanding == 0)
+                    work_done.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "simpic_image.hpp"
+#include "simpic_decode.hpp"
+
+namespace SimpicClientLib
+{
+    /* Measure sharpness, blockiness and noise of a decoded image and fold them into one score. */
+    /* score = 10 log10(1 + sharpness / (1 + noise^2)) - 10 max(0, blockiness - 1) + 0.5 log2(width * height) */
+    QualityScore score_grayscale(const GrayImage &img);
+
+    /* A pool of threads, one per core by default, that decodes and scores the images of a set while the rest of it arrives. */
+    /* Give it to SimpicClient::set_scorer(); every image then has its Image::quality before the end of its set is signalled. */
+    class QualityScorer
+    {
+    private:
+        std::vector<std::thread> workers;
+        std::deque<Image*> jobs;
+
+        std::mutex lock;
+        std::condition_variable work_ready;
+        std::condition_variable work_done;
+
+        size_t outstanding;
+        bool stopping;
+
+        void worker();
+    public:
+        /* threads == 0 means one thread per core. */
+        QualityScorer(unsigned int threads);
+        ~QualityScorer();
+
+        /* Score an image in the background; it must have been buffered with Image::buffer(). */
+        void submit(Image *img);
+
+        /* Block until everything submitted has been scored. */
+        void wait();
+    };
+}
@@ -0,0 +1,77 @@
+#include "simpic_reclaim.hpp"
+
+#include <algorithm>
+
+#include <cstring>
+
+namespace SimpicClientLib
+{
+    ReclaimRanking::ReclaimRanking(size_t _capacity, std::string &_directory)
+    {
+        capacity = _capacity;
+        directory = _directory;
+        sets = 0;
+        reclaimable = 0;
+    }
+
+    bool ReclaimRanking::more_reclaimable(const RankedSet &a, const RankedSet &b)
+    {
+        if (a.reclaimable != b.reclaimable)
+            return a.reclaimable > b.reclaimable;
+
+        return a.order < b.order;
+    }
+
+    void ReclaimRanking::add(DataTypes type, std::vector<Media*> &set)
+    {
+        uint64_t total = 0;
+        uint64_t largest = 0;
+
+        for (Media *media : set)
+        {
+            total += media->length;
+            largest = std::max(largest, (uint64_t) media->length);
+        }
+
+        uint64_t order = sets++;
+        reclaimable += total - largest;
+
+        /* Full, and this one would be the first to go. */
+        if (capacity && heap.size() >= capacity && total - largest <= heap.front().reclaimable)
+            return;
+
+        RankedSet ranked;
+        ranked.type = type;
+        ranked.total = total;
+        ranked.reclaimable = total - largest;
+        ranked.order = order;
+
+        for (Media *media : set)
+        {
+            RankedFile file;
+            std::memcpy(file.target.sha256, media->sha256, SHA256_DIGEST_LENGTH);
+            file.target.path = (media->path.empty() ? directory : media->path) + "/" + media->filename;
+            file.size = media->length;
+            file.index = media->index;
+            ranked.files.push_back(file);
+        }
+
+        heap.push_back(std::move(ranked));
+        std::push_heap(heap.begin(), heap.end(), more_reclaimable);
+
+        if (capacity && heap.size() > capacity)
+        {
+            std::pop_heap(heap.begin(), heap.end(), more_reclaimable);
+            heap.pop_back();
+        }
+    }
+
+    std::vector<RankedSet> ReclaimRanking::ranked()
+    {
+        std::vector<RankedSet> out;
+        out.swap(heap);
+
+        std::sort(out.begin(), out.end(), more_reclaimable);
+        return out;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "simpic_client.hpp"
+
+namespace SimpicClientLib
+{
+    struct RankedFile
+    {
+        RemoveTarget target;
+        uint64_t size;
+        int index; // within its set, as the scan numbered it.
+    };
+
+    struct RankedSet
+    {
+        DataTypes type;
+        uint64_t total; // bytes of every file in it.
+        uint64_t reclaimable; // what removing all but the largest file would free.
+        uint64_t order; // its place in the scan.
+        std::vector<RankedFile> files;
+    };
+
+    /* Ranks the sets of a scan by the bytes reviewing each could free, as they come in: the top capacity are kept in a */
+    /* min-heap, so that a set that can't make it is passed over without its names ever being copied. */
+    class ReclaimRanking
+    {
+    private:
+        size_t capacity;
+        std::string directory;
+        std::vector<RankedSet> heap; // the least reclaimable at the front.
+
+        static bool more_reclaimable(const RankedSet &a, const RankedSet &b);
+
+    public:
+        uint64_t sets; // every set seen, ranked or not.
+        uint64_t reclaimable; // over every set seen.
+
+        /* capacity == 0 ranks every set. directory is what was scanned, for scans that send no paths. */
+        ReclaimRanking(size_t _capacity, std::string &_directory);
+
+        /* Add a set as a callback gets it from SimpicClient::request() (before the set is over). */
+        void add(DataTypes type, std::vector<Media*> &set);
+
+        /* The top sets, most reclaimable first; the ranking is left empty. */
+        std::vector<RankedSet> ranked();
+    };
+}
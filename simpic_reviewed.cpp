@@ -0,0 +1,189 @@
+#include "simpic_reviewed.hpp"
+#include "simpic_client.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+
+#include <cerrno>
+#include <cstring>
+
+#include <openssl/evp.h>
+
+namespace SimpicClientLib
+{
+    /* One save at a time in the process, so that none is lost between another's load and rename. */
+    static std::mutex saving;
+
+    ReviewedSets::ReviewedSets(const std::string &_location)
+    {
+        location = _location;
+        dirty = false;
+        ignored = 0;
+        false_positives = 0;
+    }
+
+    bool ReviewedSets::load()
+    {
+        keys.clear();
+        dirty = false;
+
+        std::ifstream in(location, std::ios::binary);
+
+        if (!in)
+            return false;
+
+        char magic[8];
+        uint32_t count = 0;
+
+        in.read(magic, sizeof(magic));
+        in.read((char*) &count, sizeof(count));
+
+        if (!in || std::memcmp(magic, REVIEWED_MAGIC, sizeof(magic)))
+            return false;
+
+        std::string key(SHA256_DIGEST_LENGTH, '\0');
+
+        for (uint32_t i = 0; i < count && in; i++)
+        {
+            in.read(key.data(), SHA256_DIGEST_LENGTH);
+            keys.insert(key);
+        }
+
+        /* A truncated list is as good as none. */
+        if (!in)
+        {
+            keys.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    void ReviewedSets::save()
+    {
+        if (!dirty)
+            return;
+
+        /* The sessions of a multiplexed client each have a list of their own, loaded when their request began: */
+        /* whatever the others saved since is merged in first, rather than written over. */
+        std::lock_guard<std::mutex> guard(saving);
+        ReviewedSets saved(location);
+
+        if (saved.load())
+            keys.insert(saved.keys.begin(), saved.keys.end());
+
+        /* Write it beside the old one and rename it over, as ScanState does. */
+        std::string temporary = location + ".";
+        int fd = make_temporary(temporary, ".tmp");
+
+        if (fd < 0)
+            throw ErrnoException(errno);
+
+        ::close(fd);
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+
+        if (!out)
+        {
+            int err = errno;
+            unlink(temporary.c_str());
+            throw ErrnoException(err);
+        }
+
+        uint32_t count = keys.size();
+        out.write(REVIEWED_MAGIC, 8);
+        out.write((char*) &count, sizeof(count));
+
+        for (const std::string &key : keys)
+            out.write(key.data(), SHA256_DIGEST_LENGTH);
+
+        out.close();
+
+        if (!out || rename(temporary.c_str(), location.c_str()) < 0)
+        {
+            int err = errno;
+            unlink(temporary.c_str());
+            throw ErrnoException(err);
+        }
+
+        dirty = false;
+    }
+
+    std::string ReviewedSets::key(std::vector<Media*> &set)
+    {
+        std::vector<std::string> hashes;
+
+        for (Media *media : set)
+            hashes.push_back(std::string(media->sha256, SHA256_DIGEST_LENGTH));
+
+        /* The server may send the same set in any order. */
+        std::sort(hashes.begin(), hashes.end(), [](const std::string &a, const std::string &b) -> bool {
+            return std::memcmp(a.data(), b.data(), SHA256_DIGEST_LENGTH) < 0;
+        });
+
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+
+        for (std::string &hash : hashes)
+            EVP_DigestUpdate(ctx, hash.data(), SHA256_DIGEST_LENGTH);
+
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        EVP_DigestFinal_ex(ctx, digest, nullptr);
+        EVP_MD_CTX_free(ctx);
+
+        return std::string((char*) digest, sizeof(digest));
+    }
+
+    bool ReviewedSets::contains(const std::string &key)
+    {
+        return keys.count(key) > 0;
+    }
+
+    void ReviewedSets::add(const std::string &key)
+    {
+        if (keys.insert(key).second)
+            dirty = true;
+    }
+
+    size_t ReviewedSets::size()
+    {
+        return keys.size();
+    }
+
+    void ReviewedSets::positions(const std::string &key, uint32_t bits, uint8_t hashes, std::vector<uint32_t> &out)
+    {
+        /* The key is already uniform, so two of its words make every hash function (Kirsch-Mitzenmacher). */
+        uint64_t h1;
+        uint64_t h2;
+        std::memcpy(&h1, key.data(), sizeof(h1));
+        std::memcpy(&h2, key.data() + sizeof(h1), sizeof(h2));
+        h2 |= 1;
+
+        out.clear();
+
+        for (uint8_t i = 0; i < hashes; i++)
+            out.push_back((h1 + i * h2) % bits);
+    }
+
+    void ReviewedSets::filter(struct ClientIgnoreRequest &req, std::vector<uint8_t> &bits)
+    {
+        uint64_t wanted = std::max<uint64_t>(64, (uint64_t) keys.size() * REVIEWED_BITS_PER_KEY);
+        wanted = std::min<uint64_t>((wanted + 7) & ~(uint64_t) 7, UINT32_MAX & ~(uint32_t) 7);
+
+        req.hashes = REVIEWED_HASHES;
+        req.bits = wanted;
+
+        bits.assign(req.bits / 8, 0);
+
+        std::vector<uint32_t> at;
+
+        for (const std::string &key : keys)
+        {
+            positions(key, req.bits, req.hashes, at);
+
+            for (uint32_t bit : at)
+                bits[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+}
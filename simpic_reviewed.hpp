@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include <cstdint>
+
+#include "simpic_protocol.hpp"
+#include "simpic_media.hpp"
+
+#define REVIEWED_MAGIC "SPREVW01"
+
+/* Bloom filter sizing: about 1% false positives, which the client then weeds out itself. */
+#define REVIEWED_BITS_PER_KEY 10
+#define REVIEWED_HASHES 7
+
+namespace SimpicClientLib
+{
+    /* Every set the user has looked at and kept whole, by its grouping key (see ClientIgnoreRequest), persisted in */
+    /* ~/.simpic/reviewed. A set that gains or loses a file gets a new key, and so is shown again. */
+    class ReviewedSets
+    {
+    private:
+        std::string location;
+        std::unordered_set<std::string> keys;
+        bool dirty;
+
+    public:
+        uint32_t ignored; // how many sets of the last scan were already reviewed, and so weren't presented.
+        uint32_t false_positives; // how many the server suppressed, that turned out not to have been.
+
+        ReviewedSets(const std::string &_location);
+
+        /* Returns false if there is no list yet (or it was unreadable), leaving it empty. */
+        bool load();
+
+        /* Only writes if anything was added since load(). */
+        void save();
+
+        /* The grouping key of a set: SHA256 over its members' hashes, sorted. */
+        static std::string key(std::vector<Media*> &set);
+
+        bool contains(const std::string &key);
+        void add(const std::string &key);
+        size_t size();
+
+        /* The whole list as a Bloom filter, laid out as ClientIgnoreRequest describes. */
+        void filter(struct ClientIgnoreRequest &req, std::vector<uint8_t> &bits);
+
+        /* Where key falls in a filter of bits bits, for each of hashes hash functions. */
+        static void positions(const std::string &key, uint32_t bits, uint8_t hashes, std::vector<uint32_t> &out);
+    };
+}
@@ -0,0 +1,261 @@
+#include "simpic_scan_state.hpp"
+#include "simpic_client.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+#include <openssl/evp.h>
+
+namespace SimpicClientLib
+{
+    static void write_string(std::ofstream &out, const std::string &str)
+    {
+        uint16_t len = str.size();
+        out.write((char*) &len, sizeof(len));
+        out.write(str.data(), len);
+    }
+
+    static std::string read_string(std::ifstream &in)
+    {
+        uint16_t len = 0;
+        in.read((char*) &len, sizeof(len));
+
+        std::string str(len, '\0');
+        in.read(str.data(), len);
+        return str;
+    }
+
+    ScanState::ScanState(std::string &folder, std::string &host, uint16_t port, std::string &path, bool recursive, uint8_t max_ham, uint8_t types)
+    {
+        generation = 0;
+        unchanged = 0;
+
+        /* Name the file after a hash of the scan's parameters, which may contain anything (slashes included). */
+        std::string key = host + ":" + std::to_string(port) + ":" + path + ":" + std::to_string(recursive) + ":" + std::to_string(max_ham) + ":" + std::to_string(types);
+
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        EVP_Digest(key.data(), key.size(), digest, nullptr, EVP_sha256(), nullptr);
+
+        location = folder + sha256digest2string((char*) digest) + ".state";
+    }
+
+    bool ScanState::load()
+    {
+        sets.clear();
+        previous.clear();
+        previous_members.clear();
+        generation = 0;
+
+        std::ifstream in(location, std::ios::binary);
+
+        if (!in)
+            return false;
+
+        char magic[8];
+        in.read(magic, sizeof(magic));
+
+        if (!in || std::memcmp(magic, SCAN_STATE_MAGIC, sizeof(magic)))
+            return false;
+
+        uint32_t count = 0;
+        in.read((char*) &generation, sizeof(generation));
+        in.read((char*) &count, sizeof(count));
+
+        for (uint32_t i = 0; i < count && in; i++)
+        {
+            ScanSet set;
+            uint8_t type = 0;
+            uint32_t members = 0;
+
+            in.read((char*) &type, sizeof(type));
+            in.read((char*) &members, sizeof(members));
+            set.type = (DataTypes) type;
+
+            for (uint32_t j = 0; j < members && in; j++)
+            {
+                ScanMember member;
+                in.read(member.sha256, sizeof(member.sha256));
+                in.read((char*) &member.size, sizeof(member.size));
+                in.read((char*) &member.width, sizeof(member.width));
+                in.read((char*) &member.height, sizeof(member.height));
+                member.filename = read_string(in);
+                member.path = read_string(in);
+
+                set.members.push_back(member);
+            }
+
+            sets.push_back(set);
+        }
+
+        /* A truncated file is as good as none. */
+        if (!in)
+        {
+            sets.clear();
+            generation = 0;
+            return false;
+        }
+
+        for (ScanSet &set : sets)
+        {
+            previous.insert(fingerprint(set));
+
+            for (ScanMember &member : set.members)
+                previous_members.insert(member_key(member));
+        }
+
+        return true;
+    }
+
+    void ScanState::save()
+    {
+        /* Write it beside the old one and rename it over, so a crash never leaves half a state behind; under a name */
+        /* of its own, since the sessions of a multiplexed client may scan the same path at once. */
+        std::string temporary = location + ".";
+        int fd = make_temporary(temporary, ".tmp");
+
+        if (fd < 0)
+            throw ErrnoException(errno);
+
+        ::close(fd);
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+
+        if (!out)
+        {
+            int err = errno;
+            unlink(temporary.c_str());
+            throw ErrnoException(err);
+        }
+
+        uint32_t count = sets.size();
+        out.write(SCAN_STATE_MAGIC, 8);
+        out.write((char*) &generation, sizeof(generation));
+        out.write((char*) &count, sizeof(count));
+
+        for (ScanSet &set : sets)
+        {
+            uint8_t type = (uint8_t) set.type;
+            uint32_t members = set.members.size();
+
+            out.write((char*) &type, sizeof(type));
+            out.write((char*) &members, sizeof(members));
+
+            for (ScanMember &member : set.members)
+            {
+                out.write(member.sha256, sizeof(member.sha256));
+                out.write((char*) &member.size, sizeof(member.size));
+                out.write((char*) &member.width, sizeof(member.width));
+                out.write((char*) &member.height, sizeof(member.height));
+                write_string(out, member.filename);
+                write_string(out, member.path);
+            }
+        }
+
+        out.close();
+
+        if (!out || rename(temporary.c_str(), location.c_str()) < 0)
+        {
+            int err = errno;
+            unlink(temporary.c_str());
+            throw ErrnoException(err);
+        }
+    }
+
+    ScanSet ScanState::describe(DataTypes type, std::vector<Media*> &media)
+    {
+        ScanSet set;
+        set.type = type;
+
+        for (Media *m : media)
+            set.members.push_back(describe(type, m));
+
+        return set;
+    }
+
+    ScanMember ScanState::describe(DataTypes type, Media *m)
+    {
+        ScanMember member;
+        std::memcpy(member.sha256, m->sha256, sizeof(member.sha256));
+        member.size = m->length;
+        member.width = 0;
+        member.height = 0;
+        member.filename = m->filename;
+        member.path = m->path;
+
+        if (type == DataTypes::Image)
+        {
+            member.width = ((Image*) m)->width;
+            member.height = ((Image*) m)->height;
+        }
+        else if (type == DataTypes::Video)
+        {
+            member.width = ((Video*) m)->width;
+            member.height = ((Video*) m)->height;
+        }
+
+        return member;
+    }
+
+    std::string ScanState::member_key(const ScanMember &member)
+    {
+        return std::string(member.sha256, sizeof(member.sha256)) + member.path + "/" + member.filename;
+    }
+
+    std::string ScanState::fingerprint(const ScanSet &set)
+    {
+        std::vector<std::string> keys;
+
+        for (const ScanMember &member : set.members)
+            keys.push_back(member_key(member));
+
+        /* The server may send the same set in any order. */
+        std::sort(keys.begin(), keys.end());
+
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+
+        for (std::string &key : keys)
+            EVP_DigestUpdate(ctx, key.c_str(), key.size() + 1);
+
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        EVP_DigestFinal_ex(ctx, digest, nullptr);
+        EVP_MD_CTX_free(ctx);
+
+        return std::string((char*) digest, sizeof(digest));
+    }
+
+    bool ScanState::known(const ScanSet &set)
+    {
+        return previous.count(fingerprint(set)) > 0;
+    }
+
+    bool ScanState::seen(const ScanMember &member)
+    {
+        return previous_members.count(member_key(member)) > 0;
+    }
+
+    void ScanState::merge(std::vector<std::string> &removed, std::vector<ScanSet> &changed)
+    {
+        std::unordered_set<std::string> gone(removed.begin(), removed.end());
+
+        for (ScanSet &set : changed)
+        {
+            for (ScanMember &member : set.members)
+                gone.insert(std::string(member.sha256, sizeof(member.sha256)));
+        }
+
+        std::vector<ScanSet> merged;
+
+        for (ScanSet &set : sets)
+        {
+            bool touched = std::any_of(set.members.begin(), set.members.end(), [&gone](ScanMember &member) -> bool {
+                return gone.count(std::string(member.sha256, sizeof(member.sha256))) > 0;
+            });
+
+            if (!touched)
+                merged.push_back(set);
+        }
+
+        merged.insert(merged.end(), changed.begin(), changed.end());
+        sets.swap(merged);
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include <cstdint>
+
+#include "simpic_protocol.hpp"
+#include "simpic_media.hpp"
+#include "simpic_image.hpp"
+#include "utils.hpp"
+
+#define SCAN_STATE_MAGIC "SPSCAN02"
+
+namespace SimpicClientLib
+{
+    struct ScanMember
+    {
+        char sha256[SHA256_DIGEST_LENGTH];
+        uint64_t size;
+        uint32_t width; // images and videos only.
+        uint32_t height;
+
+        std::string filename;
+        std::string path;
+    };
+
+    struct ScanSet
+    {
+        DataTypes type;
+        std::vector<ScanMember> members;
+    };
+
+    /* The result of the last scan of one path on one server, persisted in ~/.simpic/scans/ along with its generation token, */
+    /* so the next scan of it only has to present the sets whose membership changed. */
+    class ScanState
+    {
+    private:
+        std::string location;
+
+        /* Fingerprints of the sets as they were loaded, before this scan, and the keys of all their members. */
+        std::unordered_set<std::string> previous;
+        std::unordered_set<std::string> previous_members;
+
+        static std::string member_key(const ScanMember &member);
+
+    public:
+        uint64_t generation; // issued by the server (or counted locally, if it doesn't do deltas).
+        std::vector<ScanSet> sets;
+
+        uint32_t unchanged; // how many sets of the last scan were already known, and so weren't presented.
+
+        /* The state for a scan, named after everything that makes one scan different from another. */
+        ScanState(std::string &folder, std::string &host, uint16_t port, std::string &path, bool recursive, uint8_t max_ham, uint8_t types);
+
+        /* Returns false if there is no earlier scan (or it was unreadable), leaving the state empty with generation 0. */
+        bool load();
+        void save();
+
+        /* Describe a set that was just received, or one of its members. */
+        static ScanSet describe(DataTypes type, std::vector<Media*> &media);
+        static ScanMember describe(DataTypes type, Media *media);
+
+        /* SHA256 over the sorted hashes and paths of a set's members: equal exactly when the membership is. */
+        static std::string fingerprint(const ScanSet &set);
+
+        /* Whether the set was already there (unchanged) last time. */
+        bool known(const ScanSet &set);
+
+        /* Whether the file was in some set last time, where it is now. If not, no set it is in now can be known(). */
+        bool seen(const ScanMember &member);
+
+        /* Apply a server's delta: drop every stored set that lost a member or had one move to a changed set, then add the changed sets. */
+        void merge(std::vector<std::string> &removed, std::vector<ScanSet> &changed);
+    };
+}
@@ -0,0 +1,275 @@
+#include "simpic_scheduler.hpp"
+
+#include <thread>
+
+namespace SimpicClientLib
+{
+    bool ScanScheduler::ByPriority::operator()(const ScanJob *a, const ScanJob *b) const
+    {
+        if (a->priority != b->priority)
+            return a->priority < b->priority;
+
+        return a->order > b->order;
+    }
+
+    bool ScanScheduler::ByTime::operator()(const ScanJob *a, const ScanJob *b) const
+    {
+        return a->not_before > b->not_before;
+    }
+
+    ScanScheduler::ScanScheduler(unsigned int per_server, std::function<void(SimpicClient&)> setup)
+    {
+        this->per_server = std::max(per_server, 1u);
+        this->setup = setup;
+        running = 0;
+    }
+
+    ScanScheduler::~ScanScheduler()
+    {
+        for (ScanJob *job : jobs)
+            delete job;
+    }
+
+    void ScanScheduler::add(std::string &host, uint16_t port, std::string &path, bool recursive, uint8_t max_ham, uint8_t types, int priority)
+    {
+        ScanJob *job = new ScanJob;
+        job->host = host;
+        job->port = port;
+        job->path = path;
+        job->recursive = recursive;
+        job->max_ham = max_ham;
+        job->types = types;
+        job->priority = priority;
+        job->order = jobs.size();
+        job->attempts = 0;
+        job->not_before = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(job);
+        ready.push(job);
+        servers[{host, port}];
+    }
+
+    ScanJob *ScanScheduler::next_job()
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        /* Whatever has waited out its backoff is back in the running. */
+        while (!waiting.empty() && waiting.top()->not_before <= now)
+        {
+            ready.push(waiting.top());
+            waiting.pop();
+        }
+
+        std::vector<ScanJob*> skipped;
+        ScanJob *found = nullptr;
+
+        /* Jobs whose server is at its limit are passed over, not waited on. */
+        while (!ready.empty())
+        {
+            ScanJob *job = ready.top();
+            ready.pop();
+
+            if (servers[{job->host, job->port}].busy < per_server)
+            {
+                found = job;
+                break;
+            }
+
+            skipped.push_back(job);
+        }
+
+        for (ScanJob *job : skipped)
+            ready.push(job);
+
+        return found;
+    }
+
+    void ScanScheduler::worker(std::function<void(ScanJob&, SimpicClient&, void*, DataTypes)> &callback,
+                        std::function<void(ScanJob&, JobOutcomes)> &done, std::function<void(ScanJob&)> &started)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true)
+        {
+            ScanJob *job = next_job();
+
+            if (job == nullptr)
+            {
+                /* Nothing left, and nothing out there that could come back. */
+                if (ready.empty() && waiting.empty() && !running)
+                {
+                    changed.notify_all();
+                    return;
+                }
+
+                if (!waiting.empty())
+                    changed.wait_until(guard, waiting.top()->not_before);
+                else
+                    changed.wait(guard);
+
+                continue;
+            }
+
+            Server &server = servers[{job->host, job->port}];
+            server.busy++;
+            running++;
+
+            SimpicClient *client = nullptr;
+
+            if (!server.idle.empty())
+            {
+                client = server.idle.back();
+                server.idle.pop_back();
+            }
+
+            guard.unlock();
+
+            JobOutcomes outcome = JobOutcomes::Done;
+            bool retry = false;
+            bool healthy = true;
+
+            try
+            {
+                if (client == nullptr)
+                {
+                    client = new SimpicClient(job->host, job->port);
+                    setup(*client);
+                    client->make_connection();
+                }
+
+                if (started)
+                    started(*job);
+
+                client->request(job->path, job->recursive, job->max_ham, job->types, [&callback, job, client](void *data, DataTypes type) -> void {
+                    callback(*job, *client, data, type);
+                });
+
+                job->hashes.swap(client->perceptual_hashes());
+            }
+            catch (NoResultsException &ex)
+            {
+                outcome = JobOutcomes::NoResults;
+                job->hashes.swap(client->perceptual_hashes());
+            }
+            catch (InUseException &ex)
+            {
+                job->error = ex.what();
+                retry = true;
+            }
+            catch (ErrnoException &ex)
+            {
+                job->error = ex.what();
+                outcome = JobOutcomes::Failed;
+            }
+            catch (simpic_networking_exception &ex)
+            {
+                /* The connection can't be trusted to be anywhere sensible in the stream anymore. */
+                job->error = ex.what();
+                retry = true;
+                healthy = false;
+            }
+            catch (std::runtime_error &ex)
+            {
+                /* The server's name didn't resolve. */
+                job->error = ex.what();
+                retry = true;
+                healthy = false;
+            }
+            catch (LimitsException &ex)
+            {
+                /* Another try would ask the same of the server; the connection is left waiting on an answer. */
+                job->error = ex.what();
+                outcome = JobOutcomes::Failed;
+                healthy = false;
+            }
+            catch (...)
+            {
+                /* A plugin, or the callback itself: whatever it was, the connection was left in the middle of the scan. */
+                job->error = "The scan stopped on an unexpected error.";
+                outcome = JobOutcomes::Failed;
+                healthy = false;
+            }
+
+            if (!healthy && client != nullptr)
+            {
+                if (client->fd >= 0)
+                    ::close(client->fd);
+
+                delete client;
+                client = nullptr;
+            }
+
+            guard.lock();
+            server.busy--;
+            running--;
+
+            if (client != nullptr)
+                server.idle.push_back(client);
+
+            if (retry)
+            {
+                job->attempts++;
+
+                if (job->attempts >= SCHEDULER_MAX_ATTEMPTS)
+                {
+                    outcome = JobOutcomes::GaveUp;
+                    retry = false;
+                }
+                else
+                {
+                    long backoff = std::min((long) SCHEDULER_MAX_BACKOFF_MS, (long) SCHEDULER_BACKOFF_MS << (job->attempts - 1));
+                    job->not_before = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoff);
+                    waiting.push(job);
+                }
+            }
+
+            changed.notify_all();
+
+            if (!retry)
+            {
+                guard.unlock();
+                done(*job, outcome);
+                guard.lock();
+            }
+        }
+    }
+
+    void ScanScheduler::run(std::function<void(ScanJob&, SimpicClient&, void*, DataTypes)> callback,
+                        std::function<void(ScanJob&, JobOutcomes)> done, std::function<void(ScanJob&)> started)
+    {
+        std::vector<std::thread> workers;
+        size_t count;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            count = servers.size() * per_server;
+        }
+
+        for (size_t i = 0; i < count; i++)
+            workers.emplace_back(&ScanScheduler::worker, this, std::ref(callback), std::ref(done), std::ref(started));
+
+        for (std::thread &t : workers)
+            t.join();
+
+        /* One Exit per connection, however many scans it carried. */
+        for (auto &entry : servers)
+        {
+            for (SimpicClient *client : entry.second.idle)
+            {
+                try
+                {
+                    client->close();
+                }
+                catch (simpic_networking_exception &ex)
+                {
+
+                }
+
+                delete client;
+            }
+
+            entry.second.idle.clear();
+        }
+    }
+}
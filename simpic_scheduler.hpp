@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+#include "simpic_client.hpp"
+
+/* A directory the server is busy with is retried after this long, doubling every time... */
+#define SCHEDULER_BACKOFF_MS 2000
+
+/* ...up to this long between tries... */
+#define SCHEDULER_MAX_BACKOFF_MS 300000
+
+/* ...and given up on after this many tries (dropped connections count too). */
+#define SCHEDULER_MAX_ATTEMPTS 8
+
+namespace SimpicClientLib
+{
+    enum class JobOutcomes
+    {
+        Done, // the scan went through, and every set went to the callback.
+        NoResults, // the scan went through, and found nothing.
+        Failed, // the server failed the scan (see ScanJob::error).
+        GaveUp // the directory stayed busy, or the server unreachable, for SCHEDULER_MAX_ATTEMPTS tries.
+    };
+
+    struct ScanJob
+    {
+        std::string host;
+        uint16_t port;
+
+        std::string path;
+        bool recursive;
+        uint8_t max_ham;
+        uint8_t types;
+
+        int priority; // higher goes first; among equals, the one added first.
+        uint64_t order;
+
+        int attempts;
+        std::chrono::steady_clock::time_point not_before;
+        std::string error; // what went wrong last, if anything did.
+
+        std::vector<HashedImage> hashes; // what the scan hashed, if setup() asked for set_perceptual_hashes().
+    };
+
+    /* Runs a queue of scans across any number of servers: at most per_server at a time on each, every one of them */
+    /* on a connection kept open from scan to scan. A directory the server is already scanning goes back in the queue */
+    /* with exponential backoff instead of failing. */
+    class ScanScheduler
+    {
+    private:
+        struct Server
+        {
+            unsigned int busy;
+            std::vector<SimpicClient*> idle;
+        };
+
+        struct ByPriority
+        {
+            bool operator()(const ScanJob *a, const ScanJob *b) const;
+        };
+
+        struct ByTime
+        {
+            bool operator()(const ScanJob *a, const ScanJob *b) const;
+        };
+
+        unsigned int per_server;
+        std::function<void(SimpicClient&)> setup;
+
+        std::mutex lock;
+        std::condition_variable changed;
+
+        std::vector<ScanJob*> jobs;
+        std::priority_queue<ScanJob*, std::vector<ScanJob*>, ByPriority> ready;
+        std::priority_queue<ScanJob*, std::vector<ScanJob*>, ByTime> waiting;
+        std::map<std::pair<std::string, uint16_t>, Server> servers;
+        unsigned int running;
+
+        /* The highest priority job that is due and whose server has room, or nullptr. Called locked. */
+        ScanJob *next_job();
+
+        void worker(std::function<void(ScanJob&, SimpicClient&, void*, DataTypes)> &callback,
+                        std::function<void(ScanJob&, JobOutcomes)> &done, std::function<void(ScanJob&)> &started);
+
+    public:
+        /* setup is called on every new connection before it connects (set_no_data(), set_transport() and so on). */
+        ScanScheduler(unsigned int per_server, std::function<void(SimpicClient&)> setup);
+        ~ScanScheduler();
+
+        void add(std::string &host, uint16_t port, std::string &path, bool recursive, uint8_t max_ham, uint8_t types, int priority);
+
+        /* Run every job, blocking until each one is finished. */
+        /* The callback is what request() takes, plus the job and the connection it runs on (to keep() or remove() with); */
+        /* it is called from several threads at once. done is called once per job, with how it ended. started, if given, */
+        /* is called before every try of a job, on the thread its callbacks will run on: a try that failed part of the */
+        /* way through a set leaves that set unfinished, and the next one starts over from the first set. */
+        /* Every connection is closed at the end. */
+        void run(std::function<void(ScanJob&, SimpicClient&, void*, DataTypes)> callback,
+                        std::function<void(ScanJob&, JobOutcomes)> done, std::function<void(ScanJob&)> started = nullptr);
+    };
+}
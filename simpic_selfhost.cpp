@@ -0,0 +1,24 @@
+#include <string>
+#include <cstdint>
+
+#include <simpic_server/simpic_server.hpp>
+
+/* Built into SELFHOST_PLUGIN, so that only a client that hosts its own server pulls in libsimpicserver and its */
+/* dependencies. Serves forever on port; returns -1 if a Simpic server is already running on this machine. */
+extern "C" int simpic_selfhost_start(uint16_t port, const char *folder, const char *recycling_bin)
+{
+    std::string ourfolder(folder);
+    std::string bin(recycling_bin);
+
+    try
+    {
+        SimpicServerLib::SimpicServer srv(port, ourfolder, bin);
+        srv.start();
+    }
+    catch (SimpicServerLib::SimpicMultipleInstanceException &ex)
+    {
+        return -1;
+    }
+
+    return 0;
+}
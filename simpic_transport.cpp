@@ -0,0 +1,666 @@
+#include "simpic_transport.hpp"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* What a completion was for, in the top byte of its user_data. */
+#define URING_TAG_RECV 1ULL
+#define URING_TAG_SEND 2ULL
+#define URING_TAG_WRITE 3ULL
+#define URING_TAG_CANCEL 4ULL // nothing to do: what it cancelled completes on its own.
+
+namespace SimpicClientLib
+{
+    OutboundMessage &OutboundMessage::add(const void *data, size_t length)
+    {
+        buffer.insert(buffer.end(), (const char*) data, (const char*) data + length);
+        return *this;
+    }
+
+    OutboundMessage &OutboundMessage::add(const std::string &str)
+    {
+        return add(str.c_str(), str.size() + 1);
+    }
+
+    Transport::Transport(int _fd, TransportKinds _kind)
+    {
+        fd = _fd;
+        kind = _kind;
+    }
+
+    Transport::~Transport()
+    {
+
+    }
+
+    void Transport::flush()
+    {
+
+    }
+
+    void Transport::send(OutboundMessage &message)
+    {
+        sendall(message.buffer.data(), message.buffer.size());
+    }
+
+    /* io_uring gathers its sends on its own. */
+    void Transport::cork(bool)
+    {
+
+    }
+
+    void Transport::recvall(void *buffer, size_t length)
+    {
+        char *at = (char*) buffer;
+
+        while (length)
+        {
+            ssize_t n = receive(at, length);
+
+            if (n <= 0)
+            {
+                uint8_t err = n == 0 ? ECONNRESET : errno;
+                throw simpic_networking_exception("Error recvall(): " + std::string(std::strerror(err)), err);
+            }
+
+            at += n;
+            length -= n;
+        }
+    }
+
+    void Transport::receive_to(int out, off_t offset, uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        std::vector<char> chunk(std::min(length, (uint64_t) TRANSPORT_CHUNK_SIZE));
+
+        while (length)
+        {
+            size_t amnt = std::min(length, (uint64_t) chunk.size());
+            recvall(chunk.data(), amnt);
+            observe(chunk.data(), amnt);
+
+            if (pwrite(out, chunk.data(), amnt, offset) != (ssize_t) amnt)
+            {
+                uint8_t err = errno;
+                throw simpic_networking_exception("Error writing received data: " + std::string(std::strerror(err)), err);
+            }
+
+            offset += amnt;
+            length -= amnt;
+        }
+    }
+
+    void Transport::discard(uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        std::vector<char> chunk(std::min(length, (uint64_t) TRANSPORT_CHUNK_SIZE));
+
+        while (length)
+        {
+            size_t amnt = std::min(length, (uint64_t) chunk.size());
+            recvall(chunk.data(), amnt);
+            observe(chunk.data(), amnt);
+
+            length -= amnt;
+        }
+    }
+
+    SocketTransport::SocketTransport(int _fd) : Transport(_fd, TransportKinds::Socket)
+    {
+
+    }
+
+    ssize_t SocketTransport::receive(void *buffer, size_t length)
+    {
+        ssize_t n;
+
+        do
+        {
+            n = recv(fd, buffer, length, 0);
+        } while (n < 0 && errno == EINTR);
+
+        return n;
+    }
+
+    void SocketTransport::sendall(void *buffer, size_t length)
+    {
+        char *at = (char*) buffer;
+
+        while (length)
+        {
+            ssize_t n = ::send(fd, at, length, MSG_NOSIGNAL);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n < 0)
+            {
+                uint8_t err = errno;
+                throw simpic_networking_exception("Error sendall(): " + std::string(std::strerror(err)), err);
+            }
+
+            at += n;
+            length -= n;
+        }
+    }
+
+    void SocketTransport::cork(bool on)
+    {
+        int value = on;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    }
+
+    UringTransport::UringTransport(int _fd) : Transport(_fd, TransportKinds::Uring)
+    {
+        sq_ptr = MAP_FAILED;
+        cq_ptr = MAP_FAILED;
+        sqes = (struct io_uring_sqe*) MAP_FAILED;
+        buf_ring = (struct io_uring_buf*) MAP_FAILED;
+        buffers = nullptr;
+
+        to_submit = 0;
+        buf_tail = 0;
+        available = 0;
+        armed = false;
+        eof = false;
+        error = 0;
+        sent = 0;
+        send_in_flight = false;
+        writes_in_flight = 0;
+        write_error = 0;
+
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 2;
+
+        ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+        if (ring_fd < 0)
+        {
+            uint8_t err = errno;
+            throw simpic_networking_exception("Error io_uring_setup(): " + std::string(std::strerror(err)), err);
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        /* Newer kernels map both rings at once. */
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else if (sq_ptr != MAP_FAILED)
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        if (cq_ptr != MAP_FAILED)
+            sqes = (struct io_uring_sqe*) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+        if (sqes == MAP_FAILED)
+        {
+            uint8_t err = errno;
+            teardown();
+            throw simpic_networking_exception("Error mapping the io_uring: " + std::string(std::strerror(err)), err);
+        }
+
+        char *sq = (char*) sq_ptr;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+
+        char *cq = (char*) cq_ptr;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        /* The buffer ring has to be page aligned, which mmap() gives. */
+        buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+        buf_ring = (struct io_uring_buf*) mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buf_ring == MAP_FAILED)
+        {
+            uint8_t err = errno;
+            teardown();
+            throw simpic_networking_exception("Error mapping the buffer ring: " + std::string(std::strerror(err)), err);
+        }
+
+        struct io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) buf_ring;
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = 0;
+
+        /* Provided buffer rings need Linux 5.19. */
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            uint8_t err = errno;
+            teardown();
+            throw simpic_networking_exception("Error registering the buffer ring: " + std::string(std::strerror(err)), err);
+        }
+
+        buffers = new char[(size_t) URING_BUFFERS * URING_BUFFER_SIZE];
+        holds.assign(URING_BUFFERS, 0);
+
+        for (uint16_t bid = 0; bid < URING_BUFFERS; bid++)
+            recycle(bid);
+    }
+
+    UringTransport::~UringTransport()
+    {
+        teardown();
+    }
+
+    void UringTransport::quiesce()
+    {
+        /* Nothing is armed or sent again from here on. */
+        if (!error)
+            error = ECANCELED;
+
+        try
+        {
+            if (armed)
+            {
+                struct io_uring_sqe *sqe = get_sqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = URING_TAG_RECV << 56;
+                sqe->user_data = URING_TAG_CANCEL << 56;
+            }
+
+            if (send_in_flight)
+            {
+                struct io_uring_sqe *sqe = get_sqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = URING_TAG_SEND << 56;
+                sqe->user_data = URING_TAG_CANCEL << 56;
+            }
+
+            /* The writes go to a file, and end soon enough on their own. */
+            while (armed || send_in_flight || writes_in_flight)
+            {
+                enter(1);
+                reap();
+            }
+        }
+        catch (simpic_networking_exception &ex)
+        {
+            /* The ring itself is failing; closing it is all that is left to do. */
+        }
+    }
+
+    void UringTransport::teardown()
+    {
+        /* The ring goes away in the background once closed, and with it whatever is in flight, which may still be */
+        /* using the buffers or the sends meanwhile: wait for all of it first. Before the buffers, nothing was submitted. */
+        if (buffers != nullptr)
+            quiesce();
+
+        if (ring_fd >= 0)
+            ::close(ring_fd);
+
+        ring_fd = -1;
+
+        if (buf_ring != MAP_FAILED)
+            munmap(buf_ring, buf_ring_size);
+
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+
+        buf_ring = (struct io_uring_buf*) MAP_FAILED;
+        sqes = (struct io_uring_sqe*) MAP_FAILED;
+        cq_ptr = sq_ptr = MAP_FAILED;
+
+        delete[] buffers;
+        buffers = nullptr;
+    }
+
+    struct io_uring_sqe *UringTransport::get_sqe()
+    {
+        unsigned tail = *sq_tail;
+
+        /* Full: hand what is there to the kernel first, and if it took none (its completions backed up), wait on one */
+        /* until it does. Until then, the slot at the tail is one it hasn't read. */
+        for (unsigned wait = 0; tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries; wait = 1)
+            enter(wait);
+
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+
+        return sqe;
+    }
+
+    void UringTransport::enter(unsigned min_complete)
+    {
+        while (true)
+        {
+            unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+
+            if (ret >= 0)
+            {
+                to_submit -= std::min((unsigned) ret, to_submit);
+                return;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            /* Completions backed up: make room, and the caller will come around again. */
+            if (errno == EAGAIN || errno == EBUSY)
+            {
+                reap();
+                return;
+            }
+
+            uint8_t err = errno;
+            throw simpic_networking_exception("Error io_uring_enter(): " + std::string(std::strerror(err)), err);
+        }
+    }
+
+    void UringTransport::recycle(uint16_t bid)
+    {
+        struct io_uring_buf *buf = &buf_ring[buf_tail & (URING_BUFFERS - 1)];
+        buf->addr = (uint64_t)(buffers + (size_t) bid * URING_BUFFER_SIZE);
+        buf->len = URING_BUFFER_SIZE;
+        buf->bid = bid;
+
+        buf_tail++;
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+        available++;
+    }
+
+    void UringTransport::release(uint16_t bid)
+    {
+        if (--holds[bid] == 0)
+            recycle(bid);
+    }
+
+    void UringTransport::submit_send()
+    {
+        /* Whatever was gathered since goes out next, in one go. */
+        if (sent >= sending.size())
+        {
+            sending.clear();
+            sending.swap(outbound);
+            sent = 0;
+        }
+
+        if (sending.empty())
+            return;
+
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(sending.data() + sent);
+        sqe->len = sending.size() - sent;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = URING_TAG_SEND << 56;
+
+        send_in_flight = true;
+    }
+
+    void UringTransport::reap()
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            uint64_t tag = cqe->user_data >> 56;
+
+            if (tag == URING_TAG_RECV)
+            {
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                {
+                    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    available--;
+                    holds[bid] = 1;
+
+                    if (cqe->res > 0)
+                        received.push_back({bid, 0, (uint32_t) cqe->res});
+                    else
+                        release(bid);
+                }
+
+                if (cqe->res == 0)
+                    eof = true;
+
+                /* Out of buffers just means waiting for some to come back. */
+                else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+                    error = -cqe->res;
+
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    armed = false;
+            }
+
+            else if (tag == URING_TAG_SEND)
+            {
+                send_in_flight = false;
+
+                if (cqe->res < 0)
+                    error = -cqe->res;
+                else
+                    sent += cqe->res;
+            }
+
+            else if (tag == URING_TAG_WRITE)
+            {
+                uint16_t bid = (cqe->user_data >> 32) & 0xFFFF;
+                uint32_t expected = cqe->user_data & 0xFFFFFFFF;
+
+                writes_in_flight--;
+
+                if (cqe->res != (int32_t) expected && !write_error)
+                    write_error = cqe->res < 0 ? -cqe->res : EIO;
+
+                release(bid);
+            }
+
+            head++;
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        /* A short send, or more gathered while it was out. */
+        if (!send_in_flight && !error && (sent < sending.size() || !outbound.empty()))
+            submit_send();
+    }
+
+    void UringTransport::pump(bool wait)
+    {
+        if (!armed && !eof && !error && available > 0)
+        {
+            struct io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->user_data = URING_TAG_RECV << 56;
+
+            armed = true;
+        }
+
+        if (!send_in_flight && !outbound.empty())
+            submit_send();
+
+        if (to_submit || wait)
+            enter(wait ? 1 : 0);
+
+        reap();
+    }
+
+    bool UringTransport::want_data()
+    {
+        while (received.empty())
+        {
+            if (error)
+                throw simpic_networking_exception("Error receiving over io_uring: " + std::string(std::strerror(error)), error);
+
+            if (eof)
+                return false;
+
+            pump(true);
+        }
+
+        return true;
+    }
+
+    ssize_t UringTransport::receive(void *buffer, size_t length)
+    {
+        if (!want_data())
+            return 0;
+
+        Chunk &chunk = received.front();
+        size_t amnt = std::min(length, (size_t) chunk.length);
+        std::memcpy(buffer, buffers + (size_t) chunk.bid * URING_BUFFER_SIZE + chunk.offset, amnt);
+
+        chunk.offset += amnt;
+        chunk.length -= amnt;
+
+        if (!chunk.length)
+        {
+            uint16_t bid = chunk.bid;
+            received.pop_front();
+            release(bid);
+        }
+
+        return amnt;
+    }
+
+    void UringTransport::sendall(void *buffer, size_t length)
+    {
+        if (error)
+            throw simpic_networking_exception("Error sendall(): " + std::string(std::strerror(error)), error);
+
+        outbound.insert(outbound.end(), (char*) buffer, (char*) buffer + length);
+    }
+
+    void UringTransport::flush()
+    {
+        while (send_in_flight || !outbound.empty())
+        {
+            if (error)
+                throw simpic_networking_exception("Error sendall(): " + std::string(std::strerror(error)), error);
+
+            pump(true);
+        }
+    }
+
+    void UringTransport::receive_to(int out, off_t offset, uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        while (length && !write_error)
+        {
+            if (!want_data())
+                throw simpic_networking_exception("Error recvall(): " + std::string(std::strerror(ECONNRESET)), ECONNRESET);
+
+            Chunk &chunk = received.front();
+            uint32_t amnt = std::min(length, (uint64_t) chunk.length);
+            char *data = buffers + (size_t) chunk.bid * URING_BUFFER_SIZE + chunk.offset;
+
+            observe(data, amnt);
+
+            /* Written straight out of the buffer it was received into, which stays out of the ring until then. */
+            struct io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = out;
+            sqe->addr = (uint64_t) data;
+            sqe->len = amnt;
+            sqe->off = offset;
+            sqe->user_data = (URING_TAG_WRITE << 56) | ((uint64_t) chunk.bid << 32) | amnt;
+
+            holds[chunk.bid]++;
+            writes_in_flight++;
+
+            offset += amnt;
+            length -= amnt;
+            chunk.offset += amnt;
+            chunk.length -= amnt;
+
+            if (!chunk.length)
+            {
+                uint16_t bid = chunk.bid;
+                received.pop_front();
+                release(bid);
+            }
+        }
+
+        while (writes_in_flight)
+            pump(true);
+
+        if (write_error)
+        {
+            uint8_t err = write_error;
+            write_error = 0;
+            throw simpic_networking_exception("Error writing received data: " + std::string(std::strerror(err)), err);
+        }
+    }
+
+    void UringTransport::discard(uint64_t length, std::function<void(const char*, size_t)> observe)
+    {
+        while (length)
+        {
+            if (!want_data())
+                throw simpic_networking_exception("Error recvall(): " + std::string(std::strerror(ECONNRESET)), ECONNRESET);
+
+            Chunk &chunk = received.front();
+            uint32_t amnt = std::min(length, (uint64_t) chunk.length);
+
+            observe(buffers + (size_t) chunk.bid * URING_BUFFER_SIZE + chunk.offset, amnt);
+
+            length -= amnt;
+            chunk.offset += amnt;
+            chunk.length -= amnt;
+
+            if (!chunk.length)
+            {
+                uint16_t bid = chunk.bid;
+                received.pop_front();
+                release(bid);
+            }
+        }
+    }
+
+    Transport *open_transport(TransportKinds kind, int fd)
+    {
+        if (kind == TransportKinds::Uring)
+        {
+            try
+            {
+                return new UringTransport(fd);
+            }
+            catch (simpic_networking_exception &ex)
+            {
+                /* Old kernel, or io_uring disabled (kernel.io_uring_disabled, seccomp): fall back. */
+            }
+        }
+
+        return new SocketTransport(fd);
+    }
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <functional>
+
+#include <cstdint>
+
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "networking.hpp"
+
+/* The most a transport without buffers of its own holds of a body at once. */
+#define TRANSPORT_CHUNK_SIZE (1 << 20)
+
+/* Submission queue entries of an io_uring transport (completions get twice as many). */
+#define URING_ENTRIES 64
+
+/* The multishot receive lands in this many provided buffers (a power of two)... */
+#define URING_BUFFERS 64
+
+/* ...of this many bytes each. */
+#define URING_BUFFER_SIZE 65536
+
+namespace SimpicClientLib
+{
+    enum class TransportKinds
+    {
+        Socket, // a recv()/send() per message.
+        Uring, // io_uring: multishot receive into provided buffers, batched sends, bodies written straight from them.
+        Replay, // a capture file played back, with no server at all (see ReplayTransport).
+        Stream // one stream of a connection shared by several requests at once (see Multiplexer).
+    };
+
+    /* One logical client->server message (a request with its path and extensions, an action with its indices), */
+    /* assembled in one buffer so that it leaves in one send, and so in one segment. */
+    class OutboundMessage
+    {
+    public:
+        std::vector<char> buffer;
+
+        OutboundMessage &add(const void *data, size_t length);
+
+        /* A string, with its terminating NUL, as the protocol sends every path. */
+        OutboundMessage &add(const std::string &str);
+
+        /* A packed protocol structure, or a fixed-size integer. */
+        template <typename T>
+        OutboundMessage &add(const T &value)
+        {
+            return add(&value, sizeof(value));
+        }
+    };
+
+    /* Everything the client reads or writes on its connection goes through one of these. */
+    /* A transport is not thread-safe; it belongs to whichever thread is talking to the server. */
+    class Transport
+    {
+    public:
+        int fd;
+        TransportKinds kind;
+
+        Transport(int _fd, TransportKinds _kind);
+        virtual ~Transport();
+
+        /* Receive at most length bytes; returns how many, or <= 0 if the connection is gone. */
+        virtual ssize_t receive(void *buffer, size_t length) = 0;
+
+        /* Send all of buffer. It may only be queued, to go out with the next receive or flush(). */
+        virtual void sendall(void *buffer, size_t length) = 0;
+
+        /* Make sure everything given to sendall() is on its way. */
+        virtual void flush();
+
+        /* Send a whole message at once. */
+        void send(OutboundMessage &message);
+
+        /* While corked, messages are held back to be packed into full segments; uncorking sends what is left. */
+        /* For runs of messages that are known to follow each other (see SimpicClient::check()). */
+        virtual void cork(bool on);
+
+        /* Receive exactly length bytes, or throw simpic_networking_exception. */
+        void recvall(void *buffer, size_t length);
+
+        /* Receive length bytes into the file out at offset. observe sees each chunk first (to hash it, say). */
+        virtual void receive_to(int out, off_t offset, uint64_t length, std::function<void(const char*, size_t)> observe);
+
+        /* Receive length bytes and throw them away, after observe has seen them. */
+        virtual void discard(uint64_t length, std::function<void(const char*, size_t)> observe);
+    };
+
+    class SocketTransport : public Transport
+    {
+    public:
+        SocketTransport(int _fd);
+
+        ssize_t receive(void *buffer, size_t length);
+        void sendall(void *buffer, size_t length);
+        void cork(bool on);
+    };
+
+    /* The receive side is a single multishot recv that stays armed, filling buffers from a ring the kernel picks from; */
+    /* a buffer goes back into the ring once it has been read (or written out) in full. When the ring runs dry, the */
+    /* receive stops until buffers come back, which is the flow control. Sends are gathered and submitted together */
+    /* with whatever the next wait is for. Throws simpic_networking_exception if the kernel can't do any of it. */
+    class UringTransport : public Transport
+    {
+    private:
+        int ring_fd;
+
+        void *sq_ptr;
+        void *cq_ptr;
+        size_t sq_size;
+        size_t cq_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned sq_entries;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        unsigned to_submit;
+
+        /* The provided buffers, and the ring that hands them to the kernel. The ring is addressed as an array of */
+        /* io_uring_buf rather than through struct io_uring_buf_ring, whose flexible array lands 8 bytes off in C++; */
+        /* its tail is the resv field of the first entry. */
+        struct io_uring_buf *buf_ring;
+        size_t buf_ring_size;
+        char *buffers;
+        uint16_t buf_tail;
+
+        /* How many things (the receive queue, writes in flight) still use each buffer. */
+        std::vector<int> holds;
+        int available;
+
+        struct Chunk
+        {
+            uint16_t bid;
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        /* Received, in order, and not yet consumed. */
+        std::deque<Chunk> received;
+
+        bool armed;
+        bool eof;
+        int error;
+
+        /* What sendall() gathered, and what is being sent right now. */
+        std::vector<char> outbound;
+        std::vector<char> sending;
+        size_t sent;
+        bool send_in_flight;
+
+        int writes_in_flight;
+        int write_error;
+
+        struct io_uring_sqe *get_sqe();
+        void enter(unsigned min_complete);
+        void submit_send();
+        void recycle(uint16_t bid);
+        void release(uint16_t bid);
+        void reap();
+
+        /* Arm the receive and submit the sends if need be, then wait for at least one completion if wait. */
+        void pump(bool wait);
+
+        /* Block until there is something received; false at the end of the stream, and a throw on errors. */
+        bool want_data();
+
+        /* Cancel the receive and any send, and wait until nothing is in flight. */
+        void quiesce();
+        void teardown();
+
+    public:
+        UringTransport(int _fd);
+        ~UringTransport();
+
+        ssize_t receive(void *buffer, size_t length);
+        void sendall(void *buffer, size_t length);
+        void flush();
+        void receive_to(int out, off_t offset, uint64_t length, std::function<void(const char*, size_t)> observe);
+        void discard(uint64_t length, std::function<void(const char*, size_t)> observe);
+    };
+
+    /* A transport of the kind asked for over fd, or a SocketTransport if io_uring is not available. */
+    Transport *open_transport(TransportKinds kind, int fd);
+}
@@ -0,0 +1,144 @@
+#include "simpic_watch.hpp"
+#include "simpic_client.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+
+namespace SimpicClientLib
+{
+    DirectoryWatcher::DirectoryWatcher(std::string &root, bool _recursive)
+    {
+        recursive = _recursive;
+        ifd = inotify_init1(IN_CLOEXEC);
+
+        if (ifd < 0)
+            throw ErrnoException(errno);
+
+        add_watch(root, nullptr);
+    }
+
+    DirectoryWatcher::~DirectoryWatcher()
+    {
+        ::close(ifd);
+    }
+
+    void DirectoryWatcher::add_watch(const std::string &dir, std::vector<std::string> *found)
+    {
+        int wd = inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+
+        if (wd < 0)
+        {
+            /* The root has to be watchable; a subdirectory that vanished already doesn't matter. */
+            if (found == nullptr && watches.empty())
+                throw ErrnoException(errno);
+
+            return;
+        }
+
+        watches[wd] = dir;
+
+        DIR *d = opendir(dir.c_str());
+
+        if (d == nullptr)
+            return;
+
+        /* Files can land in a new directory before its watch exists: pick those up by hand. */
+        struct dirent *entry;
+
+        while ((entry = readdir(d)) != nullptr)
+        {
+            if (!std::strcmp(entry->d_name, ".") || !std::strcmp(entry->d_name, ".."))
+                continue;
+
+            std::string child = dir + "/" + entry->d_name;
+
+            if (entry->d_type == DT_DIR && recursive)
+                add_watch(child, found);
+            else if (entry->d_type == DT_REG && found != nullptr)
+                found->push_back(child);
+        }
+
+        closedir(d);
+    }
+
+    std::vector<std::string> DirectoryWatcher::next_batch(int debounce_ms, int max_batch_ms)
+    {
+        typedef std::chrono::steady_clock clock;
+
+        std::vector<std::string> batch;
+        std::unordered_set<std::string> seen;
+        clock::time_point first;
+
+        alignas(struct inotify_event) char buffer[64 * 1024];
+
+        while (true)
+        {
+            /* Nothing yet: wait as long as it takes. Otherwise, only until the batch is due. */
+            int wait = -1;
+
+            if (!batch.empty())
+            {
+                int age = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - first).count();
+                wait = std::max(0, std::min(debounce_ms, max_batch_ms - age));
+            }
+
+            struct pollfd pfd = {ifd, POLLIN, 0};
+            int ready = poll(&pfd, 1, wait);
+
+            if (ready < 0 && errno != EINTR)
+                throw ErrnoException(errno);
+
+            if (ready == 0)
+                return batch;
+
+            ssize_t len = read(ifd, buffer, sizeof(buffer));
+
+            if (len < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                throw ErrnoException(errno);
+            }
+
+            std::vector<std::string> landed;
+
+            for (char *ptr = buffer; ptr < buffer + len;)
+            {
+                struct inotify_event *ev = (struct inotify_event*) ptr;
+                ptr += sizeof(struct inotify_event) + ev->len;
+
+                if (!ev->len || !watches.count(ev->wd))
+                    continue;
+
+                std::string full = watches[ev->wd] + "/" + ev->name;
+
+                if (ev->mask & IN_ISDIR)
+                {
+                    if (recursive && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+                        add_watch(full, &landed);
+                }
+                else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                {
+                    landed.push_back(full);
+                }
+            }
+
+            for (std::string &path : landed)
+            {
+                if (!seen.insert(path).second)
+                    continue;
+
+                if (batch.empty())
+                    first = clock::now();
+
+                batch.push_back(path);
+            }
+        }
+    }
+}
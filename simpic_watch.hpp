@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <sys/inotify.h>
+
+/* A batch is handed out once no new file has landed for this long... */
+#define WATCH_DEBOUNCE_MS 500
+
+/* ...or once its first file has waited this long, whichever comes first. */
+#define WATCH_MAX_BATCH_MS 5000
+
+namespace SimpicClientLib
+{
+    /* Watches a directory (and, if recursive, every directory under it, including new ones) with inotify */
+    /* for files that were just finished: closed after writing, or moved in whole. */
+    class DirectoryWatcher
+    {
+    private:
+        int ifd;
+        bool recursive;
+
+        /* inotify watch descriptors to the directories they are on. */
+        std::unordered_map<int, std::string> watches;
+
+        void add_watch(const std::string &dir, std::vector<std::string> *found);
+    public:
+        DirectoryWatcher(std::string &root, bool _recursive);
+        ~DirectoryWatcher();
+
+        /* Block until at least one file lands, then collect more until things have been quiet for debounce_ms */
+        /* (or the batch is max_batch_ms old). Each path appears once per batch. */
+        std::vector<std::string> next_batch(int debounce_ms, int max_batch_ms);
+    };
+}
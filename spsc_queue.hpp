@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+namespace SimpicClientLib
+{
+    /* A bounded, lock-free, single-producer single-consumer ring. */
+    /* Exactly one thread may push() and exactly one (other) thread may pop(). */
+    template <typename T>
+    class SpscQueue
+    {
+    private:
+        std::vector<T> slots;
+        size_t mask;
+
+        /* Kept on separate cache lines, so the two threads don't fight over one. */
+        alignas(64) std::atomic<size_t> head; // next slot to pop, owned by the consumer.
+        alignas(64) std::atomic<size_t> tail; // next slot to push, owned by the producer.
+
+    public:
+        /* The capacity is rounded up to a power of two. */
+        SpscQueue(size_t capacity)
+        {
+            size_t size = 1;
+
+            while (size < capacity)
+                size <<= 1;
+
+            slots.resize(size);
+            mask = size - 1;
+
+            head = 0;
+            tail = 0;
+        }
+
+        /* Returns false if the queue is full. */
+        bool push(const T &item)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+
+            if (t - head.load(std::memory_order_acquire) == slots.size())
+                return false;
+
+            slots[t & mask] = item;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        /* Returns false if the queue is empty. */
+        bool pop(T &item)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+
+            item = slots[h & mask];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+    };
+}
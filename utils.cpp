@@ -1,5 +1,9 @@
 #include "utils.hpp"
 
+#include <random>
+
+#include <fcntl.h>
+
 namespace SimpicClientLib
 {
     /* Get the home folder on UNIX systems. */
@@ -56,7 +60,9 @@ namespace SimpicClientLib
 
         if (dir == nullptr)
         {
-            std::cerr << "Error with directory '" << where << "': " << std::strerror(errno) << std::endl;
+            if (print)
+                std::cerr << "Error with directory '" << where << "': " << std::strerror(errno) << std::endl;
+
             return false;
         }
 
@@ -92,22 +98,80 @@ namespace SimpicClientLib
     {
         std::string result;
         char bank[] = "qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM";
-        
+
+        /* Seeded per thread, so neither two processes nor two threads come up with the same names. */
+        thread_local std::mt19937 generator(std::random_device{}());
+        std::uniform_int_distribution<size_t> pick(0, sizeof(bank) - 2);
+
         for (int i = 0; i < amount; i++)
-            result += bank[rand() % sizeof(bank)];
-        
+            result += bank[pick(generator)];
+
         return result;
     }
 
+    int make_temporary(std::string &path, const std::string &suffix)
+    {
+        std::string name = path + "XXXXXX" + suffix;
+        int fd = mkostemps(name.data(), suffix.size(), O_CLOEXEC);
+
+        if (fd >= 0)
+            path = name;
+
+        return fd;
+    }
+
+    DataTypes guess_type(const std::string &path)
+    {
+        size_t dot = path.rfind('.');
+
+        if (dot == std::string::npos)
+            return DataTypes::Unspecified;
+
+        std::string ext = path.substr(dot + 1);
+
+        for (char &c : ext)
+            c = std::tolower(c);
+
+        for (const char *known : {"jpg", "jpeg", "png", "gif", "bmp", "tif", "tiff", "webp"})
+        {
+            if (ext == known)
+                return DataTypes::Image;
+        }
+
+        for (const char *known : {"mp4", "mkv", "avi", "mov", "webm", "m4v", "wmv", "flv"})
+        {
+            if (ext == known)
+                return DataTypes::Video;
+        }
+
+        for (const char *known : {"mp3", "flac", "wav", "ogg", "m4a", "aac", "opus"})
+        {
+            if (ext == known)
+                return DataTypes::Audio;
+        }
+
+        for (const char *known : {"txt", "md", "csv", "log"})
+        {
+            if (ext == known)
+                return DataTypes::Text;
+        }
+
+        return DataTypes::Unspecified;
+    }
+
     std::string sha256digest2string(char *digest)
     {
-        std::stringstream stream;
+        static const char hex[] = "0123456789ABCDEF";
+        std::string result(SHA256_DIGEST_LENGTH * 2, '0');
 
+        /* Two table lookups per byte, straight into the string. */
         for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
         {
-            stream << std::uppercase << std::hex << digest[i];
+            uint8_t byte = digest[i];
+            result[2 * i] = hex[byte >> 4];
+            result[2 * i + 1] = hex[byte & 0x0F];
         }
 
-        return stream.str();
+        return result;
     }
 }
\ No newline at end of file
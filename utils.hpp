@@ -2,7 +2,6 @@
 
 #include <iostream>
 #include <string>
-#include <sstream>
 
 #include <unistd.h>
 #include <dirent.h>
@@ -16,6 +15,8 @@
 
 #include <ctime>
 
+#include "simpic_protocol.hpp"
+
 namespace SimpicClientLib
 {
     std::string home_folder();
@@ -29,6 +30,13 @@ namespace SimpicClientLib
     void mkdir_dir(std::string &where);
     std::string random_chars(uint8_t amount);
 
+    /* Create a file of its own (mode 0600) at path followed by six random characters and suffix, which path is */
+    /* set to; returns it open for writing, or -1 with errno set. */
+    int make_temporary(std::string &path, const std::string &suffix = "");
+
 
     std::string sha256digest2string(char *digest);
+
+    /* Guess what kind of media a file is from its extension; DataTypes::Unspecified if it can't be told. */
+    DataTypes guess_type(const std::string &path);
 }
\ No newline at end of file